@@ -0,0 +1,29 @@
+/***********************************************************************
+
+ std::atomic and std::this_thread::yield for the msaFluid threads
+
+ VS2010 ships no <atomic>. Like cinder/Thread.h does with the boost thread
+ and mutex types below VS2012, boost.atomic, which has the same interface,
+ is promoted into std there.
+
+ ***********************************************************************/
+
+#pragma once
+
+#if defined( _MSC_VER ) && ( _MSC_VER < 1700 )
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace std {
+	using boost::atomic;
+	using boost::memory_order_relaxed;
+	using boost::memory_order_acquire;
+	using boost::memory_order_release;
+	using boost::memory_order_acq_rel;
+	namespace this_thread {
+		using boost::this_thread::yield;
+	}
+}
+#else
+#include <atomic>
+#endif
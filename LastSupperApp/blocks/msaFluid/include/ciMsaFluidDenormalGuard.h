@@ -0,0 +1,77 @@
+/***********************************************************************
+
+ Scoped flush-to-zero / denormals-are-zero mode of the calling thread
+
+ Decaying fields (the fade of the dye and the velocity) slowly run into
+ denormal floats, which are many times slower on most cpus. With FTZ/DAZ set
+ the hardware treats them as zero, so the solver does not have to flush small
+ values per element. The mode is per thread: the guard sets it on construction
+ and restores the previous mode on destruction.
+
+ Without SSE (the mode lives in the MXCSR register) the guard does nothing and
+ isSupported() returns false.
+
+ ***********************************************************************/
+
+#pragma once
+
+#if defined( __SSE__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 )
+#include <xmmintrin.h>
+#define FLUID_DENORMAL_MXCSR
+#endif
+
+// flush-to-zero (bit 15) and denormals-are-zero (bit 6) of the MXCSR
+#define		FLUID_MXCSR_FTZ_DAZ		0x8040
+
+class ciMsaFluidDenormalGuard {
+public:
+	explicit ciMsaFluidDenormalGuard( bool enable = true )
+	:_enabled(false)
+	,_saved(0)
+	{
+#ifdef FLUID_DENORMAL_MXCSR
+		if ( enable )
+		{
+			_saved = _mm_getcsr();
+			_mm_setcsr( _saved | FLUID_MXCSR_FTZ_DAZ );
+			_enabled = true;
+		}
+#else
+		(void)enable;
+#endif
+	}
+
+	~ciMsaFluidDenormalGuard()
+	{
+#ifdef FLUID_DENORMAL_MXCSR
+		if ( _enabled )
+			_mm_setcsr( _saved );
+#endif
+	}
+
+	static bool isSupported()
+	{
+#ifdef FLUID_DENORMAL_MXCSR
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// true if the calling thread flushes denormals
+	static bool isActive()
+	{
+#ifdef FLUID_DENORMAL_MXCSR
+		return ( _mm_getcsr() & FLUID_MXCSR_FTZ_DAZ ) == FLUID_MXCSR_FTZ_DAZ;
+#else
+		return false;
+#endif
+	}
+
+private:
+	bool		_enabled;
+	unsigned	_saved;
+
+	ciMsaFluidDenormalGuard( const ciMsaFluidDenormalGuard & );
+	ciMsaFluidDenormalGuard &operator=( const ciMsaFluidDenormalGuard & );
+};
@@ -0,0 +1,52 @@
+/***********************************************************************
+
+ Checks that a ciMsaFluidSolver gives the same fields for any number of threads
+
+ run() sets up one solver per thread count with the same configuration and
+ the deterministic mode, steps every solver with the same scripted forces
+ and colors and compares the hashes of the fields after the last step.
+ test/src/FluidDeterminismTest.cpp runs it headless.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "ciMsaFluidSolver.h"
+
+#define		FLUID_DETERMINISM_CHECK_STEPS			60
+
+// forces and colors added before every step
+#define		FLUID_DETERMINISM_CHECK_INJECTIONS		64
+
+class ciMsaFluidDeterminismCheck {
+public:
+	ciMsaFluidDeterminismCheck();
+
+	// 1, 2, 4 and 8 by default
+	void	setThreadCounts( const std::vector< int > &threadCounts )	{ _threadCounts = threadCounts; }
+	void	setSteps( int steps = FLUID_DETERMINISM_CHECK_STEPS )		{ _steps = steps; }
+	// the solvers run with ciMsaFluidSolver::enableDeterministic( b ), true by default
+	void	enableDeterministic( bool b )		{ _deterministic = b; }
+
+	// configure is called with every solver after its setup, before the thread count is set.
+	// returns true if all hashes are equal
+	bool	run( int NX, int NY, const std::function< void ( ciMsaFluidSolver & ) > &configure );
+
+	bool		hasPassed() const					{ return _passed; }
+	int			getNumRuns() const					{ return (int)_hashes.size(); }
+	int			getThreadCount( int run ) const		{ return _threadCounts[run]; }
+	uint64_t	getHash( int run ) const			{ return _hashes[run]; }
+
+protected:
+	std::vector< int >		_threadCounts;
+	std::vector< uint64_t >	_hashes;
+	int		_steps;
+	bool	_deterministic;
+	bool	_passed;
+
+	void	inject( ciMsaFluidSolver &solver, int step ) const;
+};
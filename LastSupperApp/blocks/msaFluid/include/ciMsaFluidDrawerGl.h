@@ -37,6 +37,7 @@
 
 #pragma once
 #include "cinder/gl/Texture.h"
+#include "ciMsaFluidSnapshot.h"
 #include "ciMsaFluidSolver.h"
 
 #define FLUID_DRAW_COLOR		0
@@ -60,6 +61,13 @@ class ciMsaFluidDrawerGl {
 	ciMsaFluidSolver* setup(ciMsaFluidSolver* f);
 	ciMsaFluidSolver* getFluidSolver();
 	
+	// while set the draw functions read the snapshot instead of the solver, which may be stepped on another thread.
+	// the texture follows the size of the snapshot, which may lag a resize of the solver by a step
+	void setSnapshot(const ciMsaFluidSnapshot* snapshot);
+	
+	// drawColor draws the dye grid of the solver, the other modes the velocity grid.
+	// the texture is resized when the grid of the mode differs from the last one drawn
+	
 	void enableAlpha(bool b);
 	
 	void update();
@@ -106,8 +114,16 @@ protected:
 	
 	ciMsaFluidSolver	*_fluidSolver;
 	bool				_didICreateTheFluid;
+	const ciMsaFluidSnapshot	*_snapshot;
+	
+	// the planes of the snapshot or the solver, the draw functions stream them row by row
+	ciMsaFluidFieldView getFieldView() const {
+		return _snapshot ? _snapshot->getFieldView() : _fluidSolver->getFieldView();
+	}
 	
 	virtual void		createTexture();
+	void				allocateTexture(int texWidth, int texHeight);
+	void				prepareTexture(int texWidth, int texHeight);	// recreates the texture if the size differs
 	
 	void deleteFluidSolver();
 	bool isFluidReady();
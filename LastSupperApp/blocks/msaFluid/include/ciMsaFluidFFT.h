@@ -0,0 +1,70 @@
+/***********************************************************************
+
+ Self contained mixed radix FFT (radix 4, 2 and generic odd factors, any size)
+ and an exact periodic solver for the cell centered 5-point systems of ciMsaFluidSolver
+
+	alpha * x + beta * ( 4 * x - sum of the 4 neighbours of x ) = b
+
+ With both wrap_x and wrap_y the pressure equation in ciMsaFluidSolver::project() is fully
+ periodic, the 5-point operator is diagonal in the Fourier basis and can be inverted exactly
+ with a 2D real FFT in O(N log N).
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <complex>
+#include <vector>
+
+typedef std::complex< float > ciMsaFluidComplex;
+
+class ciMsaFluidFFT {
+public:
+	ciMsaFluidFFT();
+
+	void	setup( int n );
+	int		getSize() const		{ return _n; }
+
+	// out of place, unnormalized transforms of n contiguous elements
+	void	forward( const ciMsaFluidComplex *in, ciMsaFluidComplex *out ) const;
+	void	inverse( const ciMsaFluidComplex *in, ciMsaFluidComplex *out ) const;
+
+protected:
+	int		_n;
+	std::vector< int > _factors;					// radix, remaining length pairs
+	std::vector< ciMsaFluidComplex > _twiddles;
+	std::vector< ciMsaFluidComplex > _twiddlesInv;
+	mutable std::vector< ciMsaFluidComplex > _scratch;
+
+	void	work( ciMsaFluidComplex *out, const ciMsaFluidComplex *in, int fstride,
+				const int *factors, const ciMsaFluidComplex *tw, bool inv ) const;
+	void	butterfly2( ciMsaFluidComplex *out, int fstride, int m, const ciMsaFluidComplex *tw ) const;
+	void	butterfly4( ciMsaFluidComplex *out, int fstride, int m, const ciMsaFluidComplex *tw, bool inv ) const;
+	void	butterflyGeneric( ciMsaFluidComplex *out, int fstride, int m, int p, const ciMsaFluidComplex *tw ) const;
+};
+
+class ciMsaFluidSpectralSolver {
+public:
+	ciMsaFluidSpectralSolver();
+
+	// allocate plans and buffers for a periodic NX * NY interior
+	void	setup( int NX, int NY );
+
+	// (NX + 2) * (NY + 2) floats laid out like FLUID_IX, ghost cells are filled periodically after solve()
+	float*	getSolution()	{ return &_x[0]; }
+	float*	getRhs()		{ return &_b[0]; }
+
+	// exact solve, the mean of the solution is zero if alpha = 0
+	void	solve( float alpha, float beta );
+
+protected:
+	int		_NX, _NY, _halfNX;
+
+	ciMsaFluidFFT _fftX, _fftY;
+
+	std::vector< float > _x, _b;
+	std::vector< float > _cosX, _cosY;					// 2 - 2 * cos( 2 pi k / N ) eigenvalue terms
+	std::vector< ciMsaFluidComplex > _spectrum;			// ( NX / 2 + 1 ) * NY half spectrum, row major
+	std::vector< ciMsaFluidComplex > _row, _rowOut;
+	std::vector< ciMsaFluidComplex > _col, _colOut;
+};
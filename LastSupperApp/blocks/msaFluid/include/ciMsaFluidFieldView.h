@@ -0,0 +1,82 @@
+/***********************************************************************
+
+ Read-only view of the velocity and dye planes of a solver or a snapshot
+
+ The planes keep one ghost (boundary) cell on every side: interior cell
+ (i, j), 1 <= i <= NX, 1 <= j <= NY, is at i + stride * j, so a row starts
+ with its ghost cell at row(j)[0]. The velocity is stored in normalized units
+ times the grid size, multiply by velocityScale for the normalized velocity
+ that getInfoAtCell returns. The dye planes are on the dye grid. In
+ monochrome mode g and b point at r, so a consumer can stream three planes
+ without checking the color mode.
+
+ The pointers stay valid until the next update(), setSize(), setDyeScale()
+ or enableRGB() of the solver, or the next capture() of the snapshot.
+ getVelocitiesAtPos() samples with the kernels of the solver, NULL for the
+ scalar loop.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include "cinder/CinderMath.h"
+#include "cinder/Vector.h"
+
+#include "ciMsaFluidKernels.h"
+
+struct ciMsaFluidFieldView {
+	const float	*u, *v;
+	const float	*r, *g, *b;
+	int			NX, NY, stride;
+	int			dyeNX, dyeNY, dyeStride, dyeScale;
+	ci::Vec2f	velocityScale;			// 1 / NX, 1 / NY
+	bool		isRGB;
+	const ciMsaFluidKernels	*kernels;
+
+	ciMsaFluidFieldView()
+	:u(NULL), v(NULL), r(NULL), g(NULL), b(NULL)
+	,NX(0), NY(0), stride(0)
+	,dyeNX(0), dyeNY(0), dyeStride(0), dyeScale(1)
+	,velocityScale(0, 0)
+	,isRGB(false)
+	,kernels(NULL)
+	{}
+
+	bool isValid() const { return u != NULL; }
+
+	// rows including the ghost cells, j in 0..NY+1 (0..dyeNY+1)
+	const float *uRow( int j ) const	{ return u + stride * j; }
+	const float *vRow( int j ) const	{ return v + stride * j; }
+	const float *rRow( int j ) const	{ return r + dyeStride * j; }
+	const float *gRow( int j ) const	{ return g + dyeStride * j; }
+	const float *bRow( int j ) const	{ return b + dyeStride * j; }
+
+	// unscaled velocity of the cell at normalized (x, y), the same as getVelocityAtPos of the solver
+	ci::Vec2f getVelocityAtPos( const ci::Vec2f &pos ) const {
+		int i = ci::constrain<int>( (int)(pos.x * (NX+2)), 0, NX+1 );
+		int j = ci::constrain<int>( (int)(pos.y * (NY+2)), 0, NY+1 );
+		int o = i + stride * j;
+		return ci::Vec2f( u[o], v[o] );
+	}
+
+	// unscaled velocities at count normalized positions (x[k], y[k]), bilinearly interpolated between the cell centers.
+	// cell i is centered at ( i - 0.5 ) / NX like for addForceAtPos, positions outside the grid are clamped to the
+	// centers of the ghost cells
+	void getVelocitiesAtPos( const float *x, const float *y, float *velX, float *velY, int count ) const {
+		if(kernels) {
+			kernels->sampleBilinear( u, v, NX, NY, stride, x, y, velX, velY, count );
+			return;
+		}
+		for(int k = 0; k < count; k++) {
+			float fx = ci::constrain( x[k] * NX + 0.5f, 0.0f, NX + 1.0f );
+			float fy = ci::constrain( y[k] * NY + 0.5f, 0.0f, NY + 1.0f );
+			int i0 = ci::math<int>::min( (int)fx, NX );
+			int j0 = ci::math<int>::min( (int)fy, NY );
+			float s1 = fx - i0;
+			float t1 = fy - j0;
+			int o = i0 + stride * j0;
+			velX[k] = ( 1 - s1 ) * ( ( 1 - t1 ) * u[o] + t1 * u[o + stride] ) + s1 * ( ( 1 - t1 ) * u[o + 1] + t1 * u[o + stride + 1] );
+			velY[k] = ( 1 - s1 ) * ( ( 1 - t1 ) * v[o] + t1 * v[o + stride] ) + s1 * ( ( 1 - t1 ) * v[o + 1] + t1 * v[o + stride + 1] );
+		}
+	}
+};
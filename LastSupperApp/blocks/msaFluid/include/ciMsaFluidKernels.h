@@ -0,0 +1,85 @@
+/***********************************************************************
+
+ Vectorized inner loops of ciMsaFluidSolver (SSE2 and AVX2), selected at runtime by CPUID.
+ The original scalar loops in ciMsaFluidSolver stay as the reference path (FLUID_SIMD_NONE).
+
+ Fields are planes of floats with a padded row stride.
+ The iterative solvers use red-black ordering: relaxRow updates the cells of one
+ color only, so the result does not depend on the vector width.
+
+ ***********************************************************************/
+
+#pragma once
+
+#define		FLUID_SIMD_NONE			0
+#define		FLUID_SIMD_SSE2			1
+#define		FLUID_SIMD_AVX2			2
+
+// widest vector used by the kernels, relaxRow masks are this long
+#define		FLUID_SIMD_MAX_WIDTH	8
+
+// u, v and three dye planes
+#define		FLUID_MAX_ADVECT_FIELDS	5
+
+struct ciMsaFluidAdvectArgs {
+	const float	*du, *dv;				// velocity to trace back along
+	int			numFields;				// 1..FLUID_MAX_ADVECT_FIELDS advected fields
+	float		*dst[FLUID_MAX_ADVECT_FIELDS];
+	const float	*src[FLUID_MAX_ADVECT_FIELDS];
+	float		dt0x, dt0y;
+	float		minX, maxX, minY, maxY;	// the traced back positions are clamped to these, 0.5 and NX + 0.5 for the whole grid
+	int			stride;					// row stride in floats
+};
+
+struct ciMsaFluidKernels {
+	int		simdLevel;
+
+	// x[i] += dt * x0[i] for n floats
+	void	(*addSource)( float *x, const float *x0, float dt, int n );
+
+	// x[f] = ( ( x[f-1] + x[f+1] + x[f-rowStep] + x[f+rowStep] ) * a + x0[f] ) * c
+	// for the floats f in [begin, begin + count) enabled in mask,
+	// mask[k] is 0 or all bits set for the float begin + k, repeating every FLUID_SIMD_MAX_WIDTH floats
+	void	(*relaxRow)( float *x, const float *x0, int begin, int count, int rowStep,
+						float a, float c, const float *mask );
+
+	// accumulates r^2 and x0^2 for the floats f in [begin, begin + count),
+	// r = x0[f] + ( x[f-1] + x[f+1] + x[f-rowStep] + x[f+rowStep] ) * a - diag * x[f] is the residual of the relaxation
+	void	(*residualRow)( const float *x, const float *x0, int begin, int count, int rowStep,
+						float a, float diag, double *sumResidual2, double *sumRhs2 );
+
+	// semi-lagrangian advection of the cells [i0, i1) of row j for all fields in args
+	void	(*advectRow)( const ciMsaFluidAdvectArgs &args, int j, int i0, int i1 );
+
+	// clamps up to 3 color planes to 1 and multiplies by holdAmount, clears the old planes.
+	// with flush values below the zero threshold are set to 0
+	void	(*fadeDye)( float **x, float **xOld, int numPlanes, int n, float holdAmount, bool flush );
+
+	// clears xOld for n floats, with flush values of x below the zero threshold are set to 0
+	void	(*fadeVelocity)( float *x, float *xOld, int n, bool flush );
+
+	// flushes values below the zero threshold to 0
+	void	(*flushZero)( float *x, int n );
+
+	// tileMax[k] = max( tileMax[k], |x[i]| ) for the floats i in [k * tileSize, (k + 1) * tileSize) of the n floats
+	void	(*tileMax)( const float *x, int n, int tileSize, float *tileMax );
+
+	// w[i] = ( u[i+stride] - u[i-stride] - v[i+1] + v[i-1] ) * 0.5 for n floats, the signed curl
+	void	(*curlRow)( const float *u, const float *v, float *w, int n, int stride );
+
+	// vorticity confinement force of n cells from the signed curl of their row and of the rows below and above,
+	// f = N x w with N the normalized gradient of |w|. the normalization uses a reciprocal square root estimate
+	// refined by one newton step
+	void	(*vorticityRow)( const float *wDown, const float *w, const float *wUp, float *fx, float *fy, int n );
+
+	// bilinear samples of u and v at n normalized positions (x[k], y[k]), see ciMsaFluidFieldView::getVelocitiesAtPos
+	void	(*sampleBilinear)( const float *u, const float *v, int NX, int NY, int stride,
+						const float *x, const float *y, float *outU, float *outV, int n );
+
+	// returns the kernels for the requested level, clamped to what the cpu supports,
+	// NULL for FLUID_SIMD_NONE
+	static const ciMsaFluidKernels* get( int simdLevel );
+
+	// highest level supported by the cpu and the compiler
+	static int	detectSimdLevel();
+};
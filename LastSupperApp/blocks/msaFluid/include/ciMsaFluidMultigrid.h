@@ -0,0 +1,74 @@
+/***********************************************************************
+
+ Geometric multigrid V-cycle solver for the cell centered 5-point systems of ciMsaFluidSolver
+
+	alpha * x + beta * ( 4 * x - sum of the 4 neighbours of x ) = b
+
+ on an NX * NY interior surrounded by one ghost cell, using the same layout as FLUID_IX.
+ alpha = 0, beta = 1 is the pressure Poisson equation solved in ciMsaFluidSolver::project(),
+ alpha = 1, beta = a the implicit diffusion step of ciMsaFluidSolver::diffuse().
+
+ The grid is coarsened by 2 in both directions as long as both dimensions are even,
+ so sizes with a large power of two factor (e.g. 256x192, 320x240) get the deepest hierarchy.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <vector>
+
+#define		FLUID_MULTIGRID_PRE_SWEEPS			2
+#define		FLUID_MULTIGRID_POST_SWEEPS			2
+#define		FLUID_MULTIGRID_COARSE_SWEEPS		32
+#define		FLUID_MULTIGRID_MIN_SIZE			4
+
+class ciMsaFluidMultigrid {
+public:
+	ciMsaFluidMultigrid();
+
+	// allocate the level hierarchy for an NX * NY interior
+	void	setup( int NX, int NY );
+
+	// boundary handling, matches ciMsaFluidSolver::setWrap
+	// non-wrapped sides use zero gradient (copy) ghost cells
+	void	setWrap( bool bx, bool by );
+
+	// b as in ciMsaFluidSolver::setBoundary: 1 negates the ghost cells of the non-wrapped left and right sides,
+	// 2 those of the top and bottom sides (the velocity components). 0, zero gradient everywhere, by default
+	void	setBoundaryType( int b );
+
+	// finest level buffers, (NX + 2) * (NY + 2) floats laid out like FLUID_IX
+	// fill the solution with the initial guess and the rhs before calling solve()
+	float*	getSolution()	{ return &_levels[0].x[0]; }
+	float*	getRhs()		{ return &_levels[0].b[0]; }
+
+	// run V-cycles until the rms residual falls below tolerance * rms(rhs) or maxCycles is reached
+	// returns the number of cycles run
+	int		solve( float alpha, float beta, float tolerance, int maxCycles );
+
+	// relative rms residual after the last solve
+	float	getResidual() const		{ return _residual; }
+
+	int		getNumLevels() const	{ return (int)_levels.size(); }
+
+protected:
+	struct Level {
+		int		nx, ny, stride;
+		std::vector< float > x, b, r;
+	};
+
+	std::vector< Level > _levels;
+
+	bool	wrap_x;
+	bool	wrap_y;
+	int		_boundaryType;
+	float	_residual;
+
+	void	setBoundary( Level &l, std::vector< float > &x );
+	void	smooth( Level &l, float alpha, float beta, int sweeps );
+	float	calcResidual( Level &l, float alpha, float beta );
+	void	restrictResidual( const Level &fine, Level &coarse );
+	void	prolongate( const Level &coarse, Level &fine );
+	void	removeMean( Level &l, std::vector< float > &x );
+	void	vCycle( int level, float alpha, float beta );
+};
@@ -0,0 +1,142 @@
+/***********************************************************************
+
+ Runs a ciMsaFluidSolver on its own thread at a fixed step rate
+
+ The simulation no longer waits for the render loop. Forces and colors are
+ passed in through lock-free single producer, single consumer queues and
+ applied before the next step. After every step the velocity and color are
+ copied into a ciMsaFluidSnapshot and published through a triple buffer.
+ The reader takes the latest snapshot without locking and the snapshot stays
+ unchanged until the reader's next acquireSnapshot(), so the drawer and the
+ particles of one frame see the same step.
+
+ While the thread runs the solver belongs to it, parameters are changed
+ through configure(), which is applied on the simulation thread before the
+ next step.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cinder/Color.h"
+#include "cinder/Thread.h"
+#include "cinder/Vector.h"
+
+#include "ciMsaFluidAtomic.h"
+#include "ciMsaFluidSnapshot.h"
+#include "ciMsaFluidSolver.h"
+
+// injections the queue holds by default, see setQueueSize()
+#define		FLUID_SIM_DEFAULT_QUEUE_SIZE	16384
+
+// force fields the field queue holds, power of 2
+#define		FLUID_SIM_FIELD_QUEUE_SIZE		4
+
+#define		FLUID_SIM_DEFAULT_RATE			60.0f
+
+// after falling behind by more steps than this, e.g. when the process was suspended,
+// the thread skips the missed steps instead of running them back to back
+#define		FLUID_SIM_MAX_CATCHUP_STEPS		4
+
+class ciMsaFluidSimThread {
+public:
+	ciMsaFluidSimThread();
+	~ciMsaFluidSimThread();
+
+	// starts stepping the solver, which has to be set up. it must not be used directly until stop()
+	void	start( ciMsaFluidSolver *solver, float stepsPerSecond = FLUID_SIM_DEFAULT_RATE );
+	void	stop();
+	bool	isRunning() const				{ return _thread != NULL; }
+
+	void	setRate( float stepsPerSecond );
+	float	getRate() const					{ return _rate; }
+
+	// the injections queued between two steps, rounded up to a power of 2. it should hold one force and
+	// one color per cell of the largest grid injected per frame. takes effect on the next start()
+	void	setQueueSize( int injections );
+	int		getQueueSize() const			{ return (int)_queue.size(); }
+
+	// queued for the next step, return false if the queue is full and the injection is dropped.
+	// one producer thread
+	bool	addForceAtPos( const ci::Vec2f &pos, const ci::Vec2f &force );
+	bool	addColorAtPos( const ci::Vec2f &pos, const ci::Color &color );
+	// copies the field for ciMsaFluidSolver::addForceField()
+	bool	addForceField( const float *field, int width, int height, int fieldStride, const ci::Rectf &rect,
+						   const ci::Vec2f &scale, float minLength2, float colorAmount, bool bilinear = false );
+
+	// apply is called with the solver on the simulation thread before the next step,
+	// a newer configuration replaces one that has not been applied yet
+	void	configure( const std::function< void ( ciMsaFluidSolver & ) > &apply );
+
+	// clears the solver before the next step
+	void	reset()							{ _resetPending = true; }
+
+	// ciMsaFluidSolver::saveState() / loadState() on the simulation thread before the next step, a load follows a pending reset
+	void	saveState( const std::string &path );
+	void	loadState( const std::string &path );
+
+	// latest published snapshot, valid and unchanged until the next call. one consumer thread
+	const ciMsaFluidSnapshot*	acquireSnapshot();
+
+	int		getStepCount() const			{ return _stepCount; }
+	int		getSkippedSteps() const			{ return _skippedSteps; }
+	int		getDroppedInjections() const	{ return _droppedInjections; }
+
+protected:
+	struct Injection {
+		ci::Vec2f	pos;
+		ci::Vec3f	value;		// force in xy or color
+		bool		isForce;
+	};
+
+	struct FieldInjection {
+		std::vector< float >	field;		// width x height interleaved vectors without padding
+		int			width, height;
+		ci::Rectf	rect;
+		ci::Vec2f	scale;
+		float		minLength2;
+		float		colorAmount;
+		bool		bilinear;
+	};
+
+	ciMsaFluidSolver	*_solver;
+	std::shared_ptr< std::thread >	_thread;
+	std::atomic< bool >		_stop;
+	std::atomic< float >	_rate;
+
+	// the producer only writes _queueTail, the consumer only _queueHead
+	std::vector< Injection >	_queue;		// power of 2 size
+	unsigned					_queueMask;
+	std::atomic< unsigned >		_queueHead, _queueTail;
+	std::atomic< int >			_droppedInjections;
+
+	// same scheme, the vectors of the slots keep their capacity
+	std::vector< FieldInjection >	_fieldQueue;
+	std::atomic< unsigned >		_fieldQueueHead, _fieldQueueTail;
+
+	std::mutex	_configMutex;
+	std::function< void ( ciMsaFluidSolver & ) >	_config;
+	std::string		_savePath, _loadPath;		// empty if none is pending
+	std::atomic< bool >		_resetPending;
+
+	// _ready holds the index of the latest snapshot and FLUID_SIM_SNAPSHOT_NEW if the reader has not taken it yet,
+	// _back is only used by the simulation thread and _front by the reader
+	ciMsaFluidSnapshot		_snapshots[3];
+	std::atomic< int >		_ready;
+	int		_back, _front;
+
+	std::atomic< int >		_stepCount;
+	std::atomic< int >		_skippedSteps;
+
+	bool	push( const Injection &injection );
+	void	applyInjections();
+	void	applyPending();
+	void	step();
+	void	publish();
+	void	threadLoop();
+};
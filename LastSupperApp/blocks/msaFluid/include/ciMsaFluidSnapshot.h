@@ -0,0 +1,102 @@
+/***********************************************************************
+
+ Immutable copy of the velocity and color of a ciMsaFluidSolver step
+
+ ciMsaFluidSimThread publishes one after every step. The readers (the drawer,
+ the particles) sample the copy with the same accessors as the solver, so they
+ never touch the planes the simulation thread is writing.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <vector>
+
+#include "cinder/Color.h"
+#include "cinder/Vector.h"
+
+#include "ciMsaFluidSolver.h"
+
+class ciMsaFluidSnapshot {
+public:
+	ciMsaFluidSnapshot();
+
+	// copies the fields and the statistics of the last update() of the solver
+	void capture( const ciMsaFluidSolver &solver, int step );
+
+	// false until the first capture
+	bool isValid() const			{ return _NX > 0; }
+
+	// same layout as the solver, including the boundary cells
+	int getWidth() const			{ return _NX + 2; }
+	int getHeight() const			{ return _NY + 2; }
+	int getDyeWidth() const			{ return _dyeNX + 2; }
+	int getDyeHeight() const		{ return _dyeNY + 2; }
+
+	// number of solver steps done before the capture
+	int getStep() const				{ return _step; }
+
+	inline ci::Vec2f getVelocityAtPos( const ci::Vec2f &pos ) const;
+	inline void getInfoAtCell( int i, int j, ci::Vec2f *vel, ci::Color *color = NULL ) const;
+	inline void getDyeAtCell( int i, int j, ci::Color *color ) const;
+
+	// the copied planes in place, valid until the next capture()
+	ciMsaFluidFieldView getFieldView() const;
+
+	float getAvgDensity() const		{ return _avgDensity; }
+	float getAvgSpeed() const		{ return _avgSpeed; }
+	int getNumActiveTiles() const	{ return _numActiveTiles; }
+	int getFrameIterations() const	{ return _frameIterations; }
+	float getFrameResidual() const	{ return _frameResidual; }
+	float getStageSpeedup( int stage ) const { return _stageCounters[ stage ].speedup; }
+	ciMsaFluidStageCounters getStageCounters( int stage ) const { return _stageCounters[ stage ]; }
+
+protected:
+	int		_NX, _NY, _stride;
+	float	_invNX, _invNY;
+	int		_dyeNX, _dyeNY, _dyeStride, _dyeScale;		// the color planes are on the dye grid
+	bool	_isRGB;
+	const ciMsaFluidKernels	*_kernels;		// the sampling kernels of the solver
+	int		_step;
+
+	std::vector< float >	_u, _v, _r, _g, _b;
+
+	float	_avgDensity, _avgSpeed;
+	int		_numActiveTiles;
+	int		_frameIterations;
+	float	_frameResidual;
+	ciMsaFluidStageCounters	_stageCounters[FLUID_STAGE_COUNT];
+};
+
+inline ci::Vec2f ciMsaFluidSnapshot::getVelocityAtPos( const ci::Vec2f &pos ) const {
+	int i = (int)(pos.x * (_NX+2));
+	int j = (int)(pos.y * (_NY+2));
+	i = ci::constrain<int>( i, 0, _NX+1 );
+	j = ci::constrain<int>( j, 0, _NY+1 );
+	int o = i + _stride * j;
+	return ci::Vec2f( _u[o], _v[o] );
+}
+
+inline void ciMsaFluidSnapshot::getInfoAtCell( int i, int j, ci::Vec2f *vel, ci::Color *color ) const {
+	if(i<0) i = 0; else if(i > _NX+1) i = _NX+1;
+	if(j<0) j = 0; else if(j > _NY+1) j = _NY+1;
+	int o = i + _stride * j;
+	if(vel)
+		vel->set(_u[o] * _invNX, _v[o] * _invNY);
+	if(color)
+	{
+		// center of the dye cells covering the cell
+		int half = _dyeScale / 2;
+		getDyeAtCell( ( i - 1 ) * _dyeScale + 1 + half, ( j - 1 ) * _dyeScale + 1 + half, color );
+	}
+}
+
+inline void ciMsaFluidSnapshot::getDyeAtCell( int i, int j, ci::Color *color ) const {
+	if(i<0) i = 0; else if(i > _dyeNX+1) i = _dyeNX+1;
+	if(j<0) j = 0; else if(j > _dyeNY+1) j = _dyeNY+1;
+	int o = i + _dyeStride * j;
+	if(_isRGB)
+		color->set( ci::CM_RGB, ci::Vec3f( _r[o], _g[o], _b[o] ) );
+	else
+		color->set( ci::CM_RGB, ci::Vec3f( _r[o], _r[o], _r[o] ) );
+}
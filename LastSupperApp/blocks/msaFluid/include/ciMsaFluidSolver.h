@@ -46,8 +46,20 @@
 
 #pragma once
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include "cinder/Vector.h"
 #include "cinder/Color.h"
+#include "cinder/Rect.h"
+#include "cinder/Timer.h"
+
+#include "ciMsaFluidFFT.h"
+#include "ciMsaFluidFieldView.h"
+#include "ciMsaFluidKernels.h"
+#include "ciMsaFluidMultigrid.h"
+#include "ciMsaFluidThreadPool.h"
 
 // do not change these values, you can override them using the solver methods
 #define		FLUID_DEFAULT_NX					100
@@ -57,8 +69,65 @@
 #define     FLUID_DEFAULT_COLOR_DIFFUSION	0
 #define     FLUID_DEFAULT_FADESPEED         .03
 #define		FLUID_DEFAULT_SOLVER_ITERATIONS		10
+#define		FLUID_DEFAULT_SOLVER_TOLERANCE		1e-3f
+#define		FLUID_DEFAULT_MULTIGRID_CYCLES		6
+#define		FLUID_DEFAULT_TARGET_RESIDUAL		0.02f
+#define		FLUID_DEFAULT_MIN_ITERATIONS		2
+#define		FLUID_DEFAULT_MAX_ITERATIONS		40
+
+// in adaptive mode the residual is checked every this many sweeps
+#define		FLUID_RESIDUAL_CHECK_INTERVAL		2
+
+// pressure solvers for project(), see setProjectionSolver()
+#define		FLUID_PROJECTION_GAUSS_SEIDEL		0
+#define		FLUID_PROJECTION_MULTIGRID			1
+
+// viscosity and color diffusion solvers, see setDiffusionSolver()
+#define		FLUID_DIFFUSION_GAUSS_SEIDEL		0
+#define		FLUID_DIFFUSION_FAST				1
+#define		FLUID_DEFAULT_DIFFUSION_BLUR_LIMIT	2.0f
+// the blur kernel is cut where its taps fall below FLUID_DIFFUSION_BLUR_EPSILON, but at this radius at the latest
+#define		FLUID_DIFFUSION_MAX_RADIUS			16
+#define		FLUID_DIFFUSION_BLUR_EPSILON		1e-5f
+
+// solver stages timed by update(), see getStageCounters(). the projections before and after the advection are timed apart
+#define		FLUID_STAGE_ADD_SOURCE				0
+#define		FLUID_STAGE_VORTICITY				1
+#define		FLUID_STAGE_DIFFUSE					2
+#define		FLUID_STAGE_PROJECT					3
+#define		FLUID_STAGE_ADVECT					4
+#define		FLUID_STAGE_REPROJECT				5
+#define		FLUID_STAGE_FADE					6
+#define		FLUID_STAGE_COUNT					7
+
+// with the stage timers on, every this many frames one runs on a single thread for the speedup baseline
+#define		FLUID_SERIAL_TIMING_INTERVAL		60
+
+// all fields live in one arena aligned to this many bytes, rows are padded to a multiple of it
+#define		FLUID_ARENA_ALIGNMENT				64
+
+// active tile bookkeeping, see enableActiveTiles()
+#define		FLUID_TILE_SIZE						16
+#define		FLUID_DEFAULT_TILE_VELOCITY_THRESH	1e-5f
+#define		FLUID_DEFAULT_TILE_DYE_THRESH		1e-3f
 
-#define		FLUID_IX(i, j)		((i) + (_NX + 2)  *(j))
+// cells simulated around the rect of setRegionOfInterest()
+#define		FLUID_DEFAULT_ROI_MARGIN			8
+
+// upper limit of setDyeScale()
+#define		FLUID_MAX_DYE_SCALE					4
+
+#define		FLUID_IX(i, j)		((i) + _stride * (j))
+
+// what one stage of update() cost, see ciMsaFluidSolver::getStageCounters()
+struct ciMsaFluidStageCounters {
+	float		time;			// smoothed milliseconds per frame
+	float		speedup;		// see getStageSpeedup()
+	uint64_t	cells;			// cells processed in the last frame, summed over the planes, the passes and the sweeps
+	int			iterations;		// Gauss-Seidel sweeps and multigrid V-cycles in the last frame
+	
+	ciMsaFluidStageCounters() : time(0), speedup(0), cells(0), iterations(0) {}
+};
 
 class ciMsaFluidSolver {
 public:	
@@ -66,6 +135,8 @@ public:
 	virtual ~ciMsaFluidSolver();
 	
 	ciMsaFluidSolver& setup(int NX = FLUID_DEFAULT_NX, int NY = FLUID_DEFAULT_NY);
+	// changes the grid of a set up solver between two steps, the velocity and the dye are resampled into it.
+	// the same size clears the fields
 	ciMsaFluidSolver& setSize(int NX = FLUID_DEFAULT_NX, int NY = FLUID_DEFAULT_NY);
 	
 	// solve one step of the fluid solver
@@ -114,34 +185,200 @@ public:
 	inline void addColorAtCell(int i, int j, float r, float g=0, float b=0 );
 	inline void addColorAtCell(int i, int j, float* rgb );
 	
+	// add count forces / colors at the normalized positions in one pass, the same as count addForceAtPos / addColorAtPos calls.
+	// with bilinear the value is split over the four cells around the position instead of added to the nearest cell
+	void addForcesBatch( const ci::Vec2f *positions, const ci::Vec2f *forces, int count, bool bilinear = false );
+	void addColorsBatch( const ci::Vec2f *positions, const ci::Color *colors, int count, bool bilinear = false );
+	
+	// add a dense vector field, e.g. optical flow. field holds width x height interleaved x, y floats in rows of fieldStride floats,
+	// vector (x, y) is at the center of its cell when the field is stretched over the normalized rect.
+	// every vector v with |v * scale|^2 above minLength2 adds the force v * scale and the color colorAmount (on all channels)
+	void addForceField( const float *field, int width, int height, int fieldStride, const ci::Rectf &rect,
+						const ci::Vec2f &scale, float minLength2, float colorAmount, bool bilinear = false );
+	
 	// fill with random color at every cell
 	void randomizeColor();
 		
 	// return number of cells and dimensions
+	// the fields are stored with a row stride of getRowStride() floats, FLUID_IX(i, j) = i + stride * j
 	int getNumCells() const;
+	int getRowStride() const;
 	int getWidth() const;
 	int getHeight() const;
 	
 	bool isInited() const;
 	
+	// copies the velocity and the color planes, getRowStride() * getHeight() floats each.
+	// g and b are only written in RGB mode, NULL planes are skipped
+	void copyFields(float *u, float *v, float *r, float *g, float *b) const;
+	
+	// keeps the dye on a grid scale times finer than the velocity, the dye is advected with the bilinearly upsampled
+	// velocity while diffusion and projection stay at the velocity resolution. colors are injected at the dye resolution,
+	// addColorAtCell fills the dye cells covering the velocity cell and getInfoAtCell returns the dye at its center.
+	// 1 by default, changing it clears the dye
+	ciMsaFluidSolver& setDyeScale(int scale);
+	int getDyeScale() const;
+	
+	// dye grid including the boundary cells, the velocity grid at scale 1
+	int getDyeWidth() const;
+	int getDyeHeight() const;
+	int getDyeRowStride() const;
+	
+	// get color at dye cell (i, j). range: (0..getDyeWidth()-1), (0..getDyeHeight()-1)
+	inline void getDyeAtCell(int i, int j, ci::Color *color) const;
+	
+	// copies the color planes of the dye grid, getDyeRowStride() * getDyeHeight() floats each.
+	// g and b are only written in RGB mode
+	void copyDye(float *r, float *g, float *b) const;
+	
+	// the velocity and the dye planes in place, see ciMsaFluidFieldView for the layout and how long they stay valid
+	ciMsaFluidFieldView getFieldView() const;
+	
+	// writes the velocity and the dye, including the colors added since the last update(), to a binary file.
+	// the rows are written without their padding and the file replaces an existing one only once it is complete.
+	// returns false if it could not be written
+	bool saveState(const std::string &path) const;
+	// restores a file written by saveState(), reading it through a memory mapping. the solver keeps its size, dye scale
+	// and color mode, a file of another size is resampled. returns false if the file is missing or not a fluid state
+	bool loadState(const std::string &path);
+	// true if loadState() would accept the file, it checks the header and the size without reading the fields
+	static bool isStateFile(const std::string &path);
+	
 	// accessors for  viscocity, it will lerp to the target at lerpspeed
 	ciMsaFluidSolver& setVisc(float newVisc); 
 	float getVisc() const;
 	
 	// accessors for  color diffusion
 	// if diff == 0, color diffusion is not performed
-	// ** COLOR DIFFUSION IS SLOW!
+	// ** COLOR DIFFUSION IS SLOW with the Gauss-Seidel diffusion solver, see setDiffusionSolver()
 	ciMsaFluidSolver& setColorDiffusion( float diff );
 	float				getColorDiffusion();
 	
 	ciMsaFluidSolver& enableRGB(bool isRGB);
+	bool isRGB() const;
 	ciMsaFluidSolver& setDeltaT(float dt = FLUID_DEFAULT_DT);
 	ciMsaFluidSolver& setFadeSpeed(float fadeSpeed = FLUID_DEFAULT_FADESPEED);
 	ciMsaFluidSolver& setSolverIterations(int solverIterations = FLUID_DEFAULT_SOLVER_ITERATIONS);
+	
+	// adaptive mode: instead of solverIterations sweeps the Gauss-Seidel solvers sweep until the relative rms residual
+	// ||b - Ax|| / ||b|| falls below targetResidual, at least minIterations and at most maxIterations times.
+	// the residual is checked every FLUID_RESIDUAL_CHECK_INTERVAL sweeps, a check costs about as much as a sweep. off by default
+	ciMsaFluidSolver& enableAdaptiveIterations(bool b);
+	bool getAdaptiveIterations() const;
+	ciMsaFluidSolver& setAdaptiveIterations(float targetResidual = FLUID_DEFAULT_TARGET_RESIDUAL,
+											int minIterations = FLUID_DEFAULT_MIN_ITERATIONS, int maxIterations = FLUID_DEFAULT_MAX_ITERATIONS);
+	// sweeps of all Gauss-Seidel solves in the last update()
+	int getFrameIterations() const;
+	// largest final residual of the Gauss-Seidel solves in the last update(), only measured in adaptive mode
+	float getFrameResidual() const;
+	
+	// pressure solver used by the projection step
+	// FLUID_PROJECTION_GAUSS_SEIDEL runs solverIterations relaxation sweeps,
+	// FLUID_PROJECTION_MULTIGRID runs V-cycles until the relative residual falls below the solver tolerance,
+	// it converges much faster on large grids
+	ciMsaFluidSolver& setProjectionSolver(int projectionSolver);
+	int getProjectionSolver() const;
+	ciMsaFluidSolver& setSolverTolerance(float tolerance = FLUID_DEFAULT_SOLVER_TOLERANCE);
+	ciMsaFluidSolver& setMultigridCycles(int maxCycles = FLUID_DEFAULT_MULTIGRID_CYCLES);
+	
+	// solver of the implicit viscosity and color diffusion steps, x - a * laplacian(x) = x0 with a = dt * diff * NX * NY
+	// FLUID_DIFFUSION_GAUSS_SEIDEL runs solverIterations relaxation sweeps (or the adaptive count), which under-converge for large a
+	// and lose dye at the walls. FLUID_DIFFUSION_FAST applies the heat kernel of the step, exp(a * laplacian), as a separable
+	// blur while a is at most the blur limit and solves the implicit system with multigrid above it, both conserve the dye.
+	// Gauss-Seidel by default
+	ciMsaFluidSolver& setDiffusionSolver(int diffusionSolver);
+	int getDiffusionSolver() const;
+	ciMsaFluidSolver& setDiffusionBlurLimit(float limit = FLUID_DEFAULT_DIFFUSION_BLUR_LIMIT);
+	float getDiffusionBlurLimit() const;
+	
+	// when both axes wrap the pressure equation is periodic and is solved exactly with an FFT,
+	// overriding the projection solver. enabled by default
+	ciMsaFluidSolver& enableSpectralProjection(bool b);
+	bool getSpectralProjection() const;
+	
+	// the projections before and after the advection each keep their pressure in a plane of its own and start
+	// the iterative solvers from the solution of the last frame instead of zero. with adaptive iterations or the multigrid
+	// tolerance the solve stops after far fewer sweeps while the flow changes slowly. off by default
+	ciMsaFluidSolver& enableWarmStart(bool b);
+	bool getWarmStart() const;
+	
+	// instruction set used by the addSource, linear solver, advect and fade loops
+	// FLUID_SIMD_NONE runs the original scalar loops, FLUID_SIMD_SSE2 and FLUID_SIMD_AVX2 the vectorized kernels
+	// with red-black ordering in the linear solvers. the level is clamped to what the cpu supports,
+	// by default the highest supported level is used
+	ciMsaFluidSolver& setSimdLevel(int simdLevel);
+	int getSimdLevel() const;
+	
+	// number of threads the solver stages are split over in row bands, including the calling one.
+	// the vectorized stages and the divergence, gradient and vorticity loops run in parallel,
+	// the scalar reference linear solvers, multigrid and the FFT solver stay on the calling thread
+	ciMsaFluidSolver& setNumThreads(int numThreads);
+	int getNumThreads() const;
+	
+	// per stage profiling of update(), off by default. when off it costs a branch per stage and an addition per pass
+	ciMsaFluidSolver& enableStageTimers(bool b);
+	bool getStageTimers() const;
+	// smoothed time of the stage in milliseconds per frame
+	float getStageTime(int stage) const;
+	// single threaded time / current time of the stage, 0 until a single threaded frame has been timed
+	float getStageSpeedup(int stage) const;
+	// time, speedup and work of the stage, all 0 until the first update() with the stage timers on.
+	// the dye grid is counted in the advection
+	ciMsaFluidStageCounters getStageCounters(int stage) const;
+	static const char* getStageName(int stage);
+	
+	// splits the grid into FLUID_TILE_SIZE square tiles and runs the stencil and advection loops
+	// only over the tiles holding velocity or dye above the thresholds and their neighbours.
+	// the other tiles are settled, they are cleared and skipped until something moves into them. off by default
+	ciMsaFluidSolver& enableActiveTiles(bool b);
+	bool getActiveTiles() const;
+	ciMsaFluidSolver& setActiveTileThresholds(float velocity = FLUID_DEFAULT_TILE_VELOCITY_THRESH, float dye = FLUID_DEFAULT_TILE_DYE_THRESH);
+	// number of tiles processed by the last update() and the total number of tiles
+	int getNumActiveTiles() const;
+	int getNumTiles() const;
+	
+	// confines every stage to the cells of the normalized rect plus margin cells on each side, x1 <= x2 and y1 <= y2.
+	// the edges of the region inside the grid are walls, the ones on the grid border keep its boundary and wrap.
+	// the cells outside hold no fluid: they are cleared when the region changes and the forces and colors added
+	// there are dropped by the next update(). with walls inside the grid the projection uses the Gauss-Seidel solver
+	// and the fast diffusion keeps the blur above the blur limit. off by default
+	ciMsaFluidSolver& enableRegionOfInterest(bool b);
+	bool getRegionOfInterest() const;
+	ciMsaFluidSolver& setRegionOfInterest(const ci::Rectf &rect, int margin = FLUID_DEFAULT_ROI_MARGIN);
+	ci::Rectf getRegionOfInterestRect() const;
+	int getRegionOfInterestMargin() const;
+	
 	ciMsaFluidSolver& enableVorticityConfinement(bool b);
 	bool getVorticityConfinement();
+	
+	// traces every cell back once and advects the velocity and the dye along it in a single pass.
+	// the dye then moves with the velocity of the start of the step instead of the re-projected
+	// velocity after self-advection, both are divergence free. off by default
+	ciMsaFluidSolver& enableFusedAdvection(bool b);
+	bool getFusedAdvection() const;
+	
+	// runs update() and its worker threads with flush-to-zero / denormals-are-zero set
+	// instead of flushing small values per element in the fade. on by default, without SSE the values are always flushed
+	ciMsaFluidSolver& enableFlushDenormals(bool b);
+	bool getFlushDenormals() const;
 	ciMsaFluidSolver& setWrap( bool bx, bool by );
 	
+	// the reductions (the statistics and the residual of the adaptive iterations) keep a partial sum per row and add
+	// the rows in order instead of one partial sum per thread band, so the fields and the statistics are the same
+	// for any number of threads. the other parallel stages update independent cells or use red-black ordering and
+	// the active tile spans are built in tile order, they do not depend on the threads. off by default
+	ciMsaFluidSolver& enableDeterministic(bool b);
+	bool getDeterministic() const;
+	
+	// 64 bit FNV-1a hash of the velocity and the dye of all cells without the row padding, for comparing runs
+	uint64_t hashFields() const;
+	
+	// the statistics below are reduced over the fields by updateStatistics(), which update() calls every frames frames.
+	// 0, the default, computes them only on request
+	ciMsaFluidSolver& setStatisticsInterval(int frames);
+	int getStatisticsInterval() const;
+	void updateStatistics();
+	
 	// returns average density of fluid 
 	float getAvgDensity() const;
 	
@@ -152,20 +389,31 @@ public:
 	float getAvgSpeed() const;
 
   protected:			
-	// allocate an array large enough to hold information for u, v, r, g, OR b
-	float* alloc()	{ return new float[_numCells];	}
-
+	// planes of _planeSize floats in _arena, padding is kept at zero
 	float	*r, *rOld;
 	float	*g, *gOld;
 	float	*b, *bOld;
 	
-	ci::Vec2f	*uv, *uvOld;
-
-	float	*curl;
+	float	*u, *v;
+	float	*uOld, *vOld;
+	
+	float	*_arena;				// FLUID_ARENA_ALIGNMENT aligned start of _arenaBlock
+	float	*_arenaBlock;
+	int		_arenaPlaneSize;		// plane size the arena was allocated for
 	
 	bool	doRGB;				// for monochrome, only update r
 	bool	doVorticityConfinement;
+	bool	doFusedAdvection;
+	bool	doFlushDenormals;
 	int		solverIterations;
+	int		projectionSolver;
+	float	solverTolerance;
+	int		multigridCycles;
+	bool	doSpectralProjection;
+	bool	doWarmStart;
+	bool	doDeterministic;
+	int		diffusionSolver;
+	float	diffusionBlurLimit;
 	
 	float	colorDiffusion;
 	float	viscocity;
@@ -181,6 +429,7 @@ public:
 
 	
 	int		_NX, _NY, _numCells;
+	int		_stride, _planeSize;	// padded row and plane size in floats
 	float	_invNX, _invNY, _invNumCells;
 	float	_dt;
 	bool	_isInited;
@@ -189,35 +438,177 @@ public:
 	float	_avgDensity;			// this will hold the average color of the last frame (how full it is)
 	float	_uniformity;			// this will hold the _uniformity of the last frame (how uniform the color is);
 	float	_avgSpeed;
-	
+	int		statisticsInterval;
+	int		_statisticsFrame;
+	
+	ciMsaFluidMultigrid	_multigrid;
+	ciMsaFluidSpectralSolver _spectralSolver;
+	
+	const ciMsaFluidKernels *_kernels;		// NULL for the scalar path
+	
+	ciMsaFluidThreadPool _threadPool;
+	ciMsaFluidThreadPool *_pool;			// _threadPool, the dye grid runs on the pool of its solver
+	
+	bool	doAdaptiveIterations;
+	float	targetResidual;
+	int		minIterations;
+	int		maxIterations;
+	int		_frameIterations;		// accumulated during update()
+	float	_frameResidual;
+	int		_lastFrameIterations;	// of the last finished update()
+	float	_lastFrameResidual;
+	
+	bool	doActiveTiles;
+	float	tileVelocityThreshold;
+	float	tileDyeThreshold;
+	int		_numTilesX, _numTilesY;
+	int		_numActiveTiles;
+	std::vector< float >			_tileVelocityMax, _tileDyeMax;
+	std::vector< unsigned char >	_tileLive;			// above the thresholds
+	std::vector< unsigned char >	_tileActive;		// live or next to a live tile, processed
+	std::vector< int >	_tileSpans;			// [i0, i1) cell ranges of the active tiles per tile row
+	std::vector< int >	_tileSpanOffsets;	// first span of each tile row in _tileSpans, _numTilesY + 1 entries
+	std::vector< int >	_activeRows;		// interior rows crossing at least one active tile
+	
+	bool		doRegionOfInterest;
+	ci::Rectf	roiRect;
+	int			roiMargin;
+	int			_roiI0, _roiI1, _roiJ0, _roiJ1;		// simulated cells, the whole interior without a region
+	
+	std::vector< int >		_splatColumns;		// scratch of addForceField
+	std::vector< float >	_splatWeights;
+	
+	std::vector< float >	_blurWeights;		// taps 0..radius of the diffusion blur for _blurWeightsA
+	float					_blurWeightsA;
+	std::vector< float >	_blurLines;			// scratch of blurDiffuse, one padded row per band
+	std::vector< float >	_blurPlane;
+	
+	std::vector< float >	_curlRows;			// three rows of signed curl per band, scratch of vorticityConfinement
+	std::vector< double >	_partialSums;		// per band or per row partial sums of sumRows
+	std::vector< float >	_pressure[2];		// last pressure of the two projections, sized by the first warm started update()
+	
+	int		dyeScale;
+	ciMsaFluidSolver	*_dyeSolver;			// dye grid for dyeScale > 1, its velocity is upsampled from this one
+	std::vector< int >		_upsampleColumns;	// scratch of upsampleVelocity
+	std::vector< float >	_upsampleWeights;
+	
+	bool	doStageTimers;
+	int		_frameCount;
+	ci::Timer	_stageTimer;
+	double	_stageMark;
+	double	_stageFrameTimes[FLUID_STAGE_COUNT];
+	float	_stageTimes[FLUID_STAGE_COUNT];
+	float	_serialStageTimes[FLUID_STAGE_COUNT];
+	
+	int			_numActiveCells;		// interior cells of the active spans
+	uint64_t	_cellCount;				// work of the update() so far, counted whether the timers are on or not
+	int			_iterationCount;
+	uint64_t	_stageMarkCells;		// the counts at the last markStage()
+	int			_stageMarkIterations;
+	uint64_t	_stageFrameCells[FLUID_STAGE_COUNT];
+	int			_stageFrameIterations[FLUID_STAGE_COUNT];
+	ciMsaFluidStageCounters	_stageCounters[FLUID_STAGE_COUNT];		// of the last finished update()
+	
+	void	beginStageTimers();
+	inline void	markStage(int stage);
+	void	endStageTimers();
+	inline void	countCells(int numPlanes);
+	inline void	countSweeps(int sweeps, int numPlanes);
+	inline void	countMultigrid(int cycles);
+	
+	void	allocate();
 	void	destroy();
 	
+	void	setupDye();
+	void	syncDyeSolver();
+	void	updateDye();
+	void	stepDye(const ciMsaFluidSolver &velocity);
+	void	upsampleVelocity(const ciMsaFluidSolver &velocity);
+	void	addColorAtDyeCells(int i, int j, float r, float g, float b);
+	
+	void	setupTiles();
+	template< bool RGB > void	updateActiveTiles(bool regionChanged);
+	void	buildTileSpans();
+	void	clearTile(int tx, int ty);
+	
+	bool	resolveRegion();
+	bool	updateRegion();
+	void	clearOutsideRegion();
+	void	clearOutsideRegion(float **planes, int numPlanes);
+	template< bool RGB > void	clearSourcesOutsideRegion(bool velocity, bool dye);
+	void	setRegionBoundary(int b, float *x);
+	inline	bool	hasRegionWalls() const;
+	inline	bool	wrapsX() const;
+	inline	bool	wrapsY() const;
+	template< typename Fn >
+	void	forRegionCells(int j0, int j1, const Fn &fn) const;
+	void	tileMax(const float *x, float *maxima) const;
+	inline	int		getRowSpans(int j, const int **spans) const;
+	inline	void	splat(float x, float y, float **planes, const float *values, int numPlanes, bool bilinear);
+	
 	inline	float	calcCurl(int i, int j);
-	void	vorticityConfinement(ci::Vec2f *Fvc_xy);
+	void	vorticityConfinement(float *Fvc_x, float *Fvc_y);
 	
 	void	addSource(float *x, float *x0);
 	void	addSourceUV();		// does both U and V in one go
 	void	addSourceRGB();	// does R, G, and B in one go
+	void	addSourceKernels(float *x, const float *x0);
 	
-	void	advect(int b, float *d, const float *d0, const ci::Vec2f *duv);
-	void	advect2d( ci::Vec2f *uv, const ci::Vec2f *duv );
-	void	advectRGB(int b, const ci::Vec2f *duv);
+	void	advect(int b, float *d, const float *d0, const float *du, const float *dv);
+	void	advect2d(float *u, float *v, const float *du, const float *dv);
+	void	advectRGB(int b, const float *du, const float *dv);
+	template< bool RGB > void	advectFused(float *u, float *v, const float *du, const float *dv);
+	void	advectKernels(const ciMsaFluidAdvectArgs &args);
 	
 	void	diffuse(int b, float *c, float *c0, float diff);
 	void	diffuseRGB(int b, float diff);
 	void	diffuseUV(float diff);
+	void	diffuseFast(int b, float *x, const float *x0, float a);
+	void	blurDiffuse(int b, float *x, const float *x0, float a);
+	void	multigridDiffuse(int b, float *x, const float *x0, float a);
+	int		updateBlurWeights(float a);
 	
-	void	project(ci::Vec2f *xy, ci::Vec2f *pDiv);
+	void	project(float *x, float *y, float *p, float *div);
+	float*	projectionPressure(int projection);
 	void	linearSolver(int b, float *x, const float *x0, float a, float c);
-	void	linearSolverProject( ci::Vec2f *pdiv );
+	void	linearSolverProject(float *p, const float *div);
+	void	linearSolverProjectMultigrid(float *p, const float *div);
+	void	linearSolverProjectSpectral(float *p, const float *div);
+	void	copyActiveCells(float *dst, const float *src, int rowSize);
 	void	linearSolverRGB( float a, float c);
 	void	linearSolverUV(float a, float c);
+	void	relaxRedBlack(float *x, const float *x0, float a, float c);
+	bool	continueSolve(int k, float **x, const float **x0, int numPlanes, float a, float diag);
+	float	calcResidual(float **x, const float **x0, int numPlanes, float a, float diag);
 	
 	void	setBoundary(int b, float *x);
-	void	setBoundary02d(ci::Vec2f* x);
-	void	setBoundary2d(int b, ci::Vec2f *xy );
+	void	setBoundary2d(int b, float *u, float *v);
 	void	setBoundaryRGB();
 	
+	// the loops depending on the wrap, RGB and vorticity flags are instantiated for every combination,
+	// selectSpecializations() picks the ones for the current flags when one is set and once per update()
+	typedef void (ciMsaFluidSolver::*BoundaryFn)(int b, float *x);
+	typedef void (ciMsaFluidSolver::*Boundary2dFn)(int b, float *u, float *v);
+	typedef void (ciMsaFluidSolver::*BoundaryRGBFn)();
+	typedef void (ciMsaFluidSolver::*FadeFn)();
+	typedef void (ciMsaFluidSolver::*StepFn)(bool regionChanged);
+	typedef void (ciMsaFluidSolver::*StepDyeFn)(const ciMsaFluidSolver &velocity, bool regionChanged);
+	
+	BoundaryFn		_setBoundary;
+	Boundary2dFn	_setBoundary2d;
+	BoundaryRGBFn	_setBoundaryRGB;
+	FadeFn			_fadeDye;
+	StepFn			_step;			// the stages of update()
+	StepDyeFn		_stepDye;		// the stages of stepDye()
+	
+	void	selectSpecializations();
+	template< bool WRAP_X, bool WRAP_Y > void	setBoundaryT(int b, float *x);
+	template< bool WRAP_X, bool WRAP_Y > void	setBoundary2dT(int b, float *u, float *v);
+	template< bool WRAP_X, bool WRAP_Y > void	setBoundaryRGBT();
+	template< bool RGB, bool FLUSH > void	fadeScalar();
+	template< bool RGB, bool VORTICITY > void	stepT(bool regionChanged);
+	template< bool RGB > void	stepDyeT(const ciMsaFluidSolver &velocity, bool regionChanged);
+	
 	void	swapUV();
 	void	swapU(); 
 	void	swapV(); 
@@ -226,11 +617,118 @@ public:
 	
 	void	fadeR();
 	void	fadeRGB();
+	
+	template< bool RGB > void	addDye();		// adds and diffuses the injected color
+	template< bool RGB > void	advectDye();	// moves the dye along the new velocity
+	template< bool RGB > void	fadeDye();
+	void	fadeKernels(float **planes, float **oldPlanes, int numPlanes, float holdAmount);
+	void	sumDensity(double *sums);
+	template< typename RowSums >
+	void	sumRows(int begin, int end, int numSums, double *sums, const RowSums &rowSums);
+	bool	flushesPerElement() const;		// false while the hardware flushes the denormals
 };
 
 
 // the functions below are here for optimization purposes
+
+inline void ciMsaFluidSolver::markStage(int stage) {
+	if( !doStageTimers ) return;
+	double now = _stageTimer.getSeconds();
+	_stageFrameTimes[stage] += now - _stageMark;
+	_stageMark = now;
+	_stageFrameCells[stage] += _cellCount - _stageMarkCells;
+	_stageFrameIterations[stage] += _iterationCount - _stageMarkIterations;
+	_stageMarkCells = _cellCount;
+	_stageMarkIterations = _iterationCount;
+}
+
+// one pass over the active cells of numPlanes planes
+inline void ciMsaFluidSolver::countCells(int numPlanes) {
+	_cellCount += (uint64_t)numPlanes * _numActiveCells;
+}
+
+// Gauss-Seidel sweeps over the active cells of numPlanes planes
+inline void ciMsaFluidSolver::countSweeps(int sweeps, int numPlanes) {
+	_iterationCount += sweeps;
+	_cellCount += (uint64_t)sweeps * numPlanes * _numActiveCells;
+}
+
+// V-cycles over the whole grid, counted as its finest level
+inline void ciMsaFluidSolver::countMultigrid(int cycles) {
+	_iterationCount += cycles;
+	_cellCount += (uint64_t)cycles * _NX * _NY;
+}
  
+// true when an edge of the region of interest lies inside the grid
+inline bool ciMsaFluidSolver::hasRegionWalls() const {
+	return _roiI0 > 1 || _roiI1 < _NX || _roiJ0 > 1 || _roiJ1 < _NY;
+}
+
+// the wrap of an axis only holds while the region spans it
+inline bool ciMsaFluidSolver::wrapsX() const {
+	return wrap_x && _roiI0 == 1 && _roiI1 == _NX;
+}
+
+inline bool ciMsaFluidSolver::wrapsY() const {
+	return wrap_y && _roiJ0 == 1 && _roiJ1 == _NY;
+}
+
+// calls fn( offset, n ) for the n floats from offset on of each row in [j0, j1) that cover the region and its ring,
+// once for all rows when the region spans them
+template< typename Fn >
+void ciMsaFluidSolver::forRegionCells(int j0, int j1, const Fn &fn) const {
+	if( _roiI0 == 1 && _roiI1 == _NX ) {
+		fn( j0 * _stride, ( j1 - j0 ) * _stride );
+		return;
+	}
+	for( int j = j0; j < j1; j++ )
+		fn( FLUID_IX(_roiI0 - 1, j), _roiI1 - _roiI0 + 3 );
+}
+
+// the active cells of the interior row j are [spans[0], spans[1]), [spans[2], spans[3]), ...
+// returns the number of spans
+inline int ciMsaFluidSolver::getRowSpans(int j, const int **spans) const {
+	int ty = ( j - 1 ) / FLUID_TILE_SIZE;
+	*spans = _tileSpans.data() + _tileSpanOffsets[ty];
+	return ( _tileSpanOffsets[ty + 1] - _tileSpanOffsets[ty] ) / 2;
+}
+
+// adds the values to the planes at normalized (x, y), with the same cell mapping as addForceAtPos
+inline void ciMsaFluidSolver::splat(float x, float y, float **planes, const float *values, int numPlanes, bool bilinear) {
+	if( !bilinear ) {
+		int i = (int) (x * _NX + 1);
+		if( i<0 || _NX+1<i ) return;
+		int j = (int) (y * _NY + 1);
+		if( j<0 || _NY+1<j ) return;
+		int index = FLUID_IX(i, j);
+		for (int k = 0; k < numPlanes; k++)
+			planes[k][index] += values[k];
+		return;
+	}
+	
+	// cell i is centered at x = ( i - 0.5 ) / _NX
+	float fx = x * _NX + 0.5f;
+	float fy = y * _NY + 0.5f;
+	if( fx < 0 || fx >= _NX + 1 || fy < 0 || fy >= _NY + 1 ) return;
+	int i0 = (int)fx;
+	int j0 = (int)fy;
+	float s1 = fx - i0;
+	float t1 = fy - j0;
+	float w00 = ( 1 - s1 ) * ( 1 - t1 );
+	float w10 = s1 * ( 1 - t1 );
+	float w01 = ( 1 - s1 ) * t1;
+	float w11 = s1 * t1;
+	int index = FLUID_IX(i0, j0);
+	for (int k = 0; k < numPlanes; k++)
+	{
+		float *p = planes[k] + index;
+		p[0] += w00 * values[k];
+		p[1] += w10 * values[k];
+		p[_stride] += w01 * values[k];
+		p[_stride + 1] += w11 * values[k];
+	}
+}
+
 inline int ciMsaFluidSolver::getIndexForCellPosition(int i, int j) const {
 	if(i < 1) i=1; else if(i > _NX) i = _NX;
 	if(j < 1) j=1; else if(j > _NY) j = _NY;
@@ -243,16 +741,33 @@ inline int ciMsaFluidSolver::getIndexForNormalizedPosition(float x, float y) con
 
 inline	void ciMsaFluidSolver::getInfoAtCell(int i, ci::Vec2f *vel, ci::Color *color) const {
 	if(vel)
-		vel->set(uv[i].x * _invNX, uv[i].y * _invNY);
+		vel->set(u[i] * _invNX, v[i] * _invNY);
 	if(color)
 	{
-		if(doRGB)
+		if(_dyeSolver)
+		{
+			// center of the dye cells covering the cell, the boundary cells map to the dye boundary
+			int half = dyeScale / 2;
+			_dyeSolver->getDyeAtCell( ( i % _stride - 1 ) * dyeScale + 1 + half, ( i / _stride - 1 ) * dyeScale + 1 + half, color );
+		}
+		else if(doRGB)
 			color->set( ci::CM_RGB, ci::Vec3f( r[i], g[i], b[i] ) );
 		else
 			color->set( ci::CM_RGB, ci::Vec3f( r[i], r[i], r[i] ) );
 	}
 }
 
+inline void ciMsaFluidSolver::getDyeAtCell(int i, int j, ci::Color *color) const {
+	if(_dyeSolver)
+	{
+		_dyeSolver->getDyeAtCell( i, j, color );
+		return;
+	}
+	if(i<0) i = 0; else if(i > _NX+1) i = _NX+1;
+	if(j<0) j = 0; else if(j > _NY+1) j = _NY+1;
+	getInfoAtCell(FLUID_IX(i, j), NULL, color);
+}
+
 inline void ciMsaFluidSolver::getInfoAtPos(float x, float y, ci::Vec2f *vel, ci::Color *color) const {
 	int i= (int)(x * (_NX+2));
 	int j= (int)(y * (_NY+2));
@@ -265,7 +780,7 @@ inline ci::Vec2f ciMsaFluidSolver::getVelocityAtPos( const ci::Vec2f &pos ) cons
 	i = ci::constrain<int>( i, 0, _NX+1 );
 	j = ci::constrain<int>( j, 0, _NY+1 );
 	int o = FLUID_IX( i, j );
-	return ci::Vec2f( uv[o].x, uv[o].y );	
+	return ci::Vec2f( u[o], v[o] );
 }
 
 inline	void ciMsaFluidSolver::getInfoAtCell(int i, int j, ci::Vec2f *vel, ci::Color *color) const {
@@ -285,12 +800,17 @@ inline void ciMsaFluidSolver::addForceAtPos(const ci::Vec2f &pos, const ci::Vec2
 inline	void ciMsaFluidSolver::addForceAtCell(int i, int j, const ci::Vec2f &force )
 {
 	int index = FLUID_IX(i, j);
-	uv[index].x += force.x;
-	uv[index].y += force.y;
+	u[index] += force.x;
+	v[index] += force.y;
 }
 
 inline void ciMsaFluidSolver::addColorAtCell(int i, int j, float r, float g, float b )
 {
+	if(_dyeSolver)
+	{
+		addColorAtDyeCells(i, j, r, g, b);
+		return;
+	}
 	//      if(safeToRun()){
 	int index = FLUID_IX(i, j);
 	rOld[index] += r;
@@ -304,6 +824,11 @@ inline void ciMsaFluidSolver::addColorAtCell(int i, int j, float r, float g, flo
 }
 
 inline void ciMsaFluidSolver::addColorAtPos(float x, float y, float r, float g, float b) {
+	if(_dyeSolver)
+	{
+		_dyeSolver->addColorAtPos(x, y, r, g, b);
+		return;
+	}
 	int i = (int) (x * _NX + 1);
 	if( i<0 || _NX+1<i ) return;
 	int j = (int) (y * _NY + 1);
@@ -0,0 +1,71 @@
+/***********************************************************************
+
+ Worker pool for the parallel stages of ciMsaFluidSolver
+
+ run() splits a range of rows into one contiguous band per thread, the calling
+ thread works on the first band and waits for the others. A solver step issues
+ many short jobs back to back, so the workers spin for a while after a job before
+ going to sleep until the next one. run() is not reentrant, one solver drives
+ one pool, its dye grid shares it between the solver's jobs. The workers run a
+ job with the denormal mode of the calling thread.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include "cinder/Thread.h"
+
+#include "ciMsaFluidAtomic.h"
+
+// upper limit of setNumThreads()
+#define		FLUID_MAX_THREADS			32
+
+// number of yields a worker spins before sleeping
+#define		FLUID_THREAD_SPIN_COUNT		1000
+
+class ciMsaFluidThreadPool {
+public:
+	// band index, first row, end row
+	typedef std::function< void ( int, int, int ) > Task;
+
+	ciMsaFluidThreadPool();
+	~ciMsaFluidThreadPool();
+
+	// total number of threads including the calling one, 1 runs everything on the calling thread
+	void	setNumThreads( int numThreads );
+	int		getNumThreads() const		{ return _numThreads; }
+
+	// while disabled run() executes the whole range on the calling thread as band 0
+	void	setParallel( bool parallel )	{ _parallel = parallel; }
+	bool	isParallel() const			{ return _parallel && ( _numThreads > 1 ); }
+
+	// runs task on the bands of rows [begin, end) and returns the number of bands when all of them are done.
+	// the bands only depend on the range and the thread count
+	int		run( int begin, int end, const Task &task );
+
+	static int	getHardwareConcurrency();
+
+protected:
+	int		_numThreads;
+	bool	_parallel;
+	std::vector< std::shared_ptr< std::thread > > _workers;
+
+	std::mutex				_mutex;
+	std::condition_variable	_wake;
+	std::atomic< int >		_generation;		// incremented for every job
+	std::atomic< int >		_pending;			// workers that have not finished the current job
+	std::atomic< int >		_sleeping;
+	std::atomic< bool >		_stop;
+
+	// current job, written before _generation is incremented
+	const Task	*_task;
+	int			_begin, _end, _numBands;
+	bool		_flushDenormals;
+
+	void	stopWorkers();
+	void	workerLoop( int band, int generation );
+	void	runBand( int band );
+};
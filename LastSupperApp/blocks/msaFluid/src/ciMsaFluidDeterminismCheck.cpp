@@ -0,0 +1,62 @@
+/***********************************************************************
+
+ Checks that a ciMsaFluidSolver gives the same fields for any number of threads
+
+ ***********************************************************************/
+
+#include <cmath>
+
+#include "ciMsaFluidDeterminismCheck.h"
+
+ciMsaFluidDeterminismCheck::ciMsaFluidDeterminismCheck()
+:_steps(FLUID_DETERMINISM_CHECK_STEPS)
+,_deterministic(true)
+,_passed(false)
+{
+	int threadCounts[] = { 1, 2, 4, 8 };
+	_threadCounts.assign( threadCounts, threadCounts + 4 );
+}
+
+bool ciMsaFluidDeterminismCheck::run( int NX, int NY, const std::function< void ( ciMsaFluidSolver & ) > &configure )
+{
+	_hashes.clear();
+	_passed = true;
+	for ( size_t k = 0; k < _threadCounts.size(); k++ )
+	{
+		ciMsaFluidSolver solver;
+		solver.setup( NX, NY );
+		configure( solver );
+		solver.setNumThreads( _threadCounts[k] );
+		solver.enableDeterministic( _deterministic );
+
+		for ( int step = 0; step < _steps; step++ )
+		{
+			inject( solver, step );
+			solver.update();
+		}
+		solver.updateStatistics();
+
+		_hashes.push_back( solver.hashFields() );
+		_passed = _passed && ( _hashes.back() == _hashes.front() );
+	}
+	return _passed;
+}
+
+// a fixed linear congruential sequence, the same for every run
+void ciMsaFluidDeterminismCheck::inject( ciMsaFluidSolver &solver, int step ) const
+{
+	uint32_t seed = 12345u + 7919u * (uint32_t)step;
+	for ( int k = 0; k < FLUID_DETERMINISM_CHECK_INJECTIONS; k++ )
+	{
+		float values[5];
+		for ( int i = 0; i < 5; i++ )
+		{
+			seed = seed * 1664525u + 1013904223u;
+			values[i] = ( seed >> 8 ) * ( 1.0f / 16777216.0f );
+		}
+		ci::Vec2f pos( 0.1f + 0.8f * values[0], 0.1f + 0.8f * values[1] );
+		float angle = 6.2831853f * values[2];
+		solver.addForceAtPos( pos, ci::Vec2f( cosf( angle ), sinf( angle ) ) * 0.002f );
+		solver.addColorAtPos( pos, ci::Color( values[3], values[4], 0.5f ) );
+	}
+}
@@ -46,6 +46,7 @@ ciMsaFluidDrawerGl::ciMsaFluidDrawerGl() {
 	_pixels				= NULL;
 	_byteCount			= 0;
 	_fluidSolver		= NULL;
+	_snapshot			= NULL;
 	_didICreateTheFluid	= false;
 	alpha				= 1;
 	doInvert			= false;
@@ -84,6 +85,10 @@ ciMsaFluidSolver* ciMsaFluidDrawerGl::getFluidSolver() {
 	return _fluidSolver;
 }
 
+void ciMsaFluidDrawerGl::setSnapshot(const ciMsaFluidSnapshot* snapshot) {
+	_snapshot = snapshot;
+}
+
 void ciMsaFluidDrawerGl::enableAlpha(bool b) {
 	_alphaEnabled = b;
 	if(_alphaEnabled) {
@@ -96,9 +101,16 @@ void ciMsaFluidDrawerGl::enableAlpha(bool b) {
 }
 
 void ciMsaFluidDrawerGl::createTexture() {
+	allocateTexture(_fluidSolver->getDyeWidth()-2, _fluidSolver->getDyeHeight()-2);
+}
+
+void ciMsaFluidDrawerGl::prepareTexture(int texWidth, int texHeight) {
+	if(!_pixels || _surface.getWidth() != texWidth || _surface.getHeight() != texHeight)
+		allocateTexture(texWidth, texHeight);
+}
+
+void ciMsaFluidDrawerGl::allocateTexture(int texWidth, int texHeight) {
 	if(_pixels) delete []_pixels;
-	int texWidth = _fluidSolver->getWidth()-2;
-	int texHeight =_fluidSolver->getHeight()-2;
 
 	_pixels = new unsigned char[texWidth * texHeight * _bpp];
 	//_surface = Surface8u( _pixels, texWidth, texHeight, false, SurfaceChannelOrder::RGB );
@@ -191,27 +203,32 @@ void ciMsaFluidDrawerGl::draw(float x, float y, float renderWidth, float renderH
 }
 
 void ciMsaFluidDrawerGl::drawColor(float x, float y, float renderWidth, float renderHeight, bool withAlpha) {
-	int fw = _fluidSolver->getWidth();
-	int fh = _fluidSolver->getHeight();
-
-	ci::Vec2f vel;
-	ci::Color color;
-	int index = 0;
-	for(int j=1; j < fh-1; j++) {
-		for(int i=1; i < fw-1; i++) {
-			_fluidSolver->getInfoAtCell(i, j, &vel, &color);
-			uint8_t r = (uint8_t)math<float>::min(color.r * 255 * alpha, 255);
-			uint8_t g = (uint8_t)math<float>::min(color.g * 255 * alpha, 255);
-			uint8_t b = (uint8_t)math<float>::min(color.b * 255 * alpha, 255);
-			if(doInvert) {
-				r = 255 - r;
-				g = 255 - g;
-				b = 255 - b;
+	ciMsaFluidFieldView view = getFieldView();
+	prepareTexture(view.dyeNX, view.dyeNY);
+
+	// 255 - c == c ^ 255 for bytes, so inverting needs no branch per cell
+	uint8_t invert = doInvert ? 255 : 0;
+	uint8_t *pixels = _pixels;
+	for(int j=1; j <= view.dyeNY; j++) {
+		const float *rRow = view.rRow(j) + 1;
+		const float *gRow = view.gRow(j) + 1;
+		const float *bRow = view.bRow(j) + 1;
+		if(_alphaEnabled) {
+			for(int i=0; i < view.dyeNX; i++, pixels += 4) {
+				uint8_t r = (uint8_t)math<float>::min(rRow[i] * 255 * alpha, 255) ^ invert;
+				uint8_t g = (uint8_t)math<float>::min(gRow[i] * 255 * alpha, 255) ^ invert;
+				uint8_t b = (uint8_t)math<float>::min(bRow[i] * 255 * alpha, 255) ^ invert;
+				pixels[0] = r;
+				pixels[1] = g;
+				pixels[2] = b;
+				pixels[3] = withAlpha ? math<uint8_t>::min(b, math<uint8_t>::max(r, g)) : 255;
+			}
+		} else {
+			for(int i=0; i < view.dyeNX; i++, pixels += 3) {
+				pixels[0] = (uint8_t)math<float>::min(rRow[i] * 255 * alpha, 255) ^ invert;
+				pixels[1] = (uint8_t)math<float>::min(gRow[i] * 255 * alpha, 255) ^ invert;
+				pixels[2] = (uint8_t)math<float>::min(bRow[i] * 255 * alpha, 255) ^ invert;
 			}
-			_pixels[index++] = r;
-			_pixels[index++] = g;
-			_pixels[index++] = b;
-			if(_alphaEnabled) _pixels[index++] = withAlpha ? math<uint8_t>::min(b, math<uint8_t>::max(r, g)) : 255;
 		}
 	}
 
@@ -222,21 +239,23 @@ void ciMsaFluidDrawerGl::drawColor(float x, float y, float renderWidth, float re
 }
 
 void ciMsaFluidDrawerGl::drawMotion(float x, float y, float renderWidth, float renderHeight, bool withAlpha) {
-	int fw = _fluidSolver->getWidth();
-	int fh = _fluidSolver->getHeight();
+	ciMsaFluidFieldView view = getFieldView();
+	int fw = view.NX + 2;
+	int fh = view.NY + 2;
+	prepareTexture(view.NX, view.NY);
 
-	ci::Vec2f vel;
 	int index = 0;
-	for(int j=1; j < fh-1; j++) {
-		for(int i=1; i < fw-1; i++) {
-			_fluidSolver->getInfoAtCell(i, j, &vel, NULL);
-			float speed2 = fabs(vel.x) * fw + fabs(vel.y) * fh;
-			int speed = (int)math<float>::min(speed2 * 255 * alpha, 255);
-			_pixels[index++] = (uint8_t)math<float>::min(fabs(vel.x) * fw * 255 * alpha, 255);
-			_pixels[index++] = (uint8_t)math<float>::min(fabs(vel.y) * fh * 255 * alpha, 255);
+	for(int j=1; j <= view.NY; j++) {
+		const float *uRow = view.uRow(j) + 1;
+		const float *vRow = view.vRow(j) + 1;
+		for(int i=0; i < view.NX; i++) {
+			float vx = fabs(uRow[i] * view.velocityScale.x) * fw;
+			float vy = fabs(vRow[i] * view.velocityScale.y) * fh;
+			int speed = (int)math<float>::min((vx + vy) * 255 * alpha, 255);
+			_pixels[index++] = (uint8_t)math<float>::min(vx * 255 * alpha, 255);
+			_pixels[index++] = (uint8_t)math<float>::min(vy * 255 * alpha, 255);
 			_pixels[index++] = (uint8_t)0;
 			if(_alphaEnabled) _pixels[index++] = withAlpha ? speed : 255;
-
 		}
 	}
 
@@ -248,15 +267,17 @@ void ciMsaFluidDrawerGl::drawMotion(float x, float y, float renderWidth, float r
 
 
 void ciMsaFluidDrawerGl::drawSpeed(float x, float y, float renderWidth, float renderHeight, bool withAlpha) {
-	int fw = _fluidSolver->getWidth();
-	int fh = _fluidSolver->getHeight();
+	ciMsaFluidFieldView view = getFieldView();
+	int fw = view.NX + 2;
+	int fh = view.NY + 2;
+	prepareTexture(view.NX, view.NY);
 
-	ci::Vec2f vel;
 	int index = 0;
-	for(int j=1; j < fh-1; j++) {
-		for(int i=1; i < fw-1; i++) {
-			_fluidSolver->getInfoAtCell(i, j, &vel, NULL);
-			float speed2 = fabs(vel.x) * fw + fabs(vel.y) * fh;
+	for(int j=1; j <= view.NY; j++) {
+		const float *uRow = view.uRow(j) + 1;
+		const float *vRow = view.vRow(j) + 1;
+		for(int i=0; i < view.NX; i++) {
+			float speed2 = fabs(uRow[i] * view.velocityScale.x) * fw + fabs(vRow[i] * view.velocityScale.y) * fh;
 			uint8_t speed = (uint8_t)math<float>::min(speed2 * 255 * alpha, 255);
 			_pixels[index++] = speed;
 			_pixels[index++] = speed;
@@ -273,15 +294,14 @@ void ciMsaFluidDrawerGl::drawSpeed(float x, float y, float renderWidth, float re
 
 
 void ciMsaFluidDrawerGl::drawVectors(float x, float y, float renderWidth, float renderHeight, float velThreshold) {
-	int fw = _fluidSolver->getWidth();
-	int fh = _fluidSolver->getHeight();
+	ciMsaFluidFieldView view = getFieldView();
 
 //	int xStep = renderWidth / 10;		// every 10 pixels
 //	int yStep = renderHeight / 10;		// every 10 pixels
 
 	glPushMatrix();
 	glTranslatef(x, y, 0);
-	glScalef(renderWidth/(fw-2), renderHeight/(fh-2), 1.0);
+	glScalef(renderWidth/view.NX, renderHeight/view.NY, 1.0);
 
 	float velMult = 50000;
 	float maxVel = 5.0f/20000;
@@ -289,9 +309,11 @@ void ciMsaFluidDrawerGl::drawVectors(float x, float y, float renderWidth, float
 	ci::Vec2f vel;
 	glEnable(GL_LINE_SMOOTH);
 	glLineWidth(1);
-	for (int j=0; j<fh-2; j++ ){
-		for (int i=0; i<fw-2; i++ ){
-			_fluidSolver->getInfoAtCell(i+1, j+1, &vel, NULL);
+	for (int j=0; j<view.NY; j++ ){
+		const float *uRow = view.uRow(j+1) + 1;
+		const float *vRow = view.vRow(j+1) + 1;
+		for (int i=0; i<view.NX; i++ ){
+			vel.set(uRow[i] * view.velocityScale.x, vRow[i] * view.velocityScale.y);
 			float d2 = vel.x * vel.x + vel.y * vel.y;
 			if(d2>velThreshold) {
 				if(d2 > maxVel * maxVel) {
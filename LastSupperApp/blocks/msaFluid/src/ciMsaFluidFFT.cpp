@@ -0,0 +1,301 @@
+/***********************************************************************
+
+ Self contained mixed radix FFT and exact periodic solver for ciMsaFluidSolver
+ The FFT is a recursive decimation in time Cooley-Tukey, structured after KissFFT.
+
+ ***********************************************************************/
+
+#include <cmath>
+
+#include "ciMsaFluidFFT.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// explicit complex arithmetic, std::complex operator* is slow without fast-math
+static inline ciMsaFluidComplex cmul( const ciMsaFluidComplex &a, const ciMsaFluidComplex &b )
+{
+	return ciMsaFluidComplex( a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real() );
+}
+
+static inline ciMsaFluidComplex cadd( const ciMsaFluidComplex &a, const ciMsaFluidComplex &b )
+{
+	return ciMsaFluidComplex( a.real() + b.real(), a.imag() + b.imag() );
+}
+
+static inline ciMsaFluidComplex csub( const ciMsaFluidComplex &a, const ciMsaFluidComplex &b )
+{
+	return ciMsaFluidComplex( a.real() - b.real(), a.imag() - b.imag() );
+}
+
+ciMsaFluidFFT::ciMsaFluidFFT()
+:_n(0)
+{
+}
+
+void ciMsaFluidFFT::setup( int n )
+{
+	_n = n;
+
+	const double phase = -2.0 * M_PI / n;
+	_twiddles.resize( n );
+	_twiddlesInv.resize( n );
+	for ( int i = 0; i < n; i++ )
+	{
+		_twiddles[i] = ciMsaFluidComplex( (float)cos( phase * i ), (float)sin( phase * i ) );
+		_twiddlesInv[i] = std::conj( _twiddles[i] );
+	}
+
+	// powers of 4 first, then 2, then odd factors
+	_factors.clear();
+	int maxFactor = 1;
+	int p = 4;
+	int remaining = n;
+	double floorSqrt = floor( sqrt( (double)n ) );
+	do
+	{
+		while ( remaining % p )
+		{
+			switch ( p )
+			{
+				case 4: p = 2; break;
+				case 2: p = 3; break;
+				default: p += 2; break;
+			}
+			if ( p > floorSqrt )
+				p = remaining;
+		}
+		remaining /= p;
+		_factors.push_back( p );
+		_factors.push_back( remaining );
+		if ( p > maxFactor )
+			maxFactor = p;
+	}
+	while ( remaining > 1 );
+
+	_scratch.resize( maxFactor );
+}
+
+void ciMsaFluidFFT::forward( const ciMsaFluidComplex *in, ciMsaFluidComplex *out ) const
+{
+	work( out, in, 1, &_factors[0], &_twiddles[0], false );
+}
+
+void ciMsaFluidFFT::inverse( const ciMsaFluidComplex *in, ciMsaFluidComplex *out ) const
+{
+	work( out, in, 1, &_factors[0], &_twiddlesInv[0], true );
+}
+
+void ciMsaFluidFFT::work( ciMsaFluidComplex *out, const ciMsaFluidComplex *in, int fstride,
+		const int *factors, const ciMsaFluidComplex *tw, bool inv ) const
+{
+	const int p = factors[0];
+	const int m = factors[1];
+	const ciMsaFluidComplex *outEnd = out + p * m;
+
+	if ( m == 1 )
+	{
+		for ( ciMsaFluidComplex *o = out; o != outEnd; ++o, in += fstride )
+			*o = *in;
+	}
+	else
+	{
+		for ( ciMsaFluidComplex *o = out; o != outEnd; o += m, in += fstride )
+			work( o, in, fstride * p, factors + 2, tw, inv );
+	}
+
+	switch ( p )
+	{
+		case 2: butterfly2( out, fstride, m, tw ); break;
+		case 4: butterfly4( out, fstride, m, tw, inv ); break;
+		default: butterflyGeneric( out, fstride, m, p, tw ); break;
+	}
+}
+
+void ciMsaFluidFFT::butterfly2( ciMsaFluidComplex *out, int fstride, int m, const ciMsaFluidComplex *tw ) const
+{
+	ciMsaFluidComplex *out2 = out + m;
+	for ( int k = 0; k < m; k++ )
+	{
+		ciMsaFluidComplex t = cmul( out2[k], tw[k * fstride] );
+		out2[k] = csub( out[k], t );
+		out[k] = cadd( out[k], t );
+	}
+}
+
+void ciMsaFluidFFT::butterfly4( ciMsaFluidComplex *out, int fstride, int m, const ciMsaFluidComplex *tw, bool inv ) const
+{
+	const int m2 = 2 * m;
+	const int m3 = 3 * m;
+	for ( int k = 0; k < m; k++, ++out )
+	{
+		ciMsaFluidComplex s0 = cmul( out[m], tw[k * fstride] );
+		ciMsaFluidComplex s1 = cmul( out[m2], tw[k * fstride * 2] );
+		ciMsaFluidComplex s2 = cmul( out[m3], tw[k * fstride * 3] );
+
+		ciMsaFluidComplex s5 = csub( out[0], s1 );
+		out[0] = cadd( out[0], s1 );
+		ciMsaFluidComplex s3 = cadd( s0, s2 );
+		ciMsaFluidComplex s4 = csub( s0, s2 );
+		out[m2] = csub( out[0], s3 );
+		out[0] = cadd( out[0], s3 );
+
+		if ( inv )
+		{
+			out[m] = ciMsaFluidComplex( s5.real() - s4.imag(), s5.imag() + s4.real() );
+			out[m3] = ciMsaFluidComplex( s5.real() + s4.imag(), s5.imag() - s4.real() );
+		}
+		else
+		{
+			out[m] = ciMsaFluidComplex( s5.real() + s4.imag(), s5.imag() - s4.real() );
+			out[m3] = ciMsaFluidComplex( s5.real() - s4.imag(), s5.imag() + s4.real() );
+		}
+	}
+}
+
+void ciMsaFluidFFT::butterflyGeneric( ciMsaFluidComplex *out, int fstride, int m, int p, const ciMsaFluidComplex *tw ) const
+{
+	ciMsaFluidComplex *scratch = &_scratch[0];
+
+	for ( int u = 0; u < m; u++ )
+	{
+		for ( int q1 = 0, k = u; q1 < p; q1++, k += m )
+			scratch[q1] = out[k];
+
+		for ( int q1 = 0, k = u; q1 < p; q1++, k += m )
+		{
+			int twidx = 0;
+			ciMsaFluidComplex sum = scratch[0];
+			for ( int q = 1; q < p; q++ )
+			{
+				twidx += fstride * k;
+				if ( twidx >= _n )
+					twidx -= _n;
+				sum = cadd( sum, cmul( scratch[q], tw[twidx] ) );
+			}
+			out[k] = sum;
+		}
+	}
+}
+
+ciMsaFluidSpectralSolver::ciMsaFluidSpectralSolver()
+:_NX(0)
+,_NY(0)
+,_halfNX(0)
+{
+}
+
+void ciMsaFluidSpectralSolver::setup( int NX, int NY )
+{
+	_NX = NX;
+	_NY = NY;
+	_halfNX = NX / 2 + 1;
+
+	_fftX.setup( NX );
+	_fftY.setup( NY );
+
+	_x.assign( ( NX + 2 ) * ( NY + 2 ), 0.0f );
+	_b.assign( ( NX + 2 ) * ( NY + 2 ), 0.0f );
+
+	_cosX.resize( _halfNX );
+	for ( int k = 0; k < _halfNX; k++ )
+		_cosX[k] = (float)( 2.0 - 2.0 * cos( 2.0 * M_PI * k / NX ) );
+	_cosY.resize( NY );
+	for ( int l = 0; l < NY; l++ )
+		_cosY[l] = (float)( 2.0 - 2.0 * cos( 2.0 * M_PI * l / NY ) );
+
+	_spectrum.resize( _halfNX * NY );
+	_row.resize( NX );
+	_rowOut.resize( NX );
+	_col.resize( NY );
+	_colOut.resize( NY );
+}
+
+void ciMsaFluidSpectralSolver::solve( float alpha, float beta )
+{
+	const int stride = _NX + 2;
+	const int h = _halfNX;
+
+	// rows, two real rows packed into one complex transform
+	for ( int j = 0; j < _NY; j += 2 )
+	{
+		const float *b0 = &_b[ 1 + stride * ( j + 1 ) ];
+		const float *b1 = ( j + 1 < _NY ) ? b0 + stride : NULL;
+		for ( int i = 0; i < _NX; i++ )
+			_row[i] = ciMsaFluidComplex( b0[i], b1 ? b1[i] : 0.0f );
+
+		_fftX.forward( &_row[0], &_rowOut[0] );
+
+		ciMsaFluidComplex *s0 = &_spectrum[ j * h ];
+		ciMsaFluidComplex *s1 = s0 + h;
+		for ( int k = 0; k < h; k++ )
+		{
+			ciMsaFluidComplex zk = _rowOut[k];
+			ciMsaFluidComplex znk = std::conj( _rowOut[ k ? _NX - k : 0 ] );
+			s0[k] = ciMsaFluidComplex( 0.5f * ( zk.real() + znk.real() ), 0.5f * ( zk.imag() + znk.imag() ) );
+			if ( b1 )
+				s1[k] = ciMsaFluidComplex( 0.5f * ( zk.imag() - znk.imag() ), -0.5f * ( zk.real() - znk.real() ) );
+		}
+	}
+
+	// columns of the half spectrum, divide by the eigenvalues and transform back
+	const float norm = 1.0f / ( _NX * _NY );
+	for ( int k = 0; k < h; k++ )
+	{
+		for ( int l = 0; l < _NY; l++ )
+			_col[l] = _spectrum[ l * h + k ];
+
+		_fftY.forward( &_col[0], &_colOut[0] );
+
+		for ( int l = 0; l < _NY; l++ )
+		{
+			float lambda = alpha + beta * ( _cosX[k] + _cosY[l] );
+			float scale = ( lambda != 0 ) ? norm / lambda : 0.0f;
+			_colOut[l] *= scale;
+		}
+
+		_fftY.inverse( &_colOut[0], &_col[0] );
+
+		for ( int l = 0; l < _NY; l++ )
+			_spectrum[ l * h + k ] = _col[l];
+	}
+
+	// rows back, each row spectrum is hermitian so the upper half is mirrored from the lower one
+	for ( int j = 0; j < _NY; j += 2 )
+	{
+		const ciMsaFluidComplex *s0 = &_spectrum[ j * h ];
+		const ciMsaFluidComplex *s1 = ( j + 1 < _NY ) ? s0 + h : NULL;
+		for ( int k = 0; k < _NX; k++ )
+		{
+			ciMsaFluidComplex x = ( k < h ) ? s0[k] : std::conj( s0[ _NX - k ] );
+			ciMsaFluidComplex y;
+			if ( s1 )
+				y = ( k < h ) ? s1[k] : std::conj( s1[ _NX - k ] );
+			_row[k] = ciMsaFluidComplex( x.real() - y.imag(), x.imag() + y.real() );
+		}
+
+		_fftX.inverse( &_row[0], &_rowOut[0] );
+
+		float *x0 = &_x[ 1 + stride * ( j + 1 ) ];
+		float *x1 = s1 ? x0 + stride : NULL;
+		for ( int i = 0; i < _NX; i++ )
+		{
+			x0[i] = _rowOut[i].real();
+			if ( x1 )
+				x1[i] = _rowOut[i].imag();
+		}
+	}
+
+	// periodic ghost cells
+	for ( int j = _NY; j > 0; --j )
+	{
+		_x[ stride * j ] = _x[ _NX + stride * j ];
+		_x[ _NX + 1 + stride * j ] = _x[ 1 + stride * j ];
+	}
+	for ( int i = _NX + 1; i >= 0; --i )
+	{
+		_x[i] = _x[ i + stride * _NY ];
+		_x[ i + stride * ( _NY + 1 ) ] = _x[ i + stride ];
+	}
+}
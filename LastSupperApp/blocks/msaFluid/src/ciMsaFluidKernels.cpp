@@ -0,0 +1,258 @@
+/***********************************************************************
+
+ Vectorized inner loops of ciMsaFluidSolver (SSE2 and AVX2), selected at runtime by CPUID.
+
+ The kernel bodies in ciMsaFluidKernels.inl are compiled twice, once with the SSE2 traits
+ and once with the AVX2 traits inside a target("avx2,fma") region, so no special compiler
+ flags are needed and the AVX2 code only runs on cpus that report it.
+
+ ***********************************************************************/
+
+#include <cmath>
+#include <cstddef>
+
+#include "ciMsaFluidKernels.h"
+
+#if defined( __i386__ ) || defined( __x86_64__ ) || defined( _M_IX86 ) || defined( _M_X64 )
+#define FLUID_KERNELS_X86
+#endif
+
+#if defined( FLUID_KERNELS_X86 ) && ( defined( __GNUC__ ) || ( defined( _MSC_VER ) && _MSC_VER >= 1700 ) )
+#define FLUID_KERNELS_AVX2
+#endif
+
+#define FLUID_ZERO_THRESH		1e-9f		// if value falls under this, set to zero (to avoid denormal slowdown)
+
+#ifdef FLUID_KERNELS_X86
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC push_options
+#pragma GCC target( "sse2" )
+#elif defined( __clang__ )
+#pragma clang attribute push( __attribute__(( target( "sse2" ) )), apply_to = function )
+#endif
+
+struct SimdSSE2 {
+	typedef __m128 F;
+	typedef __m128i I;
+	enum { W = 4 };
+
+	static inline F		load( const float *p )			{ return _mm_loadu_ps( p ); }
+	static inline void	store( float *p, F a )			{ _mm_storeu_ps( p, a ); }
+	static inline F		set1( float f )					{ return _mm_set1_ps( f ); }
+	static inline F		zero()							{ return _mm_setzero_ps(); }
+	static inline F		iota()							{ return _mm_set_ps( 3, 2, 1, 0 ); }
+	static inline F		add( F a, F b )					{ return _mm_add_ps( a, b ); }
+	static inline F		sub( F a, F b )					{ return _mm_sub_ps( a, b ); }
+	static inline F		mul( F a, F b )					{ return _mm_mul_ps( a, b ); }
+	static inline F		min( F a, F b )					{ return _mm_min_ps( a, b ); }
+	static inline F		max( F a, F b )					{ return _mm_max_ps( a, b ); }
+	static inline F		abs( F a )						{ return _mm_andnot_ps( _mm_set1_ps( -0.0f ), a ); }
+	static inline F		rsqrt( F a )					{ return _mm_rsqrt_ps( a ); }
+	static inline F		rcp( F a )						{ return _mm_rcp_ps( a ); }
+	static inline F		cmplt( F a, F b )				{ return _mm_cmplt_ps( a, b ); }
+	static inline F		blend( F m, F a, F b )			{ return _mm_or_ps( _mm_and_ps( m, a ), _mm_andnot_ps( m, b ) ); }
+	static inline I		cvttI( F a )					{ return _mm_cvttps_epi32( a ); }
+	static inline F		cvtF( I a )						{ return _mm_cvtepi32_ps( a ); }
+	static inline I		set1I( int i )					{ return _mm_set1_epi32( i ); }
+	static inline I		addI( I a, I b )				{ return _mm_add_epi32( a, b ); }
+
+	static inline F gather( const float *base, I index )
+	{
+		int k[4];
+		_mm_storeu_si128( (__m128i *)k, index );
+		return _mm_set_ps( base[k[3]], base[k[2]], base[k[1]], base[k[0]] );
+	}
+
+	static inline double hsum( F a )
+	{
+		float t[4];
+		_mm_storeu_ps( t, a );
+		return (double)t[0] + t[1] + t[2] + t[3];
+	}
+};
+
+namespace sse2 {
+	typedef SimdSSE2 S;
+#include "ciMsaFluidKernels.inl"
+}
+
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC pop_options
+#elif defined( __clang__ )
+#pragma clang attribute pop
+#endif
+
+#ifdef FLUID_KERNELS_AVX2
+
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC push_options
+#pragma GCC target( "avx2,fma" )
+#elif defined( __clang__ )
+#pragma clang attribute push( __attribute__(( target( "avx2,fma" ) )), apply_to = function )
+#endif
+
+struct SimdAVX2 {
+	typedef __m256 F;
+	typedef __m256i I;
+	enum { W = 8 };
+
+	static inline F		load( const float *p )			{ return _mm256_loadu_ps( p ); }
+	static inline void	store( float *p, F a )			{ _mm256_storeu_ps( p, a ); }
+	static inline F		set1( float f )					{ return _mm256_set1_ps( f ); }
+	static inline F		zero()							{ return _mm256_setzero_ps(); }
+	static inline F		iota()							{ return _mm256_set_ps( 7, 6, 5, 4, 3, 2, 1, 0 ); }
+	static inline F		add( F a, F b )					{ return _mm256_add_ps( a, b ); }
+	static inline F		sub( F a, F b )					{ return _mm256_sub_ps( a, b ); }
+	static inline F		mul( F a, F b )					{ return _mm256_mul_ps( a, b ); }
+	static inline F		min( F a, F b )					{ return _mm256_min_ps( a, b ); }
+	static inline F		max( F a, F b )					{ return _mm256_max_ps( a, b ); }
+	static inline F		abs( F a )						{ return _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), a ); }
+	static inline F		rsqrt( F a )					{ return _mm256_rsqrt_ps( a ); }
+	static inline F		rcp( F a )						{ return _mm256_rcp_ps( a ); }
+	static inline F		cmplt( F a, F b )				{ return _mm256_cmp_ps( a, b, _CMP_LT_OQ ); }
+	static inline F		blend( F m, F a, F b )			{ return _mm256_blendv_ps( b, a, m ); }
+	static inline I		cvttI( F a )					{ return _mm256_cvttps_epi32( a ); }
+	static inline F		cvtF( I a )						{ return _mm256_cvtepi32_ps( a ); }
+	static inline I		set1I( int i )					{ return _mm256_set1_epi32( i ); }
+	static inline I		addI( I a, I b )				{ return _mm256_add_epi32( a, b ); }
+	static inline F		gather( const float *base, I index )	{ return _mm256_i32gather_ps( base, index, 4 ); }
+
+	static inline double hsum( F a )
+	{
+		float t[8];
+		_mm256_storeu_ps( t, a );
+		return (double)t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+	}
+};
+
+namespace avx2 {
+	typedef SimdAVX2 S;
+#include "ciMsaFluidKernels.inl"
+}
+
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC pop_options
+#elif defined( __clang__ )
+#pragma clang attribute pop
+#endif
+
+#endif // FLUID_KERNELS_AVX2
+
+static void cpuid( int info[4], int leaf, int subleaf )
+{
+#ifdef _MSC_VER
+	__cpuidex( info, leaf, subleaf );
+#else
+	__cpuid_count( leaf, subleaf, info[0], info[1], info[2], info[3] );
+#endif
+}
+
+#ifdef FLUID_KERNELS_AVX2
+static unsigned long long xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv( 0 );
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__( "xgetbv" : "=a"( lo ), "=d"( hi ) : "c"( 0 ) );
+	return ( (unsigned long long)hi << 32 ) | lo;
+#endif
+}
+#endif
+
+static const ciMsaFluidKernels sKernelsSSE2 = {
+	FLUID_SIMD_SSE2,
+	sse2::addSource,
+	sse2::relaxRow,
+	sse2::residualRow,
+	sse2::advectRow,
+	sse2::fadeDye,
+	sse2::fadeVelocity,
+	sse2::flushZero,
+	sse2::tileMax,
+	sse2::curlRow,
+	sse2::vorticityRow,
+	sse2::sampleBilinear
+};
+
+#ifdef FLUID_KERNELS_AVX2
+static const ciMsaFluidKernels sKernelsAVX2 = {
+	FLUID_SIMD_AVX2,
+	avx2::addSource,
+	avx2::relaxRow,
+	avx2::residualRow,
+	avx2::advectRow,
+	avx2::fadeDye,
+	avx2::fadeVelocity,
+	avx2::flushZero,
+	avx2::tileMax,
+	avx2::curlRow,
+	avx2::vorticityRow,
+	avx2::sampleBilinear
+};
+#endif
+
+#endif // FLUID_KERNELS_X86
+
+int ciMsaFluidKernels::detectSimdLevel()
+{
+	static int level = -1;
+	if ( level >= 0 )
+		return level;
+
+	level = FLUID_SIMD_NONE;
+#ifdef FLUID_KERNELS_X86
+	int info[4];
+	cpuid( info, 0, 0 );
+	int maxLeaf = info[0];
+
+	cpuid( info, 1, 0 );
+	if ( info[3] & ( 1 << 26 ) )
+		level = FLUID_SIMD_SSE2;
+
+#ifdef FLUID_KERNELS_AVX2
+	bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+	bool avx = ( info[2] & ( 1 << 28 ) ) != 0;
+	bool fma = ( info[2] & ( 1 << 12 ) ) != 0;
+	if ( osxsave && avx && fma && ( ( xgetbv0() & 6 ) == 6 ) && ( maxLeaf >= 7 ) )
+	{
+		cpuid( info, 7, 0 );
+		if ( info[1] & ( 1 << 5 ) )
+			level = FLUID_SIMD_AVX2;
+	}
+#else
+	(void)maxLeaf;
+#endif
+#endif
+	return level;
+}
+
+const ciMsaFluidKernels* ciMsaFluidKernels::get( int simdLevel )
+{
+	int level = detectSimdLevel();
+	if ( simdLevel < level )
+		level = simdLevel;
+
+	switch ( level )
+	{
+#ifdef FLUID_KERNELS_X86
+		case FLUID_SIMD_SSE2:
+			return &sKernelsSSE2;
+#ifdef FLUID_KERNELS_AVX2
+		case FLUID_SIMD_AVX2:
+			return &sKernelsAVX2;
+#endif
+#endif
+		default:
+			return NULL;
+	}
+}
@@ -0,0 +1,393 @@
+/***********************************************************************
+
+ Kernel bodies for ciMsaFluidKernels, included once per instruction set by ciMsaFluidKernels.cpp
+ with S being the vector traits (SimdSSE2, SimdAVX2) of that instruction set.
+
+ ***********************************************************************/
+
+static void addSource( float * __restrict x, const float * __restrict x0, float dt, int n )
+{
+	const S::F vdt = S::set1( dt );
+	int i = 0;
+	for ( ; i <= n - S::W; i += S::W )
+		S::store( x + i, S::add( S::load( x + i ), S::mul( vdt, S::load( x0 + i ) ) ) );
+	for ( ; i < n; i++ )
+		x[i] += dt * x0[i];
+}
+
+static inline S::F relaxVector( const float *x, const float *x0, int f, int rowStep, S::F va, S::F vc, S::F vmask )
+{
+	S::F sum = S::add( S::add( S::load( x + f - 1 ), S::load( x + f + 1 ) ),
+					   S::add( S::load( x + f - rowStep ), S::load( x + f + rowStep ) ) );
+	S::F res = S::mul( S::add( S::mul( sum, va ), S::load( x0 + f ) ), vc );
+	return S::blend( vmask, res, S::load( x + f ) );
+}
+
+static void relaxRow( float *x, const float *x0, int begin, int count, int rowStep,
+		float a, float c, const float *mask )
+{
+	const S::F va = S::set1( a );
+	const S::F vc = S::set1( c );
+	const S::F vmask = S::load( mask );
+	const int end = begin + count;
+
+	// the left neighbours of a vector overlap the previous vector, storing it only after the next
+	// one is loaded avoids a store forwarding stall. the other color is not written, so the loaded
+	// values are the same either way
+	int f = begin;
+	if ( f <= end - S::W )
+	{
+		S::F pending = relaxVector( x, x0, f, rowStep, va, vc, vmask );
+		for ( f += S::W; f <= end - S::W; f += S::W )
+		{
+			S::F res = relaxVector( x, x0, f, rowStep, va, vc, vmask );
+			S::store( x + f - S::W, pending );
+			pending = res;
+		}
+		S::store( x + f - S::W, pending );
+	}
+	for ( ; f < end; f++ )
+	{
+		if ( mask[ ( f - begin ) & ( FLUID_SIMD_MAX_WIDTH - 1 ) ] != 0 )
+			x[f] = ( ( x[f-1] + x[f+1] + x[f-rowStep] + x[f+rowStep] ) * a + x0[f] ) * c;
+	}
+}
+
+static void residualRow( const float *x, const float *x0, int begin, int count, int rowStep,
+		float a, float diag, double *sumResidual2, double *sumRhs2 )
+{
+	const S::F va = S::set1( a );
+	const S::F vdiag = S::set1( diag );
+	const int end = begin + count;
+
+	S::F res2 = S::zero();
+	S::F rhs2 = S::zero();
+	int f = begin;
+	for ( ; f <= end - S::W; f += S::W )
+	{
+		S::F sum = S::add( S::add( S::load( x + f - 1 ), S::load( x + f + 1 ) ),
+						   S::add( S::load( x + f - rowStep ), S::load( x + f + rowStep ) ) );
+		S::F b = S::load( x0 + f );
+		S::F r = S::sub( S::add( b, S::mul( sum, va ) ), S::mul( vdiag, S::load( x + f ) ) );
+		res2 = S::add( res2, S::mul( r, r ) );
+		rhs2 = S::add( rhs2, S::mul( b, b ) );
+	}
+
+	double sumRes = S::hsum( res2 );
+	double sumRhs = S::hsum( rhs2 );
+	for ( ; f < end; f++ )
+	{
+		float r = x0[f] + ( x[f-1] + x[f+1] + x[f-rowStep] + x[f+rowStep] ) * a - diag * x[f];
+		sumRes += r * r;
+		sumRhs += x0[f] * x0[f];
+	}
+	*sumResidual2 += sumRes;
+	*sumRhs2 += sumRhs;
+}
+
+static inline float advectSample( const float *d0, int i0, int stride, float s0, float s1, float t0, float t1 )
+{
+	const float *p = d0 + i0;
+	return s0 * ( t0 * p[0] + t1 * p[stride] ) + s1 * ( t0 * p[1] + t1 * p[stride + 1] );
+}
+
+static void advectRow( const ciMsaFluidAdvectArgs &args, int j, int i0, int i1 )
+{
+	const int stride = args.stride;
+	const float minX = args.minX, maxX = args.maxX;
+	const float minY = args.minY, maxY = args.maxY;
+
+	const S::F vdt0x = S::set1( args.dt0x );
+	const S::F vdt0y = S::set1( args.dt0y );
+	const S::F vminX = S::set1( minX );
+	const S::F vmaxX = S::set1( maxX );
+	const S::F vminY = S::set1( minY );
+	const S::F vmaxY = S::set1( maxY );
+	const S::F vone = S::set1( 1.0f );
+	const S::F vj = S::set1( (float)j );
+	const S::F vstride = S::set1( (float)stride );
+	const S::I voffX = S::set1I( 1 );
+	const S::I voffY = S::set1I( stride );
+	const S::I voffXY = S::set1I( stride + 1 );
+
+	int i = i0;
+	int index = i + stride * j;
+	for ( ; i <= i1 - S::W; i += S::W, index += S::W )
+	{
+		S::F u = S::load( args.du + index );
+		S::F v = S::load( args.dv + index );
+
+		S::F x = S::sub( S::add( S::set1( (float)i ), S::iota() ), S::mul( vdt0x, u ) );
+		S::F y = S::sub( vj, S::mul( vdt0y, v ) );
+		x = S::max( S::min( x, vmaxX ), vminX );
+		y = S::max( S::min( y, vmaxY ), vminY );
+
+		// x and y are positive, truncation is floor
+		S::F x0 = S::cvtF( S::cvttI( x ) );
+		S::F y0 = S::cvtF( S::cvttI( y ) );
+		S::F s1 = S::sub( x, x0 );
+		S::F s0 = S::sub( vone, s1 );
+		S::F t1 = S::sub( y, y0 );
+		S::F t0 = S::sub( vone, t1 );
+
+		S::I i00 = S::cvttI( S::add( x0, S::mul( vstride, y0 ) ) );
+		S::I i10 = S::addI( i00, voffX );
+		S::I i01 = S::addI( i00, voffY );
+		S::I i11 = S::addI( i00, voffXY );
+
+		S::F res[FLUID_MAX_ADVECT_FIELDS];
+		for ( int k = 0; k < args.numFields; k++ )
+		{
+			const float *d0 = args.src[k];
+			S::F a = S::gather( d0, i00 );
+			S::F b = S::gather( d0, i10 );
+			S::F c = S::gather( d0, i01 );
+			S::F d = S::gather( d0, i11 );
+			res[k] = S::add( S::mul( s0, S::add( S::mul( t0, a ), S::mul( t1, c ) ) ),
+							 S::mul( s1, S::add( S::mul( t0, b ), S::mul( t1, d ) ) ) );
+		}
+
+		for ( int k = 0; k < args.numFields; k++ )
+			S::store( args.dst[k] + index, res[k] );
+	}
+
+	for ( ; i < i1; i++, index++ )
+	{
+		float x = i - args.dt0x * args.du[index];
+		float y = j - args.dt0y * args.dv[index];
+		if ( x > maxX ) x = maxX;
+		if ( x < minX ) x = minX;
+		if ( y > maxY ) y = maxY;
+		if ( y < minY ) y = minY;
+		int x0 = (int)x;
+		int y0 = (int)y;
+		float s1 = x - x0;
+		float t1 = y - y0;
+		for ( int k = 0; k < args.numFields; k++ )
+			args.dst[k][index] = advectSample( args.src[k], x0 + stride * y0, stride, 1 - s1, s1, 1 - t1, t1 );
+	}
+}
+
+template< bool FLUSH >
+static void fadeDyeT( float **x, float **xOld, int numPlanes, int n, float holdAmount )
+{
+	const S::F vone = S::set1( 1.0f );
+	const S::F vhold = S::set1( holdAmount );
+	const S::F vthresh = S::set1( FLUID_ZERO_THRESH );
+	const S::F vzero = S::zero();
+
+	for ( int k = 0; k < numPlanes; k++ )
+	{
+		float *p = x[k];
+		float *pOld = xOld[k];
+		int i = 0;
+		for ( ; i <= n - S::W; i += S::W )
+		{
+			S::F d = S::mul( S::min( vone, S::load( p + i ) ), vhold );
+			if ( FLUSH )
+				d = S::blend( S::cmplt( S::abs( d ), vthresh ), vzero, d );
+			S::store( p + i, d );
+			S::store( pOld + i, vzero );
+		}
+		for ( ; i < n; i++ )
+		{
+			float d = ( p[i] < 1.0f ? p[i] : 1.0f ) * holdAmount;
+			p[i] = ( FLUSH && fabsf( d ) < FLUID_ZERO_THRESH ) ? 0.0f : d;
+			pOld[i] = 0;
+		}
+	}
+}
+
+static void fadeDye( float **x, float **xOld, int numPlanes, int n, float holdAmount, bool flush )
+{
+	if ( flush )
+		fadeDyeT< true >( x, xOld, numPlanes, n, holdAmount );
+	else
+		fadeDyeT< false >( x, xOld, numPlanes, n, holdAmount );
+}
+
+template< bool FLUSH >
+static void fadeVelocityT( float *x, float *xOld, int n )
+{
+	const S::F vthresh = S::set1( FLUID_ZERO_THRESH );
+	const S::F vzero = S::zero();
+
+	int i = 0;
+	for ( ; i <= n - S::W; i += S::W )
+	{
+		if ( FLUSH )
+		{
+			S::F v = S::load( x + i );
+			S::store( x + i, S::blend( S::cmplt( S::abs( v ), vthresh ), vzero, v ) );
+		}
+		S::store( xOld + i, vzero );
+	}
+
+	for ( ; i < n; i++ )
+	{
+		if ( FLUSH && fabsf( x[i] ) < FLUID_ZERO_THRESH )
+			x[i] = 0;
+		xOld[i] = 0;
+	}
+}
+
+static void fadeVelocity( float *x, float *xOld, int n, bool flush )
+{
+	if ( flush )
+		fadeVelocityT< true >( x, xOld, n );
+	else
+		fadeVelocityT< false >( x, xOld, n );
+}
+
+static void flushZero( float *x, int n )
+{
+	const S::F vthresh = S::set1( FLUID_ZERO_THRESH );
+	const S::F vzero = S::zero();
+
+	int i = 0;
+	for ( ; i <= n - S::W; i += S::W )
+	{
+		S::F v = S::load( x + i );
+		S::store( x + i, S::blend( S::cmplt( S::abs( v ), vthresh ), vzero, v ) );
+	}
+	for ( ; i < n; i++ )
+	{
+		if ( fabsf( x[i] ) < FLUID_ZERO_THRESH )
+			x[i] = 0;
+	}
+}
+
+static void tileMax( const float *x, int n, int tileSize, float *tileMax )
+{
+	for ( int k = 0; k * tileSize < n; k++ )
+	{
+		const float *p = x + k * tileSize;
+		int count = ( n - k * tileSize < tileSize ) ? n - k * tileSize : tileSize;
+		S::F m = S::zero();
+		int i = 0;
+		for ( ; i <= count - S::W; i += S::W )
+			m = S::max( m, S::abs( S::load( p + i ) ) );
+
+		float tmp[S::W];
+		S::store( tmp, m );
+		float mx = tileMax[k];
+		for ( int l = 0; l < S::W; l++ )
+			mx = tmp[l] > mx ? tmp[l] : mx;
+		for ( ; i < count; i++ )
+			mx = fabsf( p[i] ) > mx ? fabsf( p[i] ) : mx;
+		tileMax[k] = mx;
+	}
+}
+
+static void curlRow( const float * __restrict u, const float * __restrict v, float * __restrict w, int n, int stride )
+{
+	const S::F vhalf = S::set1( 0.5f );
+	int i = 0;
+	for ( ; i <= n - S::W; i += S::W )
+	{
+		S::F du_dy = S::sub( S::load( u + i + stride ), S::load( u + i - stride ) );
+		S::F dv_dx = S::sub( S::load( v + i + 1 ), S::load( v + i - 1 ) );
+		S::store( w + i, S::mul( S::sub( du_dy, dv_dx ), vhalf ) );
+	}
+	for ( ; i < n; i++ )
+		w[i] = ( ( u[i + stride] - u[i - stride] ) - ( v[i + 1] - v[i - 1] ) ) * 0.5f;
+}
+
+static void vorticityRow( const float *wDown, const float *w, const float *wUp,
+		float * __restrict fx, float * __restrict fy, int n )
+{
+	// 2 / ( |grad| + epsilon ) like the scalar loop, the epsilon damps the force where the gradient is tiny.
+	// |grad| = grad^2 * rsqrt( grad^2 ), the floor keeps rsqrt finite where the gradient vanishes
+	const S::F veps = S::set1( 0.000001f );
+	const S::F vfloor = S::set1( 1e-30f );
+	const S::F vhalf = S::set1( 0.5f );
+	const S::F vthreeHalves = S::set1( 1.5f );
+	const S::F vtwo = S::set1( 2.0f );
+	int i = 0;
+	for ( ; i <= n - S::W; i += S::W )
+	{
+		S::F dw_dx = S::sub( S::abs( S::load( w + i + 1 ) ), S::abs( S::load( w + i - 1 ) ) );
+		S::F dw_dy = S::sub( S::abs( S::load( wUp + i ) ), S::abs( S::load( wDown + i ) ) );
+		S::F length2 = S::max( S::add( S::mul( dw_dx, dw_dx ), S::mul( dw_dy, dw_dy ) ), vfloor );
+
+		// one newton step each: y = y * ( 1.5 - 0.5 * x * y^2 ) and y = y * ( 2 - x * y )
+		S::F y = S::rsqrt( length2 );
+		y = S::mul( y, S::sub( vthreeHalves, S::mul( S::mul( vhalf, length2 ), S::mul( y, y ) ) ) );
+		S::F length = S::add( S::mul( length2, y ), veps );
+		S::F scale = S::rcp( length );
+		scale = S::mul( scale, S::sub( vtwo, S::mul( length, scale ) ) );
+		scale = S::mul( S::mul( scale, vtwo ), S::load( w + i ) );
+
+		S::store( fx + i, S::sub( S::zero(), S::mul( dw_dy, scale ) ) );
+		S::store( fy + i, S::mul( dw_dx, scale ) );
+	}
+	for ( ; i < n; i++ )
+	{
+		float dw_dx = fabsf( w[i + 1] ) - fabsf( w[i - 1] );
+		float dw_dy = fabsf( wUp[i] ) - fabsf( wDown[i] );
+		float scale = 2.0f / ( sqrtf( dw_dx * dw_dx + dw_dy * dw_dy ) + 0.000001f ) * w[i];
+		fx[i] = -dw_dy * scale;
+		fy[i] = dw_dx * scale;
+	}
+}
+
+static void sampleBilinear( const float *u, const float *v, int NX, int NY, int stride,
+		const float *x, const float *y, float *outU, float *outV, int n )
+{
+	const S::F vNX = S::set1( (float)NX );
+	const S::F vNY = S::set1( (float)NY );
+	const S::F vmaxX = S::set1( NX + 1.0f );
+	const S::F vmaxY = S::set1( NY + 1.0f );
+	const S::F vhalf = S::set1( 0.5f );
+	const S::F vzero = S::zero();
+	const S::F vone = S::set1( 1.0f );
+	const S::F vstride = S::set1( (float)stride );
+	const S::I voffX = S::set1I( 1 );
+	const S::I voffY = S::set1I( stride );
+	const S::I voffXY = S::set1I( stride + 1 );
+
+	int k = 0;
+	for ( ; k <= n - S::W; k += S::W )
+	{
+		S::F fx = S::add( S::mul( S::load( x + k ), vNX ), vhalf );
+		S::F fy = S::add( S::mul( S::load( y + k ), vNY ), vhalf );
+		fx = S::max( S::min( fx, vmaxX ), vzero );
+		fy = S::max( S::min( fy, vmaxY ), vzero );
+
+		// the last cell of a row or column is only weighted, never the left / lower corner of a sample
+		S::F x0 = S::min( S::cvtF( S::cvttI( fx ) ), vNX );
+		S::F y0 = S::min( S::cvtF( S::cvttI( fy ) ), vNY );
+		S::F s1 = S::sub( fx, x0 );
+		S::F s0 = S::sub( vone, s1 );
+		S::F t1 = S::sub( fy, y0 );
+		S::F t0 = S::sub( vone, t1 );
+
+		S::I i00 = S::cvttI( S::add( x0, S::mul( vstride, y0 ) ) );
+		S::I i10 = S::addI( i00, voffX );
+		S::I i01 = S::addI( i00, voffY );
+		S::I i11 = S::addI( i00, voffXY );
+
+		S::store( outU + k, S::add( S::mul( s0, S::add( S::mul( t0, S::gather( u, i00 ) ), S::mul( t1, S::gather( u, i01 ) ) ) ),
+									S::mul( s1, S::add( S::mul( t0, S::gather( u, i10 ) ), S::mul( t1, S::gather( u, i11 ) ) ) ) ) );
+		S::store( outV + k, S::add( S::mul( s0, S::add( S::mul( t0, S::gather( v, i00 ) ), S::mul( t1, S::gather( v, i01 ) ) ) ),
+									S::mul( s1, S::add( S::mul( t0, S::gather( v, i10 ) ), S::mul( t1, S::gather( v, i11 ) ) ) ) ) );
+	}
+
+	for ( ; k < n; k++ )
+	{
+		float fx = x[k] * NX + 0.5f;
+		float fy = y[k] * NY + 0.5f;
+		if ( fx > NX + 1.0f ) fx = NX + 1.0f;
+		if ( fx < 0 ) fx = 0;
+		if ( fy > NY + 1.0f ) fy = NY + 1.0f;
+		if ( fy < 0 ) fy = 0;
+		int x0 = (int)fx;
+		int y0 = (int)fy;
+		if ( x0 > NX ) x0 = NX;
+		if ( y0 > NY ) y0 = NY;
+		float s1 = fx - x0;
+		float t1 = fy - y0;
+		outU[k] = advectSample( u, x0 + stride * y0, stride, 1 - s1, s1, 1 - t1, t1 );
+		outV[k] = advectSample( v, x0 + stride * y0, stride, 1 - s1, s1, 1 - t1, t1 );
+	}
+}
@@ -0,0 +1,242 @@
+/***********************************************************************
+
+ Geometric multigrid V-cycle solver for the cell centered 5-point systems of ciMsaFluidSolver
+
+ ***********************************************************************/
+
+#include <algorithm>
+#include <cmath>
+
+#include "ciMsaFluidMultigrid.h"
+
+#define MG_IX( l, i, j )	( ( i ) + ( l ).stride * ( j ) )
+
+ciMsaFluidMultigrid::ciMsaFluidMultigrid()
+:wrap_x(false)
+,wrap_y(false)
+,_boundaryType(0)
+,_residual(0)
+{
+}
+
+void ciMsaFluidMultigrid::setup( int NX, int NY )
+{
+	_levels.clear();
+
+	int nx = NX;
+	int ny = NY;
+	for (;;)
+	{
+		Level l;
+		l.nx = nx;
+		l.ny = ny;
+		l.stride = nx + 2;
+		int numCells = ( nx + 2 ) * ( ny + 2 );
+		l.x.assign( numCells, 0.0f );
+		l.b.assign( numCells, 0.0f );
+		l.r.assign( numCells, 0.0f );
+		_levels.push_back( l );
+
+		if ( ( nx & 1 ) || ( ny & 1 ) ||
+			 ( nx / 2 < FLUID_MULTIGRID_MIN_SIZE ) || ( ny / 2 < FLUID_MULTIGRID_MIN_SIZE ) )
+			break;
+		nx /= 2;
+		ny /= 2;
+	}
+}
+
+void ciMsaFluidMultigrid::setWrap( bool bx, bool by )
+{
+	wrap_x = bx;
+	wrap_y = by;
+}
+
+void ciMsaFluidMultigrid::setBoundaryType( int b )
+{
+	_boundaryType = b;
+}
+
+// ghost columns first, then full ghost rows, so the corners are consistent for both modes
+void ciMsaFluidMultigrid::setBoundary( Level &l, std::vector< float > &x )
+{
+	int srcL = wrap_x ? l.nx : 1;
+	int srcR = wrap_x ? 1 : l.nx;
+	float signX = ( _boundaryType == 1 && !wrap_x ) ? -1.0f : 1.0f;
+	for ( int j = l.ny; j > 0; --j )
+	{
+		x[ MG_IX( l, 0, j ) ] = signX * x[ MG_IX( l, srcL, j ) ];
+		x[ MG_IX( l, l.nx + 1, j ) ] = signX * x[ MG_IX( l, srcR, j ) ];
+	}
+
+	int srcT = wrap_y ? l.ny : 1;
+	int srcB = wrap_y ? 1 : l.ny;
+	float signY = ( _boundaryType == 2 && !wrap_y ) ? -1.0f : 1.0f;
+	for ( int i = l.nx + 1; i >= 0; --i )
+	{
+		x[ MG_IX( l, i, 0 ) ] = signY * x[ MG_IX( l, i, srcT ) ];
+		x[ MG_IX( l, i, l.ny + 1 ) ] = signY * x[ MG_IX( l, i, srcB ) ];
+	}
+}
+
+// red-black Gauss-Seidel
+void ciMsaFluidMultigrid::smooth( Level &l, float alpha, float beta, int sweeps )
+{
+	float * __restrict x = &l.x[0];
+	const float * __restrict b = &l.b[0];
+	const int step = l.stride;
+	const float c = 1.0f / ( alpha + 4 * beta );
+
+	for ( int k = sweeps; k > 0; --k )
+	{
+		for ( int color = 0; color < 2; ++color )
+		{
+			for ( int j = l.ny; j > 0; --j )
+			{
+				int i = 1 + ( ( j + 1 + color ) & 1 );
+				int index = MG_IX( l, i, j );
+				for ( ; i <= l.nx; i += 2, index += 2 )
+				{
+					x[index] = ( b[index] + beta * ( x[index-1] + x[index+1] + x[index-step] + x[index+step] ) ) * c;
+				}
+			}
+			setBoundary( l, l.x );
+		}
+	}
+}
+
+float ciMsaFluidMultigrid::calcResidual( Level &l, float alpha, float beta )
+{
+	const float * __restrict x = &l.x[0];
+	const float * __restrict b = &l.b[0];
+	float * __restrict r = &l.r[0];
+	const int step = l.stride;
+	const float diag = alpha + 4 * beta;
+
+	double sum = 0;
+	for ( int j = l.ny; j > 0; --j )
+	{
+		int index = MG_IX( l, l.nx, j );
+		for ( int i = l.nx; i > 0; --i )
+		{
+			float res = b[index] - diag * x[index] + beta * ( x[index-1] + x[index+1] + x[index-step] + x[index+step] );
+			r[index] = res;
+			sum += res * res;
+			--index;
+		}
+	}
+	return (float)sqrt( sum / ( l.nx * l.ny ) );
+}
+
+// the coarse rhs is the average of the 4 fine residuals under each coarse cell,
+// the coarse operator uses beta / 4 to account for the doubled cell size
+void ciMsaFluidMultigrid::restrictResidual( const Level &fine, Level &coarse )
+{
+	for ( int j = coarse.ny; j > 0; --j )
+	{
+		for ( int i = coarse.nx; i > 0; --i )
+		{
+			int f = MG_IX( fine, 2 * i - 1, 2 * j - 1 );
+			int c = MG_IX( coarse, i, j );
+			coarse.b[c] = 0.25f * ( fine.r[f] + fine.r[f+1] + fine.r[f+fine.stride] + fine.r[f+fine.stride+1] );
+		}
+	}
+	std::fill( coarse.x.begin(), coarse.x.end(), 0.0f );
+}
+
+// bilinear interpolation of the coarse correction, weights 9/16, 3/16, 3/16, 1/16
+void ciMsaFluidMultigrid::prolongate( const Level &coarse, Level &fine )
+{
+	for ( int j = fine.ny; j > 0; --j )
+	{
+		int J = ( j + 1 ) / 2;
+		int dJ = ( j & 1 ) ? -coarse.stride : coarse.stride;
+		int index = MG_IX( fine, fine.nx, j );
+		for ( int i = fine.nx; i > 0; --i )
+		{
+			int I = ( i + 1 ) / 2;
+			int dI = ( i & 1 ) ? -1 : 1;
+			int c = MG_IX( coarse, I, J );
+			fine.x[index] += 0.5625f * coarse.x[c] +
+				0.1875f * ( coarse.x[c+dI] + coarse.x[c+dJ] ) +
+				0.0625f * coarse.x[c+dI+dJ];
+			--index;
+		}
+	}
+	setBoundary( fine, fine.x );
+}
+
+// pure Neumann and periodic problems with alpha = 0 are singular, the rhs needs zero mean to be solvable
+void ciMsaFluidMultigrid::removeMean( Level &l, std::vector< float > &x )
+{
+	double sum = 0;
+	for ( int j = l.ny; j > 0; --j )
+	{
+		int index = MG_IX( l, 1, j );
+		for ( int i = l.nx; i > 0; --i )
+			sum += x[index++];
+	}
+	float mean = (float)( sum / ( l.nx * l.ny ) );
+	for ( int j = l.ny; j > 0; --j )
+	{
+		int index = MG_IX( l, 1, j );
+		for ( int i = l.nx; i > 0; --i )
+			x[index++] -= mean;
+	}
+}
+
+void ciMsaFluidMultigrid::vCycle( int level, float alpha, float beta )
+{
+	Level &l = _levels[level];
+
+	if ( level == (int)_levels.size() - 1 )
+	{
+		if ( alpha == 0 )
+			removeMean( l, l.b );
+		smooth( l, alpha, beta, FLUID_MULTIGRID_COARSE_SWEEPS );
+		return;
+	}
+
+	smooth( l, alpha, beta, FLUID_MULTIGRID_PRE_SWEEPS );
+	calcResidual( l, alpha, beta );
+
+	Level &coarse = _levels[level + 1];
+	restrictResidual( l, coarse );
+	setBoundary( coarse, coarse.x );
+	vCycle( level + 1, alpha, beta * 0.25f );
+
+	prolongate( coarse, l );
+	smooth( l, alpha, beta, FLUID_MULTIGRID_POST_SWEEPS );
+}
+
+int ciMsaFluidMultigrid::solve( float alpha, float beta, float tolerance, int maxCycles )
+{
+	Level &l = _levels[0];
+
+	if ( alpha == 0 )
+		removeMean( l, l.b );
+	setBoundary( l, l.x );
+
+	float bNorm = 0;
+	for ( int j = l.ny; j > 0; --j )
+	{
+		int index = MG_IX( l, 1, j );
+		for ( int i = l.nx; i > 0; --i, ++index )
+			bNorm += l.b[index] * l.b[index];
+	}
+	bNorm = sqrtf( bNorm / ( l.nx * l.ny ) );
+	if ( bNorm == 0 )
+	{
+		_residual = 0;
+		return 0;
+	}
+
+	int cycles = 0;
+	_residual = calcResidual( l, alpha, beta ) / bNorm;
+	while ( ( _residual > tolerance ) && ( cycles < maxCycles ) )
+	{
+		vCycle( 0, alpha, beta );
+		_residual = calcResidual( l, alpha, beta ) / bNorm;
+		cycles++;
+	}
+	return cycles;
+}
@@ -0,0 +1,253 @@
+/***********************************************************************
+
+ Runs a ciMsaFluidSolver on its own thread at a fixed step rate
+
+ ***********************************************************************/
+
+#include <algorithm>
+
+#include "cinder/Timer.h"
+#include "cinder/Utilities.h"
+
+#include "ciMsaFluidSimThread.h"
+
+// flag in _ready marking a snapshot published after the reader's last acquire
+#define FLUID_SIM_SNAPSHOT_NEW		4
+
+ciMsaFluidSimThread::ciMsaFluidSimThread()
+:_solver(NULL)
+,_fieldQueue(FLUID_SIM_FIELD_QUEUE_SIZE)
+,_back(2)
+,_front(0)
+{
+	setQueueSize( FLUID_SIM_DEFAULT_QUEUE_SIZE );
+	_stop = false;
+	_rate = FLUID_SIM_DEFAULT_RATE;
+	_queueHead = 0;
+	_queueTail = 0;
+	_fieldQueueHead = 0;
+	_fieldQueueTail = 0;
+	_droppedInjections = 0;
+	_resetPending = false;
+	_ready = 1;
+	_stepCount = 0;
+	_skippedSteps = 0;
+}
+
+ciMsaFluidSimThread::~ciMsaFluidSimThread()
+{
+	stop();
+}
+
+void ciMsaFluidSimThread::start( ciMsaFluidSolver *solver, float stepsPerSecond )
+{
+	stop();
+
+	_solver = solver;
+	setRate( stepsPerSecond );
+	_queueHead = _queueTail.load();
+	_fieldQueueHead = _fieldQueueTail.load();
+	_resetPending = false;
+
+	// readers get the current state until the first step is published
+	_snapshots[_back].capture( *_solver, _stepCount );
+	publish();
+
+	_stop = false;
+	_thread = std::shared_ptr< std::thread >( new std::thread( std::bind( &ciMsaFluidSimThread::threadLoop, this ) ) );
+}
+
+void ciMsaFluidSimThread::stop()
+{
+	if ( !_thread )
+		return;
+
+	_stop = true;
+	_thread->join();
+	_thread.reset();
+
+	// the caller owns the solver again, hand over what is still pending
+	applyPending();
+}
+
+void ciMsaFluidSimThread::setRate( float stepsPerSecond )
+{
+	_rate = std::max( stepsPerSecond, 1.0f );
+}
+
+void ciMsaFluidSimThread::setQueueSize( int injections )
+{
+	if ( isRunning() )
+		return;
+
+	unsigned size = 1;
+	while ( size < (unsigned)injections )
+		size *= 2;
+	_queue.resize( size );
+	_queueMask = size - 1;
+}
+
+bool ciMsaFluidSimThread::addForceAtPos( const ci::Vec2f &pos, const ci::Vec2f &force )
+{
+	Injection injection = { pos, ci::Vec3f( force.x, force.y, 0 ), true };
+	return push( injection );
+}
+
+bool ciMsaFluidSimThread::addColorAtPos( const ci::Vec2f &pos, const ci::Color &color )
+{
+	Injection injection = { pos, ci::Vec3f( color.r, color.g, color.b ), false };
+	return push( injection );
+}
+
+bool ciMsaFluidSimThread::push( const Injection &injection )
+{
+	unsigned tail = _queueTail.load( std::memory_order_relaxed );
+	if ( tail - _queueHead.load( std::memory_order_acquire ) > _queueMask )
+	{
+		_droppedInjections++;
+		return false;
+	}
+	_queue[ tail & _queueMask ] = injection;
+	_queueTail.store( tail + 1, std::memory_order_release );
+	return true;
+}
+
+bool ciMsaFluidSimThread::addForceField( const float *field, int width, int height, int fieldStride, const ci::Rectf &rect,
+										 const ci::Vec2f &scale, float minLength2, float colorAmount, bool bilinear )
+{
+	unsigned tail = _fieldQueueTail.load( std::memory_order_relaxed );
+	if ( tail - _fieldQueueHead.load( std::memory_order_acquire ) >= FLUID_SIM_FIELD_QUEUE_SIZE )
+	{
+		_droppedInjections++;
+		return false;
+	}
+
+	FieldInjection &injection = _fieldQueue[ tail & ( FLUID_SIM_FIELD_QUEUE_SIZE - 1 ) ];
+	injection.field.resize( 2 * width * height );
+	for ( int y = 0; y < height; y++ )
+		std::copy( field + y * fieldStride, field + y * fieldStride + 2 * width, injection.field.begin() + 2 * width * y );
+	injection.width = width;
+	injection.height = height;
+	injection.rect = rect;
+	injection.scale = scale;
+	injection.minLength2 = minLength2;
+	injection.colorAmount = colorAmount;
+	injection.bilinear = bilinear;
+	_fieldQueueTail.store( tail + 1, std::memory_order_release );
+	return true;
+}
+
+void ciMsaFluidSimThread::applyInjections()
+{
+	unsigned head = _queueHead.load( std::memory_order_relaxed );
+	unsigned tail = _queueTail.load( std::memory_order_acquire );
+	for ( ; head != tail; head++ )
+	{
+		const Injection &injection = _queue[ head & _queueMask ];
+		if ( injection.isForce )
+			_solver->addForceAtPos( injection.pos, ci::Vec2f( injection.value.x, injection.value.y ) );
+		else
+			_solver->addColorAtPos( injection.pos.x, injection.pos.y, injection.value.x, injection.value.y, injection.value.z );
+	}
+	_queueHead.store( head, std::memory_order_release );
+
+	head = _fieldQueueHead.load( std::memory_order_relaxed );
+	tail = _fieldQueueTail.load( std::memory_order_acquire );
+	for ( ; head != tail; head++ )
+	{
+		const FieldInjection &injection = _fieldQueue[ head & ( FLUID_SIM_FIELD_QUEUE_SIZE - 1 ) ];
+		_solver->addForceField( injection.field.data(), injection.width, injection.height, 2 * injection.width, injection.rect,
+								injection.scale, injection.minLength2, injection.colorAmount, injection.bilinear );
+	}
+	_fieldQueueHead.store( head, std::memory_order_release );
+}
+
+void ciMsaFluidSimThread::configure( const std::function< void ( ciMsaFluidSolver & ) > &apply )
+{
+	std::lock_guard< std::mutex > lock( _configMutex );
+	_config = apply;
+}
+
+void ciMsaFluidSimThread::saveState( const std::string &path )
+{
+	std::lock_guard< std::mutex > lock( _configMutex );
+	_savePath = path;
+}
+
+void ciMsaFluidSimThread::loadState( const std::string &path )
+{
+	std::lock_guard< std::mutex > lock( _configMutex );
+	_loadPath = path;
+}
+
+const ciMsaFluidSnapshot* ciMsaFluidSimThread::acquireSnapshot()
+{
+	if ( _ready.load( std::memory_order_acquire ) & FLUID_SIM_SNAPSHOT_NEW )
+		_front = _ready.exchange( _front, std::memory_order_acq_rel ) & ~FLUID_SIM_SNAPSHOT_NEW;
+	return &_snapshots[_front];
+}
+
+void ciMsaFluidSimThread::publish()
+{
+	_back = _ready.exchange( _back | FLUID_SIM_SNAPSHOT_NEW, std::memory_order_acq_rel ) & ~FLUID_SIM_SNAPSHOT_NEW;
+}
+
+void ciMsaFluidSimThread::applyPending()
+{
+	std::function< void ( ciMsaFluidSolver & ) > config;
+	std::string savePath, loadPath;
+	{
+		std::lock_guard< std::mutex > lock( _configMutex );
+		config.swap( _config );
+		savePath.swap( _savePath );
+		loadPath.swap( _loadPath );
+	}
+	if ( config )
+		config( *_solver );
+
+	if ( _resetPending.exchange( false ) )
+		_solver->reset();
+	if ( !loadPath.empty() )
+		_solver->loadState( loadPath );
+	// the state of the last step, the injections since are not in it
+	if ( !savePath.empty() )
+		_solver->saveState( savePath );
+
+	applyInjections();
+}
+
+void ciMsaFluidSimThread::step()
+{
+	applyPending();
+	_solver->update();
+	_stepCount++;
+
+	_snapshots[_back].capture( *_solver, _stepCount );
+	publish();
+}
+
+void ciMsaFluidSimThread::threadLoop()
+{
+	// ci::Timer and ci::sleep() rather than <chrono>, which VS2010 does not have
+	ci::Timer clock( true );
+	double next = clock.getSeconds();
+	while ( !_stop )
+	{
+		double period = 1.0 / _rate;
+		double now = clock.getSeconds();
+		if ( now < next )
+		{
+			ci::sleep( (float)( ( next - now ) * 1000.0 ) );
+			continue;
+		}
+
+		if ( now - next > period * FLUID_SIM_MAX_CATCHUP_STEPS )
+		{
+			_skippedSteps += (int)( ( now - next ) / period );
+			next = now;
+		}
+
+		step();
+		next += period;
+	}
+}
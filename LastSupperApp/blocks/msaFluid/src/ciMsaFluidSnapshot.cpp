@@ -0,0 +1,86 @@
+/***********************************************************************
+
+ Immutable copy of the velocity and color of a ciMsaFluidSolver step
+
+ ***********************************************************************/
+
+#include "ciMsaFluidSnapshot.h"
+
+ciMsaFluidSnapshot::ciMsaFluidSnapshot()
+:_NX(0)
+,_NY(0)
+,_stride(0)
+,_invNX(0)
+,_invNY(0)
+,_dyeNX(0)
+,_dyeNY(0)
+,_dyeStride(0)
+,_dyeScale(1)
+,_isRGB(false)
+,_kernels(NULL)
+,_step(0)
+,_avgDensity(0)
+,_avgSpeed(0)
+,_numActiveTiles(0)
+,_frameIterations(0)
+,_frameResidual(0)
+{
+}
+
+void ciMsaFluidSnapshot::capture( const ciMsaFluidSolver &solver, int step )
+{
+	_NX = solver.getWidth() - 2;
+	_NY = solver.getHeight() - 2;
+	_stride = solver.getRowStride();
+	_invNX = 1.0f / _NX;
+	_invNY = 1.0f / _NY;
+	_dyeNX = solver.getDyeWidth() - 2;
+	_dyeNY = solver.getDyeHeight() - 2;
+	_dyeStride = solver.getDyeRowStride();
+	_dyeScale = solver.getDyeScale();
+	_isRGB = solver.isRGB();
+	_kernels = ciMsaFluidKernels::get( solver.getSimdLevel() );
+	_step = step;
+
+	// the vectors only reallocate when the grid grows
+	size_t planeSize = (size_t)_stride * ( _NY + 2 );
+	size_t dyePlaneSize = (size_t)_dyeStride * ( _dyeNY + 2 );
+	_u.resize( planeSize );
+	_v.resize( planeSize );
+	_r.resize( dyePlaneSize );
+	_g.resize( _isRGB ? dyePlaneSize : 0 );
+	_b.resize( _isRGB ? dyePlaneSize : 0 );
+	solver.copyFields( _u.data(), _v.data(), NULL, NULL, NULL );
+	solver.copyDye( _r.data(), _g.data(), _b.data() );
+
+	_avgDensity = solver.getAvgDensity();
+	_avgSpeed = solver.getAvgSpeed();
+	_numActiveTiles = solver.getNumActiveTiles();
+	_frameIterations = solver.getFrameIterations();
+	_frameResidual = solver.getFrameResidual();
+	for ( int i = 0; i < FLUID_STAGE_COUNT; i++ )
+		_stageCounters[i] = solver.getStageCounters( i );
+}
+
+ciMsaFluidFieldView ciMsaFluidSnapshot::getFieldView() const
+{
+	ciMsaFluidFieldView view;
+	if ( !isValid() )
+		return view;
+	view.u = _u.data();
+	view.v = _v.data();
+	view.r = _r.data();
+	view.g = _isRGB ? _g.data() : view.r;
+	view.b = _isRGB ? _b.data() : view.r;
+	view.NX = _NX;
+	view.NY = _NY;
+	view.stride = _stride;
+	view.dyeNX = _dyeNX;
+	view.dyeNY = _dyeNY;
+	view.dyeStride = _dyeStride;
+	view.dyeScale = _dyeScale;
+	view.velocityScale.set( _invNX, _invNY );
+	view.isRGB = _isRGB;
+	view.kernels = _kernels;
+	return view;
+}
@@ -44,9 +44,34 @@
 
  /* Portions Copyright (c) 2010, The Cinder Project, http://libcinder.org */
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "ciMsaFluidDenormalGuard.h"
 #include "ciMsaFluidSolver.h"
 #include "cinder/Rand.h"
 
+// r, g, b, u, v and their old values
+#define FLUID_ARENA_PLANES		10
+
+// file of saveState(): the header, then the planes u, v of the velocity grid and r, rOld (and g, gOld, b, bOld in RGB)
+// of the dye grid, ( NX + 2 ) * ( NY + 2 ) floats each including the boundary cells
+#define FLUID_STATE_MAGIC		0x4641534d		// "MSAF"
+#define FLUID_STATE_VERSION		1
+
+struct ciMsaFluidStateHeader {
+	uint32_t	magic, version;
+	int32_t		NX, NY;
+	int32_t		dyeNX, dyeNY;
+	uint32_t	isRGB;
+};
+
 ciMsaFluidSolver::ciMsaFluidSolver()
 :r(NULL)
 ,rOld(NULL)
@@ -54,40 +79,200 @@ ciMsaFluidSolver::ciMsaFluidSolver()
 ,gOld(NULL)
 ,b(NULL)
 ,bOld(NULL)
-,uv(NULL)
-,uvOld(NULL)
-,curl(NULL)
+,u(NULL)
+,v(NULL)
+,uOld(NULL)
+,vOld(NULL)
+,_arena(NULL)
+,_arenaBlock(NULL)
+,_arenaPlaneSize(0)
+,doRGB(false)
+,doVorticityConfinement(false)
+,doFlushDenormals(true)
+,doDeterministic(false)
+,wrap_x(false)
+,wrap_y(false)
+,_NX(0)
+,_NY(0)
 ,_isInited(false)
+,_avgDensity(0)
+,_uniformity(0)
+,_avgSpeed(0)
+,statisticsInterval(0)
+,_statisticsFrame(0)
+,_kernels(ciMsaFluidKernels::get( ciMsaFluidKernels::detectSimdLevel() ))
+,_pool(&_threadPool)
+,doAdaptiveIterations(false)
+,targetResidual(FLUID_DEFAULT_TARGET_RESIDUAL)
+,minIterations(FLUID_DEFAULT_MIN_ITERATIONS)
+,maxIterations(FLUID_DEFAULT_MAX_ITERATIONS)
+,_frameIterations(0)
+,_frameResidual(0)
+,_lastFrameIterations(0)
+,_lastFrameResidual(0)
+,doActiveTiles(false)
+,tileVelocityThreshold(FLUID_DEFAULT_TILE_VELOCITY_THRESH)
+,tileDyeThreshold(FLUID_DEFAULT_TILE_DYE_THRESH)
+,_numTilesX(0)
+,_numTilesY(0)
+,_numActiveTiles(0)
+,doRegionOfInterest(false)
+,roiRect(0, 0, 1, 1)
+,roiMargin(FLUID_DEFAULT_ROI_MARGIN)
+,_roiI0(1)
+,_roiI1(0)
+,_roiJ0(1)
+,_roiJ1(0)
+,_blurWeightsA(-1)
+,dyeScale(1)
+,_dyeSolver(NULL)
+,doStageTimers(false)
+,_frameCount(0)
+,_stageMark(0)
+,_numActiveCells(0)
+,_cellCount(0)
+,_iterationCount(0)
+,_stageMarkCells(0)
+,_stageMarkIterations(0)
+,_setBoundary(NULL)
+,_setBoundary2d(NULL)
+,_setBoundaryRGB(NULL)
+,_fadeDye(NULL)
+,_step(NULL)
+,_stepDye(NULL)
 {
+	for( int i = 0; i < FLUID_STAGE_COUNT; i++ ) {
+		_stageFrameTimes[i] = 0;
+		_stageTimes[i] = _serialStageTimes[i] = 0;
+		_stageFrameCells[i] = 0;
+		_stageFrameIterations[i] = 0;
+	}
+}
+
+// bilinear resampling of a plane with ghost cells into a grid of another size, the cell centers of both grids
+// map to the same positions of the unit square. the ghost cells of src are read, the ones of dst are not written
+static void resamplePlane( float *dst, int NX, int NY, int stride, const float *src, int srcNX, int srcNY, int srcStride )
+{
+	const float scaleX = (float)srcNX / NX;
+	const float scaleY = (float)srcNY / NY;
+	for( int j = 1; j <= NY; j++ ) {
+		float y = ci::constrain( ( j - 0.5f ) * scaleY + 0.5f, 0.5f, srcNY + 0.5f );
+		int j0 = (int)y;
+		float t1 = y - j0;
+		float t0 = 1.0f - t1;
+		const float *row0 = src + srcStride * j0;
+		const float *row1 = row0 + srcStride;
+		float *out = dst + stride * j;
+		for( int i = 1; i <= NX; i++ ) {
+			float x = ci::constrain( ( i - 0.5f ) * scaleX + 0.5f, 0.5f, srcNX + 0.5f );
+			int i0 = (int)x;
+			float s1 = x - i0;
+			float s0 = 1.0f - s1;
+			out[i] = s0 * ( t0 * row0[i0] + t1 * row1[i0] ) + s1 * ( t0 * row0[i0 + 1] + t1 * row1[i0 + 1] );
+		}
+	}
 }
 
 ciMsaFluidSolver& ciMsaFluidSolver::setSize(int NX, int NY)
 {
+	// a running solver keeps its velocity and dye, the old planes stay alive until they are resampled
+	const bool resample = _isInited && ( NX != _NX || NY != _NY );
+	const int oldNX = _NX, oldNY = _NY, oldStride = _stride;
+	float *oldBlock = NULL;
+	const float *oldPlanes[8];
+	if( resample ) {
+		const float *planes[8] = { u, v, r, rOld, g, gOld, b, bOld };
+		std::copy( planes, planes + 8, oldPlanes );
+		oldBlock = _arenaBlock;
+		_arenaBlock = _arena = NULL;
+		_arenaPlaneSize = 0;
+	}
+	
 	_NX = NX;
 	_NY = NY;
 	_numCells = (_NX + 2) * (_NY + 2);
 	
+	// pad the rows so every row starts on an aligned address
+	const int rowAlign = FLUID_ARENA_ALIGNMENT / sizeof(float);
+	_stride = ( ( _NX + 2 + rowAlign - 1 ) / rowAlign ) * rowAlign;
+	_planeSize = _stride * (_NY + 2);
+	
 	_invNX = 1.0f / _NX;
 	_invNY = 1.0f / _NY;
 	_invNumCells = 1.0f / _numCells;
+	resolveRegion();
 	
 	width           = getWidth();
 	height          = getHeight();
 	invWidth        = 1.0f/width;
 	invHeight       = 1.0f/height;
 	
-	reset();
+	_multigrid.setup( _NX, _NY );
+	_spectralSolver.setup( _NX, _NY );
+	
+	if ( _arenaPlaneSize != _planeSize )
+		allocate();
+	if( resample ) {
+		_isInited = true;
+		memset( _arena, 0, FLUID_ARENA_PLANES * _planeSize * sizeof(float) );
+		for( int k = 0; k < 2; k++ )
+			_pressure[k].clear();
+		
+		// the velocity is in units of the unit square per step, so the values carry over unscaled.
+		// pending colors are kept too, the forces are already in the velocity. the dye grid resamples its own dye
+		float *planes[8] = { u, v, r, rOld, g, gOld, b, bOld };
+		const int numPlanes = _dyeSolver ? 2 : ( doRGB ? 8 : 4 );
+		for( int k = 0; k < numPlanes; k++ )
+			resamplePlane( planes[k], _NX, _NY, _stride, oldPlanes[k], oldNX, oldNY, oldStride );
+		delete []oldBlock;
+		clearOutsideRegion();
+		
+		setBoundary2d( 1, u, v );
+		setBoundary2d( 2, u, v );
+		if( !_dyeSolver ) {
+			if( doRGB )
+				setBoundaryRGB();
+			else
+				setBoundary( 0, r );
+		}
+	}
+	else {
+		reset();
+	}
+	setupTiles();
+	setupDye();
 	return *this;
 }
 
 
 ciMsaFluidSolver& ciMsaFluidSolver::setup(int NX, int NY)
 {
+	// setup starts from empty fields, only setSize resamples
+	destroy();
 	setDeltaT();
 	setFadeSpeed();
+	enableRGB(false);
 	setSolverIterations();
+	enableAdaptiveIterations(false);
+	setAdaptiveIterations();
+	setProjectionSolver( FLUID_PROJECTION_GAUSS_SEIDEL );
+	setSolverTolerance();
+	setMultigridCycles();
+	setDiffusionSolver( FLUID_DIFFUSION_GAUSS_SEIDEL );
+	setDiffusionBlurLimit();
+	enableSpectralProjection(true);
+	enableWarmStart(false);
+	enableDeterministic(false);
 	enableVorticityConfinement(false);
+	enableFusedAdvection(false);
+	enableFlushDenormals(true);
+	enableActiveTiles(false);
+	setActiveTileThresholds();
+	enableRegionOfInterest(false);
+	setRegionOfInterest( ci::Rectf( 0, 0, 1, 1 ) );
+	setStatisticsInterval(0);
 	setWrap( false, false );
+	dyeScale = 1;
 	
 	//maa
 	viscocity =  FLUID_DEFAULT_VISC;
@@ -111,15 +296,204 @@ ciMsaFluidSolver&  ciMsaFluidSolver::setSolverIterations(int solverIterations) {
 	return *this;	
 }
 
+ciMsaFluidSolver&  ciMsaFluidSolver::enableAdaptiveIterations(bool b) {
+	doAdaptiveIterations = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getAdaptiveIterations() const {
+	return doAdaptiveIterations;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setAdaptiveIterations(float targetResidual, int minIterations, int maxIterations) {
+	this->targetResidual = targetResidual;
+	this->minIterations = ci::math<int>::max( minIterations, 0 );
+	this->maxIterations = ci::math<int>::max( maxIterations, this->minIterations );
+	return *this;
+}
+
+int ciMsaFluidSolver::getFrameIterations() const {
+	return _lastFrameIterations;
+}
+
+float ciMsaFluidSolver::getFrameResidual() const {
+	return _lastFrameResidual;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setProjectionSolver(int projectionSolver) {
+	this->projectionSolver = projectionSolver;
+	return *this;
+}
+
+int ciMsaFluidSolver::getProjectionSolver() const {
+	return projectionSolver;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setSolverTolerance(float tolerance) {
+	solverTolerance = tolerance;
+	return *this;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setMultigridCycles(int maxCycles) {
+	multigridCycles = maxCycles;
+	return *this;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setDiffusionSolver(int diffusionSolver) {
+	this->diffusionSolver = diffusionSolver;
+	return *this;
+}
+
+int ciMsaFluidSolver::getDiffusionSolver() const {
+	return diffusionSolver;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setDiffusionBlurLimit(float limit) {
+	diffusionBlurLimit = limit;
+	return *this;
+}
+
+float ciMsaFluidSolver::getDiffusionBlurLimit() const {
+	return diffusionBlurLimit;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableSpectralProjection(bool b) {
+	doSpectralProjection = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getSpectralProjection() const {
+	return doSpectralProjection;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableWarmStart(bool b) {
+	doWarmStart = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getWarmStart() const {
+	return doWarmStart;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableDeterministic(bool b) {
+	doDeterministic = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getDeterministic() const {
+	return doDeterministic;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setSimdLevel(int simdLevel) {
+	_kernels = ciMsaFluidKernels::get( simdLevel );
+	return *this;
+}
+
+int ciMsaFluidSolver::getSimdLevel() const {
+	return _kernels ? _kernels->simdLevel : FLUID_SIMD_NONE;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setNumThreads(int numThreads) {
+	_pool->setNumThreads( numThreads );
+	return *this;
+}
+
+int ciMsaFluidSolver::getNumThreads() const {
+	return _pool->getNumThreads();
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableStageTimers(bool b) {
+	doStageTimers = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getStageTimers() const {
+	return doStageTimers;
+}
+
+float ciMsaFluidSolver::getStageTime(int stage) const {
+	return _stageTimes[stage];
+}
+
+float ciMsaFluidSolver::getStageSpeedup(int stage) const {
+	if( _pool->getNumThreads() == 1 )
+		return _serialStageTimes[stage] > 0 ? 1.0f : 0.0f;
+	if( _serialStageTimes[stage] <= 0 || _stageTimes[stage] <= 0 )
+		return 0;
+	return _serialStageTimes[stage] / _stageTimes[stage];
+}
+
+ciMsaFluidStageCounters ciMsaFluidSolver::getStageCounters(int stage) const {
+	return _stageCounters[stage];
+}
+
+const char* ciMsaFluidSolver::getStageName(int stage) {
+	static const char *names[FLUID_STAGE_COUNT] = { "add source", "vorticity", "diffuse", "project", "advect", "reproject", "fade" };
+	return names[stage];
+}
 
 // whether fluid is RGB or monochrome (if only pressure / velocity is needed no need to update 3 channels)
 ciMsaFluidSolver&  ciMsaFluidSolver::enableRGB(bool doRGB) {
 	this->doRGB = doRGB;
+	selectSpecializations();
 	return *this;
 }
 
+bool ciMsaFluidSolver::isRGB() const {
+	return doRGB;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableActiveTiles(bool b) {
+	doActiveTiles = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getActiveTiles() const {
+	return doActiveTiles;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setActiveTileThresholds(float velocity, float dye) {
+	tileVelocityThreshold = velocity;
+	tileDyeThreshold = dye;
+	return *this;
+}
+
+int ciMsaFluidSolver::getNumActiveTiles() const {
+	return _numActiveTiles;
+}
+
+int ciMsaFluidSolver::getNumTiles() const {
+	return _numTilesX * _numTilesY;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableRegionOfInterest(bool b) {
+	doRegionOfInterest = b;
+	selectSpecializations();
+	return *this;
+}
+
+bool ciMsaFluidSolver::getRegionOfInterest() const {
+	return doRegionOfInterest;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setRegionOfInterest(const ci::Rectf &rect, int margin) {
+	roiRect = rect;
+	roiMargin = ci::math<int>::max( margin, 0 );
+	selectSpecializations();
+	return *this;
+}
+
+ci::Rectf ciMsaFluidSolver::getRegionOfInterestRect() const {
+	return roiRect;
+}
+
+int ciMsaFluidSolver::getRegionOfInterestMargin() const {
+	return roiMargin;
+}
+
 ciMsaFluidSolver&  ciMsaFluidSolver::enableVorticityConfinement(bool b) {
 	doVorticityConfinement = b;
+	selectSpecializations();
 	return *this;
 }
 
@@ -127,9 +501,33 @@ bool ciMsaFluidSolver::getVorticityConfinement() {
 	return doVorticityConfinement;
 }
 
+ciMsaFluidSolver&  ciMsaFluidSolver::enableFusedAdvection(bool b) {
+	doFusedAdvection = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getFusedAdvection() const {
+	return doFusedAdvection;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableFlushDenormals(bool b) {
+	doFlushDenormals = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getFlushDenormals() const {
+	return doFlushDenormals;
+}
+
+bool ciMsaFluidSolver::flushesPerElement() const {
+	return !( doFlushDenormals && ciMsaFluidDenormalGuard::isSupported() );
+}
+
 ciMsaFluidSolver& ciMsaFluidSolver::setWrap( bool bx, bool by ) {
 	wrap_x = bx;
 	wrap_y = by;
+	// setSize() and loadState() set the boundaries before the next update()
+	selectSpecializations();
 	return *this;
 }
 
@@ -138,49 +536,486 @@ bool ciMsaFluidSolver::isInited() const {
 }
 
 ciMsaFluidSolver::~ciMsaFluidSolver() {
+	delete _dyeSolver;
 	destroy();
 }
 
 void ciMsaFluidSolver::destroy() {
 	_isInited = false;
 	
-	if(r)		delete []r;
-	if(rOld)	delete []rOld;
+	if(_arenaBlock)	delete []_arenaBlock;
 	
-	if(g)		delete []g;
-	if(gOld)	delete []gOld;
+	_arenaBlock = _arena = NULL;
+	_arenaPlaneSize = 0;
+	r = rOld = g = gOld = b = bOld = NULL;
+	u = v = uOld = vOld = NULL;
+}
+
+// all fields are planes of _planeSize floats in one block, only called when the size changes
+void ciMsaFluidSolver::allocate() {
+	destroy();
 	
-	if(b)		delete []b;
-	if(bOld)	delete []bOld;
+	const size_t alignFloats = FLUID_ARENA_ALIGNMENT / sizeof(float);
+	_arenaBlock = new float[FLUID_ARENA_PLANES * _planeSize + alignFloats];
+	size_t misalign = reinterpret_cast<size_t>( _arenaBlock ) % FLUID_ARENA_ALIGNMENT;
+	_arena = _arenaBlock + ( misalign ? ( FLUID_ARENA_ALIGNMENT - misalign ) / sizeof(float) : 0 );
+	_arenaPlaneSize = _planeSize;
 	
-	if(uv)		delete []uv;
-	if(uvOld)	delete []uvOld;
-	if(curl)       delete []curl;
+	float *plane = _arena;
+	r    = plane; plane += _planeSize;
+	rOld = plane; plane += _planeSize;
+	g    = plane; plane += _planeSize;
+	gOld = plane; plane += _planeSize;
+	b    = plane; plane += _planeSize;
+	bOld = plane; plane += _planeSize;
+	u    = plane; plane += _planeSize;
+	v    = plane; plane += _planeSize;
+	uOld = plane; plane += _planeSize;
+	vOld = plane;
 }
 
-
+// clears the fields without reallocating them
 void ciMsaFluidSolver::reset() {
-	destroy();
+	if ( !_arena )
+		allocate();
 	_isInited = true;
 	
-	r    = new float[_numCells];
-	rOld = new float[_numCells];
+	memset( _arena, 0, FLUID_ARENA_PLANES * _planeSize * sizeof(float) );
+	for( int k = 0; k < 2; k++ )
+		_pressure[k].clear();
+	if( _dyeSolver )
+		_dyeSolver->reset();
+}
+
+void ciMsaFluidSolver::copyFields(float *u, float *v, float *r, float *g, float *b) const {
+	size_t size = _planeSize * sizeof(float);
+	if( u ) memcpy( u, this->u, size );
+	if( v ) memcpy( v, this->v, size );
+	if( r ) memcpy( r, this->r, size );
+	if( doRGB ) {
+		if( g ) memcpy( g, this->g, size );
+		if( b ) memcpy( b, this->b, size );
+	}
+}
+
+ciMsaFluidSolver& ciMsaFluidSolver::setDyeScale(int scale) {
+	scale = ci::constrain( scale, 1, FLUID_MAX_DYE_SCALE );
+	if( scale == dyeScale )
+		return *this;
+	
+	dyeScale = scale;
+	if( _isInited ) {
+		// the dye planes are the first six of the arena. a resized dye grid would resample, it starts empty too
+		memset( _arena, 0, 6 * _planeSize * sizeof(float) );
+		setupDye();
+		if( _dyeSolver )
+			_dyeSolver->reset();
+	}
+	return *this;
+}
+
+int ciMsaFluidSolver::getDyeScale() const {
+	return dyeScale;
+}
+
+int ciMsaFluidSolver::getDyeWidth() const {
+	return _dyeSolver ? _dyeSolver->getWidth() : getWidth();
+}
+
+int ciMsaFluidSolver::getDyeHeight() const {
+	return _dyeSolver ? _dyeSolver->getHeight() : getHeight();
+}
+
+int ciMsaFluidSolver::getDyeRowStride() const {
+	return _dyeSolver ? _dyeSolver->getRowStride() : getRowStride();
+}
+
+void ciMsaFluidSolver::copyDye(float *r, float *g, float *b) const {
+	if( _dyeSolver )
+		_dyeSolver->copyFields( NULL, NULL, r, g, b );
+	else
+		copyFields( NULL, NULL, r, g, b );
+}
+
+ciMsaFluidFieldView ciMsaFluidSolver::getFieldView() const {
+	ciMsaFluidFieldView view;
+	view.u = u;
+	view.v = v;
+	view.NX = _NX;
+	view.NY = _NY;
+	view.stride = _stride;
+	view.velocityScale.set( _invNX, _invNY );
+	// the dye of the dye solver, or the planes of this one at scale 1
+	const ciMsaFluidSolver &dye = _dyeSolver ? *_dyeSolver : *this;
+	view.r = dye.r;
+	view.g = doRGB ? dye.g : dye.r;
+	view.b = doRGB ? dye.b : dye.r;
+	view.dyeNX = dye._NX;
+	view.dyeNY = dye._NY;
+	view.dyeStride = dye._stride;
+	view.dyeScale = dyeScale;
+	view.isRGB = doRGB;
+	view.kernels = _kernels;
+	return view;
+}
+
+static void writePlane( std::ofstream &file, const float *plane, int NX, int NY, int stride )
+{
+	for( int j = 0; j < NY + 2; j++ )
+		file.write( reinterpret_cast< const char * >( plane + stride * j ), ( NX + 2 ) * sizeof(float) );
+}
+
+// copies a plane of the file including the boundary cells, or resamples the interior when the size differs
+static void readPlane( float *dst, int NX, int NY, int stride, const float *src, int srcNX, int srcNY )
+{
+	if( NX == srcNX && NY == srcNY ) {
+		for( int j = 0; j < NY + 2; j++ )
+			memcpy( dst + stride * j, src + ( NX + 2 ) * j, ( NX + 2 ) * sizeof(float) );
+	}
+	else {
+		resamplePlane( dst, NX, NY, stride, src, srcNX, srcNY, srcNX + 2 );
+	}
+}
+
+// reads the header and checks that the size of the file matches it
+static bool readStateHeader( const char *data, size_t size, ciMsaFluidStateHeader *header )
+{
+	if( size < sizeof(*header) )
+		return false;
+	memcpy( header, data, sizeof(*header) );
+	if( header->magic != FLUID_STATE_MAGIC || header->version != FLUID_STATE_VERSION ||
+	   header->NX < 1 || header->NY < 1 || header->dyeNX < 1 || header->dyeNY < 1 )
+		return false;
+	size_t planeFloats = (size_t)( header->NX + 2 ) * ( header->NY + 2 );
+	size_t dyePlaneFloats = (size_t)( header->dyeNX + 2 ) * ( header->dyeNY + 2 );
+	int numDyePlanes = header->isRGB ? 6 : 2;
+	return size == sizeof(*header) + ( 2 * planeFloats + numDyePlanes * dyePlaneFloats ) * sizeof(float);
+}
+
+bool ciMsaFluidSolver::saveState(const std::string &path) const {
+	if( !_isInited )
+		return false;
+	
+	const ciMsaFluidSolver &dye = _dyeSolver ? *_dyeSolver : *this;
+	ciMsaFluidStateHeader header = { FLUID_STATE_MAGIC, FLUID_STATE_VERSION, _NX, _NY, dye._NX, dye._NY, doRGB ? 1u : 0u };
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream file( tmpPath.c_str(), std::ios::binary | std::ios::trunc );
+		if( !file )
+			return false;
+		file.write( reinterpret_cast< const char * >( &header ), sizeof(header) );
+		writePlane( file, u, _NX, _NY, _stride );
+		writePlane( file, v, _NX, _NY, _stride );
+		const float *dyePlanes[] = { dye.r, dye.rOld, dye.g, dye.gOld, dye.b, dye.bOld };
+		for( int k = 0; k < ( doRGB ? 6 : 2 ); k++ )
+			writePlane( file, dyePlanes[k], dye._NX, dye._NY, dye._stride );
+		file.close();
+		if( file.fail() )
+			return false;
+	}
+	
+	// the last complete file stays in place until the new one is written, rename only replaces it on posix
+	if( std::rename( tmpPath.c_str(), path.c_str() ) != 0 ) {
+		std::remove( path.c_str() );
+		return std::rename( tmpPath.c_str(), path.c_str() ) == 0;
+	}
+	return true;
+}
+
+bool ciMsaFluidSolver::isStateFile(const std::string &path) {
+	try {
+		boost::interprocess::file_mapping file( path.c_str(), boost::interprocess::read_only );
+		boost::interprocess::mapped_region region( file, boost::interprocess::read_only );
+		ciMsaFluidStateHeader header;
+		return readStateHeader( static_cast< const char * >( region.get_address() ), region.get_size(), &header );
+	}
+	catch( const boost::interprocess::interprocess_exception & ) {
+		return false;
+	}
+}
+
+bool ciMsaFluidSolver::loadState(const std::string &path) {
+	if( !_isInited )
+		return false;
+	
+	try {
+		// the planes are read straight from the mapped pages, without a copy of the file in memory
+		boost::interprocess::file_mapping file( path.c_str(), boost::interprocess::read_only );
+		boost::interprocess::mapped_region region( file, boost::interprocess::read_only );
+		const char *data = static_cast< const char * >( region.get_address() );
+		
+		ciMsaFluidStateHeader header;
+		if( !readStateHeader( data, region.get_size(), &header ) )
+			return false;
+		size_t planeFloats = (size_t)( header.NX + 2 ) * ( header.NY + 2 );
+		size_t dyePlaneFloats = (size_t)( header.dyeNX + 2 ) * ( header.dyeNY + 2 );
+		
+		// the kept pressure and the scratch planes belong to the old fields
+		reset();
+		
+		const float *src = reinterpret_cast< const float * >( data + sizeof(header) );
+		readPlane( u, _NX, _NY, _stride, src, header.NX, header.NY );
+		readPlane( v, _NX, _NY, _stride, src + planeFloats, header.NX, header.NY );
+		
+		// a monochrome file fills all channels, of an RGB file a monochrome solver takes the red one
+		const float *dyeSrc = src + 2 * planeFloats;
+		ciMsaFluidSolver &dye = _dyeSolver ? *_dyeSolver : *this;
+		float *dyePlanes[] = { dye.r, dye.rOld, dye.g, dye.gOld, dye.b, dye.bOld };
+		for( int k = 0; k < ( doRGB ? 6 : 2 ); k++ )
+			readPlane( dyePlanes[k], dye._NX, dye._NY, dye._stride,
+					  dyeSrc + ( header.isRGB ? k : k % 2 ) * dyePlaneFloats, header.dyeNX, header.dyeNY );
+		clearOutsideRegion();
+		if( _dyeSolver )
+			_dyeSolver->clearOutsideRegion();
+		setBoundary2d( 1, u, v );
+		setBoundary2d( 2, u, v );
+		if( doRGB )
+			dye.setBoundaryRGB();
+		else
+			dye.setBoundary( 0, dye.r );
+		return true;
+	}
+	catch( const boost::interprocess::interprocess_exception & ) {
+		return false;
+	}
+}
+
+// creates, resizes or deletes the dye grid, a new grid starts empty and a resized one is resampled
+void ciMsaFluidSolver::setupDye() {
+	if( dyeScale <= 1 ) {
+		delete _dyeSolver;
+		_dyeSolver = NULL;
+		return;
+	}
+	
+	if( !_dyeSolver ) {
+		_dyeSolver = new ciMsaFluidSolver;
+		_dyeSolver->setup( _NX * dyeScale, _NY * dyeScale );
+	}
+	else {
+		_dyeSolver->setSize( _NX * dyeScale, _NY * dyeScale );
+	}
+	syncDyeSolver();
+}
+
+// the dye grid runs the dye stages with the settings of this solver, it never solves for its velocity
+void ciMsaFluidSolver::syncDyeSolver() {
+	ciMsaFluidSolver &dye = *_dyeSolver;
+	dye.doRGB = doRGB;
+	dye.colorDiffusion = colorDiffusion;
+	dye.fadeSpeed = fadeSpeed;
+	dye._dt = _dt;
+	dye.setWrap( wrap_x, wrap_y );
+	dye.solverIterations = solverIterations;
+	dye.doAdaptiveIterations = doAdaptiveIterations;
+	dye.targetResidual = targetResidual;
+	dye.minIterations = minIterations;
+	dye.maxIterations = maxIterations;
+	dye.diffusionSolver = diffusionSolver;
+	dye.diffusionBlurLimit = diffusionBlurLimit;
+	dye.solverTolerance = solverTolerance;
+	dye.multigridCycles = multigridCycles;
+	dye._kernels = _kernels;
+	dye.doActiveTiles = doActiveTiles;
+	dye.doRegionOfInterest = doRegionOfInterest;
+	dye.roiRect = roiRect;
+	dye.roiMargin = roiMargin * dyeScale;
+	dye.tileVelocityThreshold = tileVelocityThreshold;
+	dye.tileDyeThreshold = tileDyeThreshold;
+	dye.doFlushDenormals = doFlushDenormals;
+	dye.doDeterministic = doDeterministic;
+	dye._pool = _pool;
+}
+
+// the dye stages of update() at the dye resolution, timed as the advection
+void ciMsaFluidSolver::updateDye() {
+	syncDyeSolver();
+	_dyeSolver->stepDye( *this );
+	_frameIterations += _dyeSolver->_frameIterations;
+	_cellCount += _dyeSolver->_cellCount;
+	_iterationCount += _dyeSolver->_iterationCount;
+	_frameResidual = ci::math<float>::max( _frameResidual, _dyeSolver->_frameResidual );
+}
+
+// called on the dye grid with the solver holding the velocity
+void ciMsaFluidSolver::stepDye(const ciMsaFluidSolver &velocity) {
+	_frameIterations = 0;
+	_frameResidual = 0;
+	_cellCount = 0;
+	_iterationCount = 0;
+	
+	const bool regionChanged = updateRegion();
+	selectSpecializations();
+	(this->*_stepDye)( velocity, regionChanged );
+}
+
+template< bool RGB >
+void ciMsaFluidSolver::stepDyeT(const ciMsaFluidSolver &velocity, bool regionChanged) {
+	upsampleVelocity( velocity );
+	clearSourcesOutsideRegion< RGB >( false, true );
+	updateActiveTiles< RGB >( regionChanged );
+	
+	addDye< RGB >();
+	advectDye< RGB >();
+	fadeDye< RGB >();
+}
+
+// bilinear interpolation of the coarse velocity at the centers of the cells of the region rows, boundary cells included.
+// the velocity is in normalized units, so the values are not scaled
+void ciMsaFluidSolver::upsampleVelocity(const ciMsaFluidSolver &velocity) {
+	const float invScale = (float)velocity._NX / _NX;
+	const int cStride = velocity._stride;
+	
+	// coarse cell i is centered at x = ( i - 0.5 ) / NX, both grids share the boundary cells
+	_upsampleColumns.resize( _NX + 2 );
+	_upsampleWeights.resize( _NX + 2 );
+	for (int i = 0; i < _NX + 2; i++)
+	{
+		float fx = ( i - 0.5f ) * invScale + 0.5f;
+		int i0 = ci::math<int>::min( (int)fx, velocity._NX );
+		_upsampleColumns[i] = i0;
+		_upsampleWeights[i] = fx - i0;
+	}
 	
-	g    = new float[_numCells];
-	gOld = new float[_numCells];
+	_pool->run( _roiJ0 - 1, _roiJ1 + 2, [&]( int, int j0, int j1 ) {
+		for (int j = j0; j < j1; j++)
+		{
+			float fy = ( j - 0.5f ) * invScale + 0.5f;
+			int jc = ci::math<int>::min( (int)fy, velocity._NY );
+			float t1 = fy - jc;
+			const float *planes[] = { velocity.u, velocity.v };
+			float *dst[] = { u, v };
+			for (int k = 0; k < 2; k++)
+			{
+				const float *row0 = planes[k] + jc * cStride;
+				const float *row1 = row0 + cStride;
+				float *out = dst[k] + FLUID_IX(0, j);
+				for (int i = 0; i < _NX + 2; i++)
+				{
+					int i0 = _upsampleColumns[i];
+					float s1 = _upsampleWeights[i];
+					float top = row0[i0] + ( row0[i0 + 1] - row0[i0] ) * s1;
+					float bottom = row1[i0] + ( row1[i0 + 1] - row1[i0] ) * s1;
+					out[i] = top + ( bottom - top ) * t1;
+				}
+			}
+		}
+	} );
+}
+
+// adds the color to the dye cells covering velocity cell (i, j)
+void ciMsaFluidSolver::addColorAtDyeCells(int i, int j, float r, float g, float b) {
+	int dyeNX = _NX * dyeScale;
+	int dyeNY = _NY * dyeScale;
+	int i0 = ci::math<int>::max( ( i - 1 ) * dyeScale + 1, 0 );
+	int i1 = ci::math<int>::min( i * dyeScale, dyeNX + 1 );
+	int j0 = ci::math<int>::max( ( j - 1 ) * dyeScale + 1, 0 );
+	int j1 = ci::math<int>::min( j * dyeScale, dyeNY + 1 );
+	for (int dj = j0; dj <= j1; dj++)
+		for (int di = i0; di <= i1; di++)
+			_dyeSolver->addColorAtCell( di, dj, r, g, b );
+}
+
+void ciMsaFluidSolver::addForcesBatch( const ci::Vec2f *positions, const ci::Vec2f *forces, int count, bool bilinear ) {
+	float *planes[] = { u, v };
+	for (int k = 0; k < count; k++)
+		splat( positions[k].x, positions[k].y, planes, &forces[k].x, 2, bilinear );
+}
+
+void ciMsaFluidSolver::addColorsBatch( const ci::Vec2f *positions, const ci::Color *colors, int count, bool bilinear ) {
+	if( _dyeSolver ) {
+		_dyeSolver->addColorsBatch( positions, colors, count, bilinear );
+		return;
+	}
+	float *planes[] = { rOld, gOld, bOld };
+	int numPlanes = doRGB ? 3 : 1;
+	for (int k = 0; k < count; k++)
+		splat( positions[k].x, positions[k].y, planes, &colors[k].r, numPlanes, bilinear );
+}
+
+void ciMsaFluidSolver::addForceField( const float *field, int width, int height, int fieldStride, const ci::Rectf &rect,
+									 const ci::Vec2f &scale, float minLength2, float colorAmount, bool bilinear ) {
+	// the dye grid colors its own cells, the forces it adds are replaced by the upsampled velocity
+	if( _dyeSolver && colorAmount != 0 ) {
+		_dyeSolver->addForceField( field, width, height, fieldStride, rect, scale, minLength2, colorAmount, bilinear );
+		colorAmount = 0;
+	}
 	
-	b    = new float[_numCells];
-	bOld = new float[_numCells];
+	const float dx = rect.getWidth() / width;
+	const float dy = rect.getHeight() / height;
+	const bool addColor = colorAmount != 0;
 	
-	uv    = new ci::Vec2f[_numCells];
-	uvOld = new ci::Vec2f[_numCells];
-	curl = new float[_numCells];
+	// the cells and weights of the field columns are the same for every row
+	_splatColumns.resize( width );
+	_splatWeights.resize( width );
+	for (int x = 0; x < width; x++)
+	{
+		float px = ci::constrain( rect.x1 + ( x + 0.5f ) * dx, 0.0f, 1.0f );
+		if( bilinear ) {
+			float fx = ci::math<float>::min( px * _NX + 0.5f, _NX + 0.999f );
+			_splatColumns[x] = (int)fx;
+			_splatWeights[x] = fx - (int)fx;
+		}
+		else {
+			_splatColumns[x] = (int) (px * _NX + 1);
+			_splatWeights[x] = 0;
+		}
+	}
 	
-	for ( int i = _numCells-1; i>=0; --i )
+	for (int y = 0; y < height; y++)
 	{
-		uv[i] = uvOld[i] = ci::Vec2f::zero();
-		curl[i] = 0.0f;
-		r[i] = rOld[i] = g[i] = gOld[i] = b[i] = bOld[i] = 0;
+		const float *row = field + y * fieldStride;
+		float py = ci::constrain( rect.y1 + ( y + 0.5f ) * dy, 0.0f, 1.0f );
+		float t1 = 0;
+		int j;
+		if( bilinear ) {
+			float fy = ci::math<float>::min( py * _NY + 0.5f, _NY + 0.999f );
+			j = (int)fy;
+			t1 = fy - j;
+		}
+		else {
+			j = (int) (py * _NY + 1);
+		}
+		const int rowIndex = FLUID_IX(0, j);
+		
+		for (int x = 0; x < width; x++)
+		{
+			float fx = row[2*x] * scale.x;
+			float fy = row[2*x+1] * scale.y;
+			if( fx * fx + fy * fy <= minLength2 )
+				continue;
+			
+			int index = rowIndex + _splatColumns[x];
+			if( !bilinear ) {
+				u[index] += fx;
+				v[index] += fy;
+				if( addColor ) {
+					rOld[index] += colorAmount;
+					if( doRGB ) {
+						gOld[index] += colorAmount;
+						bOld[index] += colorAmount;
+					}
+				}
+				continue;
+			}
+			
+			float s1 = _splatWeights[x];
+			float w[4] = { ( 1 - s1 ) * ( 1 - t1 ), s1 * ( 1 - t1 ), ( 1 - s1 ) * t1, s1 * t1 };
+			int offsets[4] = { 0, 1, _stride, _stride + 1 };
+			for (int k = 0; k < 4; k++)
+			{
+				int o = index + offsets[k];
+				u[o] += w[k] * fx;
+				v[o] += w[k] * fy;
+				if( addColor ) {
+					rOld[o] += w[k] * colorAmount;
+					if( doRGB ) {
+						gOld[o] += w[k] * colorAmount;
+						bOld[o] += w[k] * colorAmount;
+					}
+				}
+			}
+		}
 	}
 }
 
@@ -189,6 +1024,11 @@ int ciMsaFluidSolver::getNumCells() const {
 	return _numCells;
 }
 
+// return the padded row length of the fields in floats
+int ciMsaFluidSolver::getRowStride() const {
+	return _stride;
+}
+
 int ciMsaFluidSolver::getWidth() const {
 	return _NX + 2;
 }
@@ -249,229 +1089,720 @@ void ciMsaFluidSolver::swapRGB(){
 	SWAP( g, gOld );
 	SWAP( b, bOld );
 }
-void ciMsaFluidSolver::swapUV()	{	SWAP( uv, uvOld ); }
+void ciMsaFluidSolver::swapUV() {
+	SWAP( u, uOld );
+	SWAP( v, vOld );
+}
 
 // Curl and vorticityConfinement based on code by Alexander McKenzie
 float ciMsaFluidSolver::calcCurl( int i, int j)
 {
-	float du_dy = uv[FLUID_IX(i, j + 1)].x - uv[FLUID_IX(i, j - 1)].x;
-	float dv_dx = uv[FLUID_IX(i + 1, j)].y - uv[FLUID_IX(i - 1, j)].y;
+	float du_dy = u[FLUID_IX(i, j + 1)] - u[FLUID_IX(i, j - 1)];
+	float dv_dx = v[FLUID_IX(i + 1, j)] - v[FLUID_IX(i - 1, j)];
 	return (du_dy - dv_dx) * 0.5f;	// for optimization should be moved to later and done with another operation
 }
 
-void ciMsaFluidSolver::vorticityConfinement(ci::Vec2f* Fvc_xy) {
-	float dw_dx, dw_dy;
-	float length;
-	float v;
-	
-	// Calculate magnitude of calcCurl(u,v) for each cell. (|w|)
-	for (int j = _NY; j > 0; --j )
-	{
-		for (int i = _NX; i > 0; --i )
-		{
-			curl[FLUID_IX(i, j)] = fabs(calcCurl(i, j));
-		}
-	}
+// one sweep over the rows: every band keeps the signed curl of the rows j-1, j and j+1 in three scratch rows,
+// so each curl is computed once and read for the gradient of its magnitude and for the force of its cell
+void ciMsaFluidSolver::vorticityConfinement(float* Fvc_x, float* Fvc_y) {
+	countCells( 1 );
+	_curlRows.resize( (size_t)_pool->getNumThreads() * 3 * _stride );
 	
-	for (int j = _NY-1; j > 1; --j )	//for (int j = 2; j < _NY; j++)
-	{
-		for (int i = _NX-1; i > 1; --i )		//for (int i = 2; i < _NX; i++)		
+	_pool->run( 0, (int)_activeRows.size(), [&]( int band, int row0, int row1 ) {
+		float *rows[3];
+		int rowJ[3] = { -1, -1, -1 };			// row of the curl each scratch row holds
+		for (int k = 0; k < 3; k++ )
+			rows[k] = &_curlRows[( band * 3 + k ) * _stride];
+		int rowsTile = -1;
+		
+		for (int row = row0; row < row1; ++row )	//for (int j = 2; j < _NY; j++)
 		{
-			// Find derivative of the magnitude (_N = del |w|)
-			dw_dx = (curl[FLUID_IX(i + 1, j)] - curl[FLUID_IX(i - 1, j)]);	// was * 0.5f; now done later with 2./lenght
-			dw_dy = (curl[FLUID_IX(i, j + 1)] - curl[FLUID_IX(i, j - 1)]);	// was * 0.5f;
-			
-			// Calculate vector length. (|_N|)
-			// Add small factor to prevent divide by zeros.
-			length = (float) sqrt(dw_dx * dw_dx + dw_dy * dw_dy) + 0.000001f;
-			
-			// N = ( _N/|_N| )
-			length = 2./length;	// the 2. come from the previous * 0.5
-			dw_dx *= length;
-			dw_dy *= length;
+			int j = _activeRows[row];
+			if( j < 2 || j >= _NY ) continue;
+			const int *spans;
+			int numSpans = getRowSpans(j, &spans);
 			
-			v = calcCurl(i, j);
+			// the scratch rows cover the spans of one tile row widened by a cell
+			int tile = ( j - 1 ) / FLUID_TILE_SIZE;
+			if( tile != rowsTile ) {
+				rowJ[0] = rowJ[1] = rowJ[2] = -1;
+				rowsTile = tile;
+			}
+			for (int jj = j - 1; jj <= j + 1; jj++ )
+			{
+				if( rowJ[jj % 3] == jj ) continue;
+				rowJ[jj % 3] = jj;
+				float *w = rows[jj % 3];
+				for (int s = 0; s < numSpans; s++ )
+				{
+					int i0 = ci::math<int>::max( spans[2*s] - 1, 1 );
+					int i1 = ci::math<int>::min( spans[2*s+1] + 1, _NX + 1 );
+					if( _kernels )
+						_kernels->curlRow( u + FLUID_IX(i0, jj), v + FLUID_IX(i0, jj), w + i0, i1 - i0, _stride );
+					else
+						for (int i = i0; i < i1; i++ )
+							w[i] = calcCurl(i, jj);
+				}
+			}
 			
-			// N x w
-			Fvc_xy[FLUID_IX(i, j)].x = dw_dy * -v;
-			Fvc_xy[FLUID_IX(i, j)].y = dw_dx *  v;
+			const float *wDown = rows[( j - 1 ) % 3];
+			const float *w = rows[j % 3];
+			const float *wUp = rows[( j + 1 ) % 3];
+			for (int s = 0; s < numSpans; s++ )
+			{
+				int i0 = ci::math<int>::max( spans[2*s], 2 );
+				int i1 = ci::math<int>::min( spans[2*s+1], _NX );		//for (int i = 2; i < _NX; i++)
+				if( i0 >= i1 ) continue;
+				if( _kernels ) {
+					_kernels->vorticityRow( wDown + i0, w + i0, wUp + i0, Fvc_x + FLUID_IX(i0, j), Fvc_y + FLUID_IX(i0, j), i1 - i0 );
+					continue;
+				}
+				for (int i = i0; i < i1; i++ )
+				{
+					// Find derivative of the magnitude (_N = del |w|)
+					float dw_dx = fabs(w[i + 1]) - fabs(w[i - 1]);		// was * 0.5f; now done later with 2./lenght
+					float dw_dy = fabs(wUp[i]) - fabs(wDown[i]);		// was * 0.5f;
+				
+					// Calculate vector length. (|_N|)
+					// Add small factor to prevent divide by zeros.
+					float length = (float) sqrt(dw_dx * dw_dx + dw_dy * dw_dy) + 0.000001f;
+				
+					// N = ( _N/|_N| )
+					length = 2./length;	// the 2. come from the previous * 0.5
+					dw_dx *= length;
+					dw_dy *= length;
+				
+					// N x w
+					Fvc_x[FLUID_IX(i, j)] = dw_dy * -w[i];
+					Fvc_y[FLUID_IX(i, j)] = dw_dx *  w[i];
+				}
+			}
 		}
-	}
+	} );
 }
 
 void ciMsaFluidSolver::update() {
+	ciMsaFluidDenormalGuard denormalGuard( doFlushDenormals );
+	beginStageTimers();
+	
+	// the boundaries depend on the region
+	const bool regionChanged = updateRegion();
+	selectSpecializations();
+	
+	_frameIterations = 0;
+	_frameResidual = 0;
+	_cellCount = 0;
+	_iterationCount = 0;
+	
+	(this->*_step)( regionChanged );
+	
+	if( statisticsInterval > 0 && ++_statisticsFrame >= statisticsInterval ) {
+		_statisticsFrame = 0;
+		updateStatistics();
+		markStage( FLUID_STAGE_FADE );
+	}
+	
+	_lastFrameIterations = _frameIterations;
+	_lastFrameResidual = _frameResidual;
+	
+	endStageTimers();
+}
+
+template< bool RGB, bool VORTICITY >
+void ciMsaFluidSolver::stepT(bool regionChanged) {
+	clearSourcesOutsideRegion< RGB >( true, !_dyeSolver );
+	updateActiveTiles< RGB >( regionChanged );
+	
 	addSourceUV();
+	markStage( FLUID_STAGE_ADD_SOURCE );
 	
-	if( doVorticityConfinement )
+	if( VORTICITY )
 	{
-		vorticityConfinement(uvOld);
+		vorticityConfinement(uOld, vOld);
+		markStage( FLUID_STAGE_VORTICITY );
 		addSourceUV();
+		markStage( FLUID_STAGE_ADD_SOURCE );
 	}
 	
 	swapUV();
 	
 	diffuseUV( viscocity );
+	markStage( FLUID_STAGE_DIFFUSE );
 	
-	project(uv, uvOld);
+	project(u, v, projectionPressure(0), vOld);
+	markStage( FLUID_STAGE_PROJECT );
 	
 	swapUV();
 	
-	advect2d(uv, uvOld);
+	// the dye grid is advected with the final velocity
+	if( doFusedAdvection && !_dyeSolver )
+	{
+		addDye< RGB >();
+		
+		advectFused< RGB >(u, v, uOld, vOld);
+		markStage( FLUID_STAGE_ADVECT );
+		
+		project(u, v, projectionPressure(1), vOld);
+		markStage( FLUID_STAGE_REPROJECT );
+	}
+	else
+	{
+		advect2d(u, v, uOld, vOld);
+		markStage( FLUID_STAGE_ADVECT );
+		
+		project(u, v, projectionPressure(1), vOld);
+		markStage( FLUID_STAGE_REPROJECT );
+		
+		addDye< RGB >();
+		
+		advectDye< RGB >();
+		markStage( FLUID_STAGE_ADVECT );
+	}
 	
-	project(uv, uvOld);
+	fadeDye< RGB >();
+	markStage( FLUID_STAGE_FADE );
+}
+
+// after this the dye to advect is in the old planes
+template< bool RGB >
+void ciMsaFluidSolver::addDye() {
+	if(_dyeSolver)
+		return;
 	
-	if(doRGB)
+	if(RGB)
 	{
 		addSourceRGB();
+		markStage( FLUID_STAGE_ADD_SOURCE );
 		swapRGB();
 		
 		if( colorDiffusion!=0. && _dt!=0. )
 		{
 			diffuseRGB(0, colorDiffusion );
+			markStage( FLUID_STAGE_DIFFUSE );
 			swapRGB();
 		}
-		
-		advectRGB(0, uv);
-		fadeRGB();
 	} 
 	else
 	{
 		addSource(r, rOld);
+		markStage( FLUID_STAGE_ADD_SOURCE );
 		swapR();
 		
 		if( colorDiffusion!=0. && _dt!=0. )
 		{
 			diffuse(0, r, rOld, colorDiffusion );
+			markStage( FLUID_STAGE_DIFFUSE );
 			swapRGB();
 		}
-		
-		advect(0, r, rOld, uv);	
-		fadeR();
 	}
 }
 
-#define ZERO_THRESH		1e-9			// if value falls under this, set to zero (to avoid denormal slowdown)
-#define CHECK_ZERO(p)	if(fabsf(p)<ZERO_THRESH) p = 0
+template< bool RGB >
+void ciMsaFluidSolver::advectDye() {
+	if(_dyeSolver)
+		updateDye();
+	else if(RGB)
+		advectRGB(0, u, v);
+	else
+		advect(0, r, rOld, u, v);
+}
+
+template< bool RGB >
+void ciMsaFluidSolver::fadeDye() {
+	countCells( RGB ? 3 : 1 );
+	(this->*_fadeDye)();
+}
+
+// all tiles start active
+void ciMsaFluidSolver::setupTiles() {
+	_numTilesX = ( _NX + FLUID_TILE_SIZE - 1 ) / FLUID_TILE_SIZE;
+	_numTilesY = ( _NY + FLUID_TILE_SIZE - 1 ) / FLUID_TILE_SIZE;
+	int numTiles = _numTilesX * _numTilesY;
+	_tileVelocityMax.assign( numTiles, 0.0f );
+	_tileDyeMax.assign( numTiles, 0.0f );
+	_tileLive.assign( numTiles, 1 );
+	_tileActive.assign( numTiles, 1 );
+	buildTileSpans();
+}
+
+// measures the velocity and the dye (including the injected color) of every tile, the tiles above the thresholds
+// and their neighbours are processed by this update. the tiles dropping out are cleared, so the skipped
+// cells hold exact zeros that the stencils of the neighbouring active cells can read. tiles outside the
+// region of interest are never active
+template< bool RGB >
+void ciMsaFluidSolver::updateActiveTiles(bool regionChanged) {
+	const int tileI0 = ( _roiI0 - 1 ) / FLUID_TILE_SIZE, tileI1 = ( _roiI1 - 1 ) / FLUID_TILE_SIZE;
+	const int tileJ0 = ( _roiJ0 - 1 ) / FLUID_TILE_SIZE, tileJ1 = ( _roiJ1 - 1 ) / FLUID_TILE_SIZE;
+	if( !doActiveTiles ) {
+		bool changed = regionChanged;
+		for( int ty = 0; ty < _numTilesY; ty++ ) {
+			for( int tx = 0; tx < _numTilesX; tx++ ) {
+				unsigned char active = tx >= tileI0 && tx <= tileI1 && ty >= tileJ0 && ty <= tileJ1;
+				changed |= _tileActive[ty * _numTilesX + tx] != active;
+				_tileActive[ty * _numTilesX + tx] = active;
+			}
+		}
+		if( changed )
+			buildTileSpans();
+		return;
+	}
+	int numTiles = _numTilesX * _numTilesY;
+	
+	_pool->run( 0, _numTilesY, [&]( int, int ty0, int ty1 ) {
+		for( int ty = ty0; ty < ty1; ty++ ) {
+			float *velocityMax = &_tileVelocityMax[ty * _numTilesX];
+			float *dyeMax = &_tileDyeMax[ty * _numTilesX];
+			std::fill( velocityMax, velocityMax + _numTilesX, 0.0f );
+			std::fill( dyeMax, dyeMax + _numTilesX, 0.0f );
+			
+			const float *velocityPlanes[] = { u, v };
+			const float *dyePlanes[] = { r, rOld, g, gOld, b, bOld };
+			const int numDyePlanes = RGB ? 6 : 2;
+			int jEnd = ci::math<int>::min( ( ty + 1 ) * FLUID_TILE_SIZE, _NY ) + 1;
+			for( int j = ty * FLUID_TILE_SIZE + 1; j < jEnd; j++ ) {
+				for( int k = 0; k < 2; k++ )
+					tileMax( velocityPlanes[k] + FLUID_IX(1, j), velocityMax );
+				for( int k = 0; k < numDyePlanes; k++ )
+					tileMax( dyePlanes[k] + FLUID_IX(1, j), dyeMax );
+			}
+		}
+	} );
+	
+	for( int t = 0; t < numTiles; t++ )
+		_tileLive[t] = ( _tileVelocityMax[t] > tileVelocityThreshold ) || ( _tileDyeMax[t] > tileDyeThreshold );
+	
+	for( int ty = 0; ty < _numTilesY; ty++ ) {
+		for( int tx = 0; tx < _numTilesX; tx++ ) {
+			// the halo wraps around the wrapped edges, the flow crosses them in one step
+			bool active = false;
+			for( int dy = -1; dy <= 1 && !active; dy++ ) {
+				int ny = ty + dy;
+				if( wrap_y )
+					ny = ( ny + _numTilesY ) % _numTilesY;
+				else if( ny < 0 || ny >= _numTilesY )
+					continue;
+				for( int dx = -1; dx <= 1 && !active; dx++ ) {
+					int nx = tx + dx;
+					if( wrap_x )
+						nx = ( nx + _numTilesX ) % _numTilesX;
+					else if( nx < 0 || nx >= _numTilesX )
+						continue;
+					active = _tileLive[ny * _numTilesX + nx] != 0;
+				}
+			}
+			active = active && tx >= tileI0 && tx <= tileI1 && ty >= tileJ0 && ty <= tileJ1;
+			
+			int t = ty * _numTilesX + tx;
+			if( _tileActive[t] && !active )
+				clearTile( tx, ty );
+			_tileActive[t] = active;
+		}
+	}
+	
+	buildTileSpans();
+}
+
+// max |x| of the FLUID_TILE_SIZE cell groups of the interior row starting at x
+void ciMsaFluidSolver::tileMax( const float *x, float *maxima ) const {
+	if( _kernels ) {
+		_kernels->tileMax( x, _NX, FLUID_TILE_SIZE, maxima );
+		return;
+	}
+	for( int i = 0; i < _NX; i++ ) {
+		float a = fabsf( x[i] );
+		if( a > maxima[i / FLUID_TILE_SIZE] )
+			maxima[i / FLUID_TILE_SIZE] = a;
+	}
+}
+
+// zeroes the tile in every field, including the kept pressure
+void ciMsaFluidSolver::clearTile( int tx, int ty ) {
+	int i0 = tx * FLUID_TILE_SIZE + 1;
+	int i1 = ci::math<int>::min( i0 + FLUID_TILE_SIZE, _NX + 1 );
+	int j0 = ty * FLUID_TILE_SIZE + 1;
+	int j1 = ci::math<int>::min( j0 + FLUID_TILE_SIZE, _NY + 1 );
+	float *planes[FLUID_ARENA_PLANES + 2];
+	int numPlanes = 0;
+	for( int k = 0; k < FLUID_ARENA_PLANES; k++ )
+		planes[numPlanes++] = _arena + k * _planeSize;
+	for( int k = 0; k < 2; k++ )
+		if( _pressure[k].size() == (size_t)_planeSize )
+			planes[numPlanes++] = _pressure[k].data();
+	for( int k = 0; k < numPlanes; k++ ) {
+		for( int j = j0; j < j1; j++ )
+			memset( planes[k] + FLUID_IX(i0, j), 0, ( i1 - i0 ) * sizeof(float) );
+	}
+}
+
+// merges the runs of active tiles in each tile row into cell spans, clipped to the region of interest
+void ciMsaFluidSolver::buildTileSpans() {
+	_tileSpans.clear();
+	_tileSpanOffsets.resize( _numTilesY + 1 );
+	_activeRows.clear();
+	_numActiveTiles = 0;
+	_numActiveCells = 0;
+	
+	for( int ty = 0; ty < _numTilesY; ty++ ) {
+		_tileSpanOffsets[ty] = (int)_tileSpans.size();
+		if( ty * FLUID_TILE_SIZE + 1 > _roiJ1 || ( ty + 1 ) * FLUID_TILE_SIZE < _roiJ0 )
+			continue;
+		const unsigned char *active = &_tileActive[ty * _numTilesX];
+		for( int tx = 0; tx < _numTilesX; ) {
+			if( !active[tx] ) {
+				tx++;
+				continue;
+			}
+			int txEnd = tx;
+			while( txEnd < _numTilesX && active[txEnd] )
+				txEnd++;
+			int i0 = ci::math<int>::max( tx * FLUID_TILE_SIZE + 1, _roiI0 );
+			int i1 = ci::math<int>::min( txEnd * FLUID_TILE_SIZE, _roiI1 ) + 1;
+			if( i0 < i1 ) {
+				_tileSpans.push_back( i0 );
+				_tileSpans.push_back( i1 );
+				_numActiveTiles += txEnd - tx;
+			}
+			tx = txEnd;
+		}
+		
+		if( (int)_tileSpans.size() > _tileSpanOffsets[ty] ) {
+			int rowCells = 0;
+			for( int s = _tileSpanOffsets[ty]; s < (int)_tileSpans.size(); s += 2 )
+				rowCells += _tileSpans[s + 1] - _tileSpans[s];
+			int jEnd = ci::math<int>::min( ( ty + 1 ) * FLUID_TILE_SIZE, _roiJ1 ) + 1;
+			for( int j = ci::math<int>::max( ty * FLUID_TILE_SIZE + 1, _roiJ0 ); j < jEnd; j++ ) {
+				_activeRows.push_back( j );
+				_numActiveCells += rowCells;
+			}
+		}
+	}
+	_tileSpanOffsets[_numTilesY] = (int)_tileSpans.size();
+}
+
+// resolves the region of interest to the simulated cells [_roiI0, _roiI1] x [_roiJ0, _roiJ1], the whole interior
+// while it is off. returns true when they changed
+bool ciMsaFluidSolver::resolveRegion() {
+	int i0 = 1, i1 = _NX, j0 = 1, j1 = _NY;
+	if( doRegionOfInterest ) {
+		i0 = ci::math<int>::max( (int)floorf( roiRect.x1 * _NX ) + 1 - roiMargin, 1 );
+		i1 = ci::math<int>::min( (int)ceilf( roiRect.x2 * _NX ) + roiMargin, _NX );
+		j0 = ci::math<int>::max( (int)floorf( roiRect.y1 * _NY ) + 1 - roiMargin, 1 );
+		j1 = ci::math<int>::min( (int)ceilf( roiRect.y2 * _NY ) + roiMargin, _NY );
+		// at least one cell
+		i0 = ci::math<int>::min( i0, _NX );
+		i1 = ci::math<int>::max( i1, i0 );
+		j0 = ci::math<int>::min( j0, _NY );
+		j1 = ci::math<int>::max( j1, j0 );
+	}
+	
+	bool changed = i0 != _roiI0 || i1 != _roiI1 || j0 != _roiJ0 || j1 != _roiJ1;
+	_roiI0 = i0;
+	_roiI1 = i1;
+	_roiJ0 = j0;
+	_roiJ1 = j1;
+	return changed;
+}
+
+// the region of this update, the fields are cleared outside a new one
+bool ciMsaFluidSolver::updateRegion() {
+	if( !resolveRegion() )
+		return false;
+	clearOutsideRegion();
+	return true;
+}
+
+// zeroes every field outside the region and its ring, including the kept pressure
+void ciMsaFluidSolver::clearOutsideRegion() {
+	float *planes[FLUID_ARENA_PLANES + 2];
+	int numPlanes = 0;
+	for( int k = 0; k < FLUID_ARENA_PLANES; k++ )
+		planes[numPlanes++] = _arena + k * _planeSize;
+	for( int k = 0; k < 2; k++ )
+		if( _pressure[k].size() == (size_t)_planeSize )
+			planes[numPlanes++] = _pressure[k].data();
+	clearOutsideRegion( planes, numPlanes );
+}
+
+// the stages only write the region and its ring, so with the planes swapped between the stages every plane
+// has to be zero outside it. cells of the grid border next to the region are kept
+void ciMsaFluidSolver::clearOutsideRegion( float **planes, int numPlanes ) {
+	if( !hasRegionWalls() )
+		return;
+	const int i0 = _roiI0 - 1, i1 = _roiI1 + 1;		// the ring
+	const int j0 = _roiJ0 - 1, j1 = _roiJ1 + 1;
+	for( int k = 0; k < numPlanes; k++ ) {
+		float *x = planes[k];
+		memset( x, 0, j0 * _stride * sizeof(float) );
+		memset( x + FLUID_IX(0, j1 + 1), 0, ( _NY + 1 - j1 ) * _stride * sizeof(float) );
+		for( int j = j0; j <= j1; j++ ) {
+			memset( x + FLUID_IX(0, j), 0, i0 * sizeof(float) );
+			memset( x + FLUID_IX(i1 + 1, j), 0, ( _NX + 1 - i1 ) * sizeof(float) );
+		}
+	}
+}
+
+// drops the forces and the colors added outside the region since the last update
+template< bool RGB >
+void ciMsaFluidSolver::clearSourcesOutsideRegion( bool velocity, bool dye ) {
+	float *planes[] = { u, v, rOld, gOld, bOld };		// the forces go straight to the velocity
+	int begin = velocity ? 0 : 2;
+	int end = dye ? ( RGB ? 5 : 3 ) : 2;
+	clearOutsideRegion( planes + begin, end - begin );
+}
 
-void ciMsaFluidSolver::fadeR() {
-	// I want the fluid to gradually fade out so the screen doesn't fill. the amount it fades out depends on how full it is, and how uniform (i.e. boring) the fluid is...
-	//		float holdAmount = 1 - _avgDensity * _avgDensity * fadeSpeed;	// this is how fast the density will decay depending on how full the screen currently is
-	float holdAmount = 1 - fadeSpeed;
+// the ring of cells around the region mirrors its border cells like the ghost cells of setBoundary, without wrap.
+// the rows of the ring include its corners
+void ciMsaFluidSolver::setRegionBoundary( int bound, float *x ) {
+	const float signX = ( bound == 1 ) ? -1.0f : 1.0f;
+	const float signY = ( bound == 2 ) ? -1.0f : 1.0f;
+	if( _roiI0 > 1 )
+		for( int j = _roiJ0; j <= _roiJ1; j++ )
+			x[FLUID_IX(_roiI0 - 1, j)] = signX * x[FLUID_IX(_roiI0, j)];
+	if( _roiI1 < _NX )
+		for( int j = _roiJ0; j <= _roiJ1; j++ )
+			x[FLUID_IX(_roiI1 + 1, j)] = signX * x[FLUID_IX(_roiI1, j)];
 	
-	_avgDensity = 0;
-	_avgSpeed = 0;
+	const int n = _roiI1 - _roiI0 + 3;
+	if( _roiJ0 > 1 ) {
+		float *dst = x + FLUID_IX(_roiI0 - 1, _roiJ0 - 1);
+		for( int i = 0; i < n; i++ )
+			dst[i] = signY * dst[i + _stride];
+	}
+	if( _roiJ1 < _NY ) {
+		float *dst = x + FLUID_IX(_roiI0 - 1, _roiJ1 + 1);
+		for( int i = 0; i < n; i++ )
+			dst[i] = signY * dst[i - _stride];
+	}
+}
+
+// with more than one thread every FLUID_SERIAL_TIMING_INTERVAL-th frame runs single threaded
+// to keep the baseline of the speedup up to date
+void ciMsaFluidSolver::beginStageTimers() {
+	if( !doStageTimers ) return;
 	
-	float totalDeviations = 0;
-	float currentDeviation;
-	float tmp_r;
-	//	float uniformityMult = uniformity * 0.05f;
+	_frameCount++;
+	bool serialFrame = ( _pool->getNumThreads() == 1 ) || ( _frameCount % FLUID_SERIAL_TIMING_INTERVAL ) == 0;
+	_pool->setParallel( !serialFrame );
 	
-	_avgSpeed = 0;
-	for (int i = _numCells-1; i >=0; --i) {
-		// clear old values
-		uvOld[i] = ci::Vec2f::zero(); 
-		rOld[i] = 0;
-		//		gOld[i] = bOld[i] = 0;
-		
-		// calc avg speed
-		_avgSpeed += uv[i].x * uv[i].x + uv[i].y * uv[i].y;
-		
-		// calc avg density
-		tmp_r = ci::math<float>::min( 1.0f, r[i] );
-		
-		//		g[i] = MIN(1.0f, g[i]);
-		//		b[i] = MIN(1.0f, b[i]);
-		//		float density = MAX(r[i], MAX(g[i], b[i]));
-		_avgDensity += tmp_r;	// add it up
-		
-		// calc deviation (for uniformity)
-		currentDeviation = tmp_r - _avgDensity;
-		totalDeviations += currentDeviation * currentDeviation;
-		
-		// fade out old
-		r[i] = tmp_r * holdAmount;
-		
-		CHECK_ZERO(r[i]);
-		CHECK_ZERO(uv[i].x);
-		CHECK_ZERO(uv[i].y);
-		if(doVorticityConfinement) CHECK_ZERO(curl[i]);
-		
+	for( int i = 0; i < FLUID_STAGE_COUNT; i++ ) {
+		_stageFrameTimes[i] = 0;
+		_stageFrameCells[i] = 0;
+		_stageFrameIterations[i] = 0;
 	}
-	_avgDensity *= _invNumCells;
-	//	_avgSpeed *= _invNumCells;
+	// update() resets the counts after this
+	_stageMarkCells = 0;
+	_stageMarkIterations = 0;
+	_stageTimer.start();
+	_stageMark = _stageTimer.getSeconds();
+}
+
+void ciMsaFluidSolver::endStageTimers() {
+	if( !doStageTimers ) return;
 	
-	//	println("%.3f\n", _avgSpeed);
-	_uniformity = 1.0f / (1 + totalDeviations * _invNumCells);		// 0: very wide distribution, 1: very uniform
+	_stageTimer.stop();
+	bool serialFrame = !_pool->isParallel();
+	for( int i = 0; i < FLUID_STAGE_COUNT; i++ ) {
+		float ms = (float)( _stageFrameTimes[i] * 1000.0 );
+		// the serial baseline is sampled less often, it is smoothed less
+		if( serialFrame )
+			_serialStageTimes[i] = _serialStageTimes[i] > 0 ? ci::lerp( _serialStageTimes[i], ms, 0.2f ) : ms;
+		if( !serialFrame || _pool->getNumThreads() == 1 )
+			_stageTimes[i] = _stageTimes[i] > 0 ? ci::lerp( _stageTimes[i], ms, 0.05f ) : ms;
+		
+		ciMsaFluidStageCounters &counters = _stageCounters[i];
+		counters.time = _stageTimes[i];
+		counters.speedup = getStageSpeedup( i );
+		counters.cells = _stageFrameCells[i];
+		counters.iterations = _stageFrameIterations[i];
+	}
+	_pool->setParallel( true );
 }
 
+#define ZERO_THRESH		1e-9			// if value falls under this, set to zero (to avoid denormal slowdown)
+#define CHECK_ZERO(p)	p = ( fabsf(p) < ZERO_THRESH ) ? 0 : p		// a select instead of a branch
+
+// vectorized paths, the scalar ones are the fadeScalar() specializations
+void ciMsaFluidSolver::fadeR() {
+	float holdAmount = 1 - fadeSpeed;
+	float *planes[] = { r };
+	float *oldPlanes[] = { rOld };
+	fadeKernels( planes, oldPlanes, 1, holdAmount );
+}
 
 void ciMsaFluidSolver::fadeRGB() {
+	float holdAmount = 1 - fadeSpeed;
+	float *planes[] = { r, g, b };
+	float *oldPlanes[] = { rOld, gOld, bOld };
+	fadeKernels( planes, oldPlanes, 3, holdAmount );
+}
+
+// without FLUSH the hardware flushes the denormals
+template< bool RGB, bool FLUSH >
+void ciMsaFluidSolver::fadeScalar() {
 	// I want the fluid to gradually fade out so the screen doesn't fill. the amount it fades out depends on how full it is, and how uniform (i.e. boring) the fluid is...
 	//		float holdAmount = 1 - _avgDensity * _avgDensity * fadeSpeed;	// this is how fast the density will decay depending on how full the screen currently is
 	float holdAmount = 1 - fadeSpeed;
 	
-	_avgDensity = 0;
-	_avgSpeed = 0;
-	
-	float totalDeviations = 0;
-	float currentDeviation;
-	//	float uniformityMult = _uniformity * 0.05f;
-	float tmp_r, tmp_g, tmp_b;
-	_avgSpeed = 0;
-	for (int i = _numCells-1; i >=0; --i)
+	for (int j = _roiJ1+1; j >= _roiJ0-1; --j)
+	for (int i = FLUID_IX(_roiI1+1, j); i >= FLUID_IX(_roiI0-1, j); --i)
 	{
 		// clear old values
-		uvOld[i] = ci::Vec2f::zero();
+		uOld[i] = vOld[i] = 0;
 		rOld[i] = 0;
-		gOld[i] = bOld[i] = 0;
-		
-		// calc avg speed
-		_avgSpeed += uv[i].x * uv[i].x + uv[i].y * uv[i].y;
-		
-		// calc avg density
-		tmp_r = ci::math<float>::min( 1.0f, r[i] );
-		tmp_g = ci::math<float>::min( 1.0f, g[i] );
-		tmp_b = ci::math<float>::min( 1.0f, b[i] );
-
-		float density = ci::math<float>::max( tmp_r, ci::math<float>::max( tmp_g, tmp_b ) );
-		_avgDensity += density;	// add it up
-		
-		// calc deviation (for _uniformity)
-		currentDeviation = density - _avgDensity;
-		totalDeviations += currentDeviation * currentDeviation;
+		if( RGB )
+			gOld[i] = bOld[i] = 0;
 		
 		// fade out old
-		r[i] = tmp_r * holdAmount;
-		g[i] = tmp_g * holdAmount;
-		b[i] = tmp_b * holdAmount;
+		r[i] = ci::math<float>::min( 1.0f, r[i] ) * holdAmount;
+		if( RGB ) {
+			g[i] = ci::math<float>::min( 1.0f, g[i] ) * holdAmount;
+			b[i] = ci::math<float>::min( 1.0f, b[i] ) * holdAmount;
+		}
 		
-		CHECK_ZERO(r[i]);
-		CHECK_ZERO(g[i]);
-		CHECK_ZERO(b[i]);
-		CHECK_ZERO(uv[i].x);
-		CHECK_ZERO(uv[i].y);
-		if(doVorticityConfinement) CHECK_ZERO(curl[i]);
+		if( FLUSH ) {
+			CHECK_ZERO(r[i]);
+			if( RGB ) {
+				CHECK_ZERO(g[i]);
+				CHECK_ZERO(b[i]);
+			}
+			CHECK_ZERO(u[i]);
+			CHECK_ZERO(v[i]);
+		}
 	}
-	_avgDensity *= _invNumCells;
-	_avgSpeed *= _invNumCells;
+}
+
+// vectorized fade of the dye planes and the velocity in row bands, over the region and its ring
+void ciMsaFluidSolver::fadeKernels( float **planes, float **oldPlanes, int numPlanes, float holdAmount ) {
+	const bool flush = flushesPerElement();
+	_pool->run( _roiJ0 - 1, _roiJ1 + 2, [&]( int, int j0, int j1 ) {
+		forRegionCells( j0, j1, [&]( int offset, int n ) {
+			float *bandPlanes[3], *bandOldPlanes[3];
+			for( int k = 0; k < numPlanes; k++ ) {
+				bandPlanes[k] = planes[k] + offset;
+				bandOldPlanes[k] = oldPlanes[k] + offset;
+			}
+			_kernels->fadeDye( bandPlanes, bandOldPlanes, numPlanes, n, holdAmount, flush );
+			_kernels->fadeVelocity( u + offset, uOld + offset, n, flush );
+			_kernels->fadeVelocity( v + offset, vOld + offset, n, flush );
+		} );
+	} );
+}
+
+// runs rowSums( row, sums ) for the rows [begin, end) on the thread pool, it adds the row to numSums partial sums.
+// the partial sums are added in order, per band they only depend on the number of bands, per row on nothing
+template< typename RowSums >
+void ciMsaFluidSolver::sumRows( int begin, int end, int numSums, double *sums, const RowSums &rowSums ) {
+	const int numSlots = doDeterministic ? end - begin : FLUID_MAX_THREADS;
+	_partialSums.assign( numSlots * numSums, 0.0 );
+	int numBands = _pool->run( begin, end, [&]( int band, int row0, int row1 ) {
+		for (int row = row0; row < row1; row++)
+			rowSums( row, &_partialSums[( doDeterministic ? row - begin : band ) * numSums] );
+	} );
+	
+	const int numUsed = doDeterministic ? numSlots : numBands;
+	for( int k = 0; k < numSums; k++ )
+		sums[k] = 0;
+	for( int slot = 0; slot < numUsed; slot++ )
+		for( int k = 0; k < numSums; k++ )
+			sums[k] += _partialSums[slot * numSums + k];
+}
+
+// average density (max of the color planes clamped to 1), its variance and the average squared speed,
+// reduced over all cells including the boundary in row bands. the dye comes from the dye grid
+void ciMsaFluidSolver::updateStatistics() {
+	ciMsaFluidSolver &dye = _dyeSolver ? *_dyeSolver : *this;
+	double densitySums[2];
+	dye.sumDensity( densitySums );
+	double mean = densitySums[0] * dye._invNumCells;
+	double variance = densitySums[1] * dye._invNumCells - mean * mean;
+	_avgDensity = (float)mean;
+	_uniformity = (float)( 1.0 / ( 1 + ci::math<double>::max( 0.0, variance ) ) );		// 0: very wide distribution, 1: very uniform
 	
-	//println("%.3f\n", _avgDensity);
-	_uniformity = 1.0f / (1 + totalDeviations * _invNumCells);		// 0: very wide distribution, 1: very uniform
+	double sumSpeed;
+	sumRows( 0, _NY + 2, 1, &sumSpeed, [&]( int j, double *sums ) {
+		const float *rowU = u + FLUID_IX(0, j);
+		const float *rowV = v + FLUID_IX(0, j);
+		float rowSum = 0;
+		for (int i = 0; i < _NX + 2; i++)
+			rowSum += rowU[i] * rowU[i] + rowV[i] * rowV[i];
+		sums[0] += rowSum;
+	} );
+	_avgSpeed = (float)( sumSpeed * _invNumCells );
+}
+
+uint64_t ciMsaFluidSolver::hashFields() const {
+	uint64_t hash = 14695981039346656037ULL;
+	const ciMsaFluidSolver &dye = _dyeSolver ? *_dyeSolver : *this;
+	const float *planes[] = { u, v, dye.r, dye.g, dye.b };
+	const int numPlanes = doRGB ? 5 : 3;
+	for( int k = 0; k < numPlanes; k++ ) {
+		const ciMsaFluidSolver &grid = k < 2 ? *this : dye;
+		for( int j = 0; j < grid._NY + 2; j++ ) {
+			const unsigned char *bytes = reinterpret_cast< const unsigned char* >( planes[k] + j * grid._stride );
+			for( size_t n = 0; n < ( grid._NX + 2 ) * sizeof(float); n++ ) {
+				hash ^= bytes[n];
+				hash *= 1099511628211ULL;
+			}
+		}
+	}
+	return hash;
+}
+
+// sum of the densities and the squared densities
+void ciMsaFluidSolver::sumDensity( double *sums ) {
+	const int numPlanes = doRGB ? 3 : 1;
+	const float *planes[] = { r, g, b };
+	sumRows( 0, _NY + 2, 2, sums, [&]( int j, double *rowSums ) {
+		const int offset = FLUID_IX(0, j);
+		float rowSum = 0, rowSum2 = 0;
+		for (int i = 0; i < _NX + 2; i++)
+		{
+			float density = ci::math<float>::min( 1.0f, planes[0][offset + i] );
+			for (int k = 1; k < numPlanes; k++)
+				density = ci::math<float>::max( density, ci::math<float>::min( 1.0f, planes[k][offset + i] ) );
+			rowSum += density;
+			rowSum2 += density * density;
+		}
+		rowSums[0] += rowSum;
+		rowSums[1] += rowSum2;
+	} );
+}
+
+ciMsaFluidSolver& ciMsaFluidSolver::setStatisticsInterval(int frames) {
+	statisticsInterval = frames;
+	_statisticsFrame = 0;
+	return *this;
 }
 
+int ciMsaFluidSolver::getStatisticsInterval() const {
+	return statisticsInterval;
+}
 
 void ciMsaFluidSolver::addSourceUV()
 {
-	for (int i = _numCells-1; i >=0; --i)
+	countCells( 2 );
+	if( _kernels ) {
+		addSourceKernels( u, uOld );
+		addSourceKernels( v, vOld );
+		return;
+	}
+	for (int i = FLUID_IX(0, _roiJ1 + 2) - 1; i >= FLUID_IX(0, _roiJ0 - 1); --i)
 	{
-		uv[i].x += _dt * uvOld[i].x;
-		uv[i].y += _dt * uvOld[i].y;
+		u[i] += _dt * uOld[i];
+		v[i] += _dt * vOld[i];
 	}
 }
 
 void ciMsaFluidSolver::addSourceRGB()
 {
-	for (int i = _numCells-1; i >=0; --i)
+	countCells( 3 );
+	if( _kernels ) {
+		addSourceKernels( r, rOld );
+		addSourceKernels( g, gOld );
+		addSourceKernels( b, bOld );
+		return;
+	}
+	for (int i = FLUID_IX(0, _roiJ1 + 2) - 1; i >= FLUID_IX(0, _roiJ0 - 1); --i)
 	{
 		r[i] += _dt * rOld[i];
 		g[i] += _dt * gOld[i];
@@ -480,13 +1811,40 @@ void ciMsaFluidSolver::addSourceRGB()
 }
 
 void ciMsaFluidSolver::addSource(float* x, float* x0) {
-	for (int i = _numCells-1; i >=0; --i)
+	countCells( 1 );
+	if( _kernels ) {
+		addSourceKernels( x, x0 );
+		return;
+	}
+	for (int i = FLUID_IX(0, _roiJ1 + 2) - 1; i >= FLUID_IX(0, _roiJ0 - 1); --i)
 	{
 		x[i] += _dt * x0[i];
 	}
 }
 
-void ciMsaFluidSolver::advect( int bound, float* d, const float* d0, const ci::Vec2f* duv) {
+// x += dt * x0 over the region and its ring, over whole rows including the padding when the region spans them
+void ciMsaFluidSolver::addSourceKernels( float* x, const float* x0 ) {
+	_pool->run( _roiJ0 - 1, _roiJ1 + 2, [&]( int, int j0, int j1 ) {
+		forRegionCells( j0, j1, [&]( int offset, int n ) {
+			_kernels->addSource( x + offset, x0 + offset, _dt, n );
+		} );
+	} );
+}
+
+void ciMsaFluidSolver::advectKernels( const ciMsaFluidAdvectArgs &args ) {
+	_pool->run( 0, (int)_activeRows.size(), [&]( int, int row0, int row1 ) {
+		for (int row = row0; row < row1; row++)
+		{
+			int j = _activeRows[row];
+			const int *spans;
+			int numSpans = getRowSpans( j, &spans );
+			for (int s = 0; s < numSpans; s++)
+				_kernels->advectRow( args, j, spans[2*s], spans[2*s+1] );
+		}
+	} );
+}
+
+void ciMsaFluidSolver::advect( int bound, float* d, const float* d0, const float* du, const float* dv ) {
 	int i0, j0, i1, j1;
 	float x, y, s0, t0, s1, t1;
 	int	index;
@@ -494,22 +1852,37 @@ void ciMsaFluidSolver::advect( int bound, float* d, const float* d0, const ci::V
 	const float dt0x = _dt * _NX;
 	const float dt0y = _dt * _NY;
 	
-	for (int j = _NY; j > 0; --j)
+	// the backtrace stays inside the region
+	const float minX = _roiI0 - 0.5f, maxX = _roiI1 + 0.5f;
+	const float minY = _roiJ0 - 0.5f, maxY = _roiJ1 + 0.5f;
+	
+	countCells( 1 );
+	if( _kernels ) {
+		ciMsaFluidAdvectArgs args = { du, dv, 1, { d }, { d0 }, dt0x, dt0y, minX, maxX, minY, maxY, _stride };
+		advectKernels( args );
+		setBoundary(bound, d);
+		return;
+	}
+	
+	for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
 	{
-		for (int i = _NX; i > 0; --i)
+		int j = _activeRows[row];
+		const int *spans;
+		for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+		for (int i = spans[2*s+1] - 1; i >= spans[2*s]; --i)
 		{
 			index = FLUID_IX(i, j);
-			x = i - dt0x * duv[index].x;
-			y = j - dt0y * duv[index].y;
+			x = i - dt0x * du[index];
+			y = j - dt0y * dv[index];
 			
-			if (x > _NX + 0.5) x = _NX + 0.5f;
-			if (x < 0.5)     x = 0.5f;
+			if (x > maxX) x = maxX;
+			if (x < minX) x = minX;
 			
 			i0 = (int) x;
 			i1 = i0 + 1;
 			
-			if (y > _NY + 0.5) y = _NY + 0.5f;
-			if (y < 0.5)     y = 0.5f;
+			if (y > maxY) y = maxY;
+			if (y < minY) y = minY;
 			
 			j0 = (int) y;
 			j1 = j0 + 1;
@@ -530,7 +1903,7 @@ void ciMsaFluidSolver::advect( int bound, float* d, const float* d0, const ci::V
 //          d    d0    du    dv
 // advect(1, u, uOld, uOld, vOld);
 // advect(2, v, vOld, uOld, vOld);
-void ciMsaFluidSolver::advect2d( ci::Vec2f *uv, const ci::Vec2f *duv ) {
+void ciMsaFluidSolver::advect2d( float *u, float *v, const float *du, const float *dv ) {
 	int i0, j0, i1, j1;
 	float s0, t0, s1, t1;
 	int	index;
@@ -538,22 +1911,37 @@ void ciMsaFluidSolver::advect2d( ci::Vec2f *uv, const ci::Vec2f *duv ) {
 	const float dt0x = _dt * _NX;
 	const float dt0y = _dt * _NY;
 	
-	for (int j = _NY; j > 0; --j)
+	const float minX = _roiI0 - 0.5f, maxX = _roiI1 + 0.5f;
+	const float minY = _roiJ0 - 0.5f, maxY = _roiJ1 + 0.5f;
+	
+	countCells( 2 );
+	if( _kernels ) {
+		ciMsaFluidAdvectArgs args = { du, dv, 2, { u, v }, { du, dv }, dt0x, dt0y, minX, maxX, minY, maxY, _stride };
+		advectKernels( args );
+		setBoundary2d(1, u, v);
+		setBoundary2d(2, u, v);
+		return;
+	}
+	
+	for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
 	{
-		for (int i = _NX; i > 0; --i)
+		int j = _activeRows[row];
+		const int *spans;
+		for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+		for (int i = spans[2*s+1] - 1; i >= spans[2*s]; --i)
 		{
 			index = FLUID_IX(i, j);
-			float x = i - dt0x * duv[index].x;
-			float y = j - dt0y * duv[index].y;
+			float x = i - dt0x * du[index];
+			float y = j - dt0y * dv[index];
 			
-			if (x > _NX + 0.5) x = _NX + 0.5f;
-			if (x < 0.5)     x = 0.5f;
+			if (x > maxX) x = maxX;
+			if (x < minX) x = minX;
 			
 			i0 = (int) x;
 			i1 = i0 + 1;
 			
-			if (y > _NY + 0.5) y = _NY + 0.5f;
-			if (y < 0.5)     y = 0.5f;
+			if (y > maxY) y = maxY;
+			if (y < minY) y = minY;
 			
 			j0 = (int) y;
 			j1 = j0 + 1;
@@ -563,18 +1951,81 @@ void ciMsaFluidSolver::advect2d( ci::Vec2f *uv, const ci::Vec2f *duv ) {
 			t1 = y - j0;
 			t0 = 1 - t1;
 			
-			uv[index].x = s0 * (t0 * duv[FLUID_IX(i0, j0)].x + t1 * duv[FLUID_IX(i0, j1)].x)
-						+ s1 * (t0 * duv[FLUID_IX(i1, j0)].x + t1 * duv[FLUID_IX(i1, j1)].x);
-			uv[index].y = s0 * (t0 * duv[FLUID_IX(i0, j0)].y + t1 * duv[FLUID_IX(i0, j1)].y)
-						+ s1 * (t0 * duv[FLUID_IX(i1, j0)].y + t1 * duv[FLUID_IX(i1, j1)].y);
+			u[index] = s0 * (t0 * du[FLUID_IX(i0, j0)] + t1 * du[FLUID_IX(i0, j1)])
+						+ s1 * (t0 * du[FLUID_IX(i1, j0)] + t1 * du[FLUID_IX(i1, j1)]);
+			v[index] = s0 * (t0 * dv[FLUID_IX(i0, j0)] + t1 * dv[FLUID_IX(i0, j1)])
+						+ s1 * (t0 * dv[FLUID_IX(i1, j0)] + t1 * dv[FLUID_IX(i1, j1)]);
 			
 		}
 	}
-	setBoundary2d(1, uv);
-	setBoundary2d(2, uv);	
+	setBoundary2d(1, u, v);
+	setBoundary2d(2, u, v);
 }
 
-void ciMsaFluidSolver::advectRGB(int bound, const ci::Vec2f* duv) {
+// advect2d and advectRGB / advect in one pass, the backtrace along du, dv is shared by all fields
+template< bool RGB >
+void ciMsaFluidSolver::advectFused( float *u, float *v, const float *du, const float *dv ) {
+	const float dt0x = _dt * _NX;
+	const float dt0y = _dt * _NY;
+	const int numDye = RGB ? 3 : 1;
+	
+	const float minX = _roiI0 - 0.5f, maxX = _roiI1 + 0.5f;
+	const float minY = _roiJ0 - 0.5f, maxY = _roiJ1 + 0.5f;
+	
+	countCells( 2 + numDye );
+	if( _kernels ) {
+		ciMsaFluidAdvectArgs args = { du, dv, 2 + numDye, { u, v, r, g, b }, { du, dv, rOld, gOld, bOld }, dt0x, dt0y,
+									  minX, maxX, minY, maxY, _stride };
+		advectKernels( args );
+	}
+	else {
+		float *dye[] = { r, g, b };
+		const float *dyeOld[] = { rOld, gOld, bOld };
+		for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
+		{
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+			for (int i = spans[2*s+1] - 1; i >= spans[2*s]; --i)
+			{
+				int index = FLUID_IX(i, j);
+				float x = i - dt0x * du[index];
+				float y = j - dt0y * dv[index];
+				
+				if (x > maxX) x = maxX;
+				if (x < minX) x = minX;
+				if (y > maxY) y = maxY;
+				if (y < minY) y = minY;
+				
+				int i0 = (int) x;
+				int j0 = (int) y;
+				float s1 = x - i0;
+				float s0 = 1 - s1;
+				float t1 = y - j0;
+				float t0 = 1 - t1;
+				
+				i0 = FLUID_IX(i0, j0);
+				j0 = i0 + _stride;
+				u[index] = s0 * ( t0 * du[i0] + t1 * du[j0] ) + s1 * ( t0 * du[i0+1] + t1 * du[j0+1] );
+				v[index] = s0 * ( t0 * dv[i0] + t1 * dv[j0] ) + s1 * ( t0 * dv[i0+1] + t1 * dv[j0+1] );
+				for (int k = 0; k < numDye; k++)
+				{
+					const float *d0 = dyeOld[k];
+					dye[k][index] = s0 * ( t0 * d0[i0] + t1 * d0[j0] ) + s1 * ( t0 * d0[i0+1] + t1 * d0[j0+1] );
+				}
+			}
+		}
+	}
+	
+	setBoundary2d(1, u, v);
+	setBoundary2d(2, u, v);
+	if(RGB)
+		setBoundaryRGB();
+	else
+		setBoundary(0, r);
+}
+
+void ciMsaFluidSolver::advectRGB(int bound, const float* du, const float* dv) {
 	int i0, j0;
 	float x, y, s0, t0, s1, t1, dt0x, dt0y;
 	int	index;
@@ -582,21 +2033,35 @@ void ciMsaFluidSolver::advectRGB(int bound, const ci::Vec2f* duv) {
 	dt0x = _dt * _NX;
 	dt0y = _dt * _NY;
 	
-	for (int j = _NY; j > 0; --j)
+	const float minX = _roiI0 - 0.5f, maxX = _roiI1 + 0.5f;
+	const float minY = _roiJ0 - 0.5f, maxY = _roiJ1 + 0.5f;
+	
+	countCells( 3 );
+	if( _kernels ) {
+		ciMsaFluidAdvectArgs args = { du, dv, 3, { r, g, b }, { rOld, gOld, bOld }, dt0x, dt0y, minX, maxX, minY, maxY, _stride };
+		advectKernels( args );
+		setBoundaryRGB();
+		return;
+	}
+	
+	for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
 	{
-		for (int i = _NX; i > 0; --i)
+		int j = _activeRows[row];
+		const int *spans;
+		for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+		for (int i = spans[2*s+1] - 1; i >= spans[2*s]; --i)
 		{
 			index = FLUID_IX(i, j);
-			x = i - dt0x * duv[index].x;
-			y = j - dt0y * duv[index].y;
+			x = i - dt0x * du[index];
+			y = j - dt0y * dv[index];
 			
-			if (x > _NX + 0.5) x = _NX + 0.5f;
-			if (x < 0.5)     x = 0.5f;
+			if (x > maxX) x = maxX;
+			if (x < minX) x = minX;
 			
 			i0 = (int) x;
 			
-			if (y > _NY + 0.5) y = _NY + 0.5f;
-			if (y < 0.5)     y = 0.5f;
+			if (y > maxY) y = maxY;
+			if (y < minY) y = minY;
 			
 			j0 = (int) y;
 			
@@ -606,7 +2071,7 @@ void ciMsaFluidSolver::advectRGB(int bound, const ci::Vec2f* duv) {
 			t0 = 1 - t1;
 			
 			i0 = FLUID_IX(i0, j0);	//we don't need col/row index any more but index in 1 dimension
-			j0 = i0 + (_NX + 2);
+			j0 = i0 + _stride;
 			r[index] = s0 * ( t0 * rOld[i0] + t1 * rOld[j0] ) + s1 * ( t0 * rOld[i0+1] + t1 * rOld[j0+1] );
 			g[index] = s0 * ( t0 * gOld[i0] + t1 * gOld[j0] ) + s1 * ( t0 * gOld[i0+1] + t1 * gOld[j0+1] );                  
 			b[index] = s0 * ( t0 * bOld[i0] + t1 * bOld[j0] ) + s1 * ( t0 * bOld[i0+1] + t1 * bOld[j0+1] );                          
@@ -618,125 +2083,432 @@ void ciMsaFluidSolver::advectRGB(int bound, const ci::Vec2f* duv) {
 void ciMsaFluidSolver::diffuse( int bound, float* c, float* c0, float diff )
 {
 	float a = _dt * diff * _NX * _NY;	//todo find the exact strategy for using _NX and _NY in the factors
+	if( diffusionSolver == FLUID_DIFFUSION_FAST ) {
+		diffuseFast( bound, c, c0, a );
+		return;
+	}
 	linearSolver( bound, c, c0, a, 1.0 + 4 * a );
 }
 
 void ciMsaFluidSolver::diffuseRGB( int bound, float diff )
 {
 	float a = _dt * diff * _NX * _NY;
+	if( diffusionSolver == FLUID_DIFFUSION_FAST ) {
+		diffuseFast( bound, r, rOld, a );
+		diffuseFast( bound, g, gOld, a );
+		diffuseFast( bound, b, bOld, a );
+		return;
+	}
 	linearSolverRGB( a, 1.0 + 4 * a );
 }
 
 void ciMsaFluidSolver::diffuseUV( float diff )
 {
 	float a = _dt * diff * _NX * _NY;
+	if( diffusionSolver == FLUID_DIFFUSION_FAST ) {
+		diffuseFast( 1, u, uOld, a );
+		diffuseFast( 2, v, vOld, a );
+		return;
+	}
 	linearSolverUV( a, 1.0 + 4 * a );
 }
 
-void ciMsaFluidSolver::project(ci::Vec2f* xy, ci::Vec2f* pDiv) 
+void ciMsaFluidSolver::diffuseFast( int bound, float* x, const float* x0, float a )
+{
+	// multigrid knows nothing of the walls of a region, the blur is mirrored at them
+	if( a <= diffusionBlurLimit || hasRegionWalls() ) {
+		countCells( 1 );
+		blurDiffuse( bound, x, x0, a );
+	}
+	else
+		multigridDiffuse( bound, x, x0, a );
+}
+
+// source cell of cell i of an n cell row or column extended by the blur, *sign gets -1 for cells mirrored an odd
+// number of times at a wall of sign -1. mirrored cells match the ghost cells of setBoundary
+static inline int blurSource( int i, int n, bool wrap, float wallSign, float *sign )
+{
+	*sign = 1.0f;
+	if( wrap ) {
+		i = ( i - 1 ) % n;
+		return ( i < 0 ? i + n : i ) + 1;
+	}
+	while( i < 1 || i > n ) {
+		i = ( i < 1 ) ? 1 - i : 2 * n + 1 - i;
+		*sign *= wallSign;
+	}
+	return i;
+}
+
+// taps 0..radius of the discrete gaussian e^-2a * I_n(2a), the 1d kernel of exp(a * laplacian) on the grid.
+// the 2d kernel is its outer product, so diffusing for a is a horizontal and a vertical pass. returns the radius
+int ciMsaFluidSolver::updateBlurWeights( float a )
+{
+	if( a == _blurWeightsA )
+		return (int)_blurWeights.size() - 1;
+	
+	double taps[FLUID_DIFFUSION_MAX_RADIUS + 1];
+	double scale = exp( -2.0 * a );
+	double power = 1;		// a^n / n!
+	double sum = 0;
+	int radius = 0;
+	for( int n = 0; n <= FLUID_DIFFUSION_MAX_RADIUS; n++ ) {
+		// series of I_n(2a) = sum over k of a^(2k + n) / ( k! (k + n)! )
+		double bessel = 0;
+		double term = power;
+		for( int k = 0; k < 64 && term > bessel * 1e-12; k++ ) {
+			bessel += term;
+			term *= (double)a * a / ( ( k + 1 ) * ( k + 1 + n ) );
+		}
+		taps[n] = scale * bessel;
+		sum += n ? 2 * taps[n] : taps[n];
+		radius = n;
+		if( n > 0 && taps[n] < FLUID_DIFFUSION_BLUR_EPSILON )
+			break;
+		power *= a / ( n + 1 );
+	}
+	
+	// the cut kernel is renormalized so the blur keeps the total dye
+	_blurWeights.resize( radius + 1 );
+	for( int n = 0; n <= radius; n++ )
+		_blurWeights[n] = (float)( taps[n] / sum );
+	_blurWeightsA = a;
+	return radius;
+}
+
+// diffuses x0 for a into x with the heat kernel instead of solving the implicit step, the two agree up to O(a^2).
+// the blur is mirrored at the walls of the region of interest like at the ones of the grid
+void ciMsaFluidSolver::blurDiffuse( int bound, float* x, const float* x0, float a )
+{
+	const int radius = updateBlurWeights( a );
+	const float *w = &_blurWeights[0];
+	const float signX = ( bound == 1 ) ? -1.0f : 1.0f;
+	const float signY = ( bound == 2 ) ? -1.0f : 1.0f;
+	const int nx = _roiI1 - _roiI0 + 1, offsetX = _roiI0 - 1;		// the blurred cells, blurSource counts from 1
+	const int ny = _roiJ1 - _roiJ0 + 1, offsetY = _roiJ0 - 1;
+	const bool wrapX = wrapsX(), wrapY = wrapsY();
+	const int lineSize = nx + 2 * radius;
+	_blurLines.resize( getNumThreads() * lineSize );
+	_blurPlane.resize( _planeSize );
+	float *tmp = &_blurPlane[0];
+	
+	// horizontal pass over all region rows, the vertical pass of an active row reads the rows around it
+	_pool->run( _roiJ0, _roiJ1 + 1, [&]( int band, int j0, int j1 ) {
+		float *line = &_blurLines[band * lineSize] + radius - _roiI0;	// line[i] holds cell i, i in [_roiI0 - radius, _roiI1 + radius]
+		for (int j = j0; j < j1; j++)
+		{
+			const float *src = x0 + FLUID_IX(0, j);
+			memcpy( line + _roiI0, src + _roiI0, nx * sizeof(float) );
+			for (int k = 1; k <= radius; k++)
+			{
+				float sign;
+				int i = blurSource( 1 - k, nx, wrapX, signX, &sign ) + offsetX;
+				line[_roiI0 - k] = sign * src[i];
+				i = blurSource( nx + k, nx, wrapX, signX, &sign ) + offsetX;
+				line[_roiI1 + k] = sign * src[i];
+			}
+			
+			float * __restrict dst = tmp + FLUID_IX(0, j);
+			for (int i = _roiI0; i <= _roiI1; i++)
+				dst[i] = w[0] * line[i];
+			for (int k = 1; k <= radius; k++)
+			{
+				const float wk = w[k];
+				for (int i = _roiI0; i <= _roiI1; i++)
+					dst[i] += wk * ( line[i - k] + line[i + k] );
+			}
+		}
+	} );
+	
+	// vertical pass, only the active cells are written
+	_pool->run( 0, (int)_activeRows.size(), [&]( int, int row0, int row1 ) {
+		for (int row = row0; row < row1; row++)
+		{
+			int j = _activeRows[row];
+			const int *spans;
+			int numSpans = getRowSpans( j, &spans );
+			float * __restrict dst = x + FLUID_IX(0, j);
+			const float *center = tmp + FLUID_IX(0, j);
+			for (int s = 0; s < numSpans; s++)
+				for (int i = spans[2*s]; i < spans[2*s+1]; i++)
+					dst[i] = w[0] * center[i];
+			
+			for (int k = 1; k <= radius; k++)
+			{
+				float signUp, signDown;
+				const float *up = tmp + FLUID_IX(0, blurSource( j - offsetY - k, ny, wrapY, signY, &signUp ) + offsetY);
+				const float *down = tmp + FLUID_IX(0, blurSource( j - offsetY + k, ny, wrapY, signY, &signDown ) + offsetY);
+				const float wUp = w[k] * signUp;
+				const float wDown = w[k] * signDown;
+				for (int s = 0; s < numSpans; s++)
+					for (int i = spans[2*s]; i < spans[2*s+1]; i++)
+						dst[i] += wUp * up[i] + wDown * down[i];
+			}
+		}
+	} );
+	
+	setBoundary( bound, x );
+}
+
+// solves the implicit step x + a * ( 4 * x - sum of the neighbours ) = x0 with multigrid V-cycles, starting from x0
+void ciMsaFluidSolver::multigridDiffuse( int bound, float* x, const float* x0, float a )
+{
+	float *mgX = _multigrid.getSolution();
+	float *mgX0 = _multigrid.getRhs();
+	const int rowSize = _NX + 2;
+	for (int j = _NY+1; j >=0; --j)
+	{
+		memcpy( mgX + j * rowSize, x0 + FLUID_IX(0, j), rowSize * sizeof(float) );
+		memcpy( mgX0 + j * rowSize, x0 + FLUID_IX(0, j), rowSize * sizeof(float) );
+	}
+	
+	_multigrid.setWrap( wrap_x, wrap_y );
+	_multigrid.setBoundaryType( bound );
+	countMultigrid( _multigrid.solve( 1.0f, a, solverTolerance, multigridCycles ) );
+	
+	copyActiveCells( x, mgX, rowSize );
+	setBoundary( bound, x );
+}
+
+// the pressure plane of projection 0 (before the advection) or 1 (after it). with warm start it keeps the last solution,
+// otherwise uOld is the scratch plane and the solve starts from zero
+float* ciMsaFluidSolver::projectionPressure(int projection)
+{
+	if( !doWarmStart )
+		return uOld;
+	std::vector< float > &pressure = _pressure[projection];
+	if( pressure.size() != (size_t)_planeSize )
+		pressure.assign( _planeSize, 0.0f );
+	return pressure.data();
+}
+
+// removes the divergence of x, y. div is a scratch plane, p is cleared unless it holds the last pressure for a warm start
+void ciMsaFluidSolver::project(float* x, float* y, float* p, float* div) 
 {
+	const bool clearPressure = !doWarmStart;
 	float	h;
-	int		index;
-	int		step_x = _NX + 2;
+	
+	// the divergence and the gradient pass, the solvers count themselves
+	countCells( 2 );
 	
 	h = - 0.5f / _NX;
-	for (int j = _NY; j > 0; --j)
-	{
-		index = FLUID_IX(_NX, j);
-		for (int i = _NX; i > 0; --i)
+	_pool->run( 0, (int)_activeRows.size(), [&]( int, int row0, int row1 ) {
+		for (int row = row1 - 1; row >= row0; --row)
 		{
-			pDiv[index].x = h * ( xy[index+1].x - xy[index-1].x + xy[index+step_x].y - xy[index-step_x].y );
-			pDiv[index].y = 0;
-			--index;
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+			{
+				int index = FLUID_IX(spans[2*s+1] - 1, j);
+				for (int i = spans[2*s+1] - spans[2*s]; i > 0; --i)
+				{
+					div[index] = h * ( x[index+1] - x[index-1] + y[index+_stride] - y[index-_stride] );
+					if( clearPressure )
+						p[index] = 0;
+					--index;
+				}
+			}
 		}
-	}
+	} );
 	
-	setBoundary02d( reinterpret_cast<ci::Vec2f*>( &pDiv[0].x ));
-	setBoundary02d( reinterpret_cast<ci::Vec2f*>( &pDiv[0].y ));
+	setBoundary(0, div);
+	setBoundary(0, p);
 	
-	linearSolverProject( pDiv );
+	// the full grid solvers know nothing of the walls of a region
+	if( doSpectralProjection && wrapsX() && wrapsY() )
+		linearSolverProjectSpectral( p, div );
+	else if( projectionSolver == FLUID_PROJECTION_MULTIGRID && !hasRegionWalls() )
+		linearSolverProjectMultigrid( p, div );
+	else
+		linearSolverProject( p, div );
 	
 	float fx = 0.5f * _NX;
 	float fy = 0.5f * _NY;	//maa	change it from _NX to _NY
-	for (int j = _NY; j > 0; --j)
-	{
-		index = FLUID_IX(_NX, j);
-		for (int i = _NX; i > 0; --i)
+	_pool->run( 0, (int)_activeRows.size(), [&]( int, int row0, int row1 ) {
+		for (int row = row1 - 1; row >= row0; --row)
 		{
-			xy[index].x -= fx * (pDiv[index+1].x - pDiv[index-1].x);
-			xy[index].y -= fy * (pDiv[index+step_x].x - pDiv[index-step_x].x);
-			--index;
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+			{
+				int index = FLUID_IX(spans[2*s+1] - 1, j);
+				for (int i = spans[2*s+1] - spans[2*s]; i > 0; --i)
+				{
+					x[index] -= fx * (p[index+1] - p[index-1]);
+					y[index] -= fy * (p[index+_stride] - p[index-_stride]);
+					--index;
+				}
+			}
 		}
-	}
+	} );
 	
-	setBoundary2d(1, xy);
-	setBoundary2d(2, xy);
+	setBoundary2d(1, x, y);
+	setBoundary2d(2, x, y);
 }
 
 
 //	Gauss-Seidel relaxation
 void ciMsaFluidSolver::linearSolver( int bound, float* __restrict x, const float* __restrict x0, float a, float c )
 {
-	int	step_x = _NX + 2;
+	int	step_x = _stride;
 	int index;
+	float *planes[] = { x };
+	const float *rhs[] = { x0 };
+	float diag = c;
 	c = 1. / c;
-	for (int k = solverIterations; k > 0; --k)	// MEMO 
+	if( _kernels ) {
+		for (int k = 0; continueSolve( k, planes, rhs, 1, a, diag ); k++)
+		{
+			relaxRedBlack( x, x0, a, c );
+			setBoundary( bound, x );
+		}
+		return;
+	}
+	for (int k = 0; continueSolve( k, planes, rhs, 1, a, diag ); k++)	// MEMO 
 	{
-		for (int j = _NY; j > 0 ; --j)
+		for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
 		{
-			index = FLUID_IX(_NX, j );
-			for (int i = _NX; i > 0 ; --i)
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
 			{
-				x[index] = ( ( x[index-1] + x[index+1] + x[index - step_x] + x[index + step_x] ) * a + x0[index] ) * c;
-				--index;
+				index = FLUID_IX(spans[2*s+1] - 1, j );
+				for (int i = spans[2*s+1] - spans[2*s]; i > 0 ; --i)
+				{
+					x[index] = ( ( x[index-1] + x[index+1] + x[index - step_x] + x[index + step_x] ) * a + x0[index] ) * c;
+					--index;
+				}
 			}
 		}
 		setBoundary( bound, x );
 	}
 }
 
-void ciMsaFluidSolver::linearSolverProject( ci::Vec2f* __restrict pdiv )
+void ciMsaFluidSolver::linearSolverProject( float* __restrict p, const float* __restrict div )
 {
-	int	step_x = _NX + 2;
+	int	step_x = _stride;
 	int index;
-	for (int k = solverIterations; k > 0; --k) {
-		for (int j = _NY; j > 0 ; --j) {
-			index = FLUID_IX(_NX, j );
-			float prev = pdiv[index+1].x;
-			for (int i = _NX; i > 0 ; --i)
-			{
-				prev = ( pdiv[index-1].x + prev + pdiv[index - step_x].x + pdiv[index + step_x].x + pdiv[index].y ) * .25;
-				pdiv[index].x = prev;
-				--index;				
+	float *planes[] = { p };
+	const float *rhs[] = { div };
+	if( _kernels ) {
+		for (int k = 0; continueSolve( k, planes, rhs, 1, 1.0f, 4.0f ); k++) {
+			relaxRedBlack( p, div, 1.0f, 0.25f );
+			setBoundary( 0, p );
+		}
+		return;
+	}
+	for (int k = 0; continueSolve( k, planes, rhs, 1, 1.0f, 4.0f ); k++) {
+		for (int row = (int)_activeRows.size() - 1; row >= 0; --row) {
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s) {
+				index = FLUID_IX(spans[2*s+1] - 1, j );
+				float prev = p[index+1];
+				for (int i = spans[2*s+1] - spans[2*s]; i > 0 ; --i)
+				{
+					prev = ( p[index-1] + prev + p[index - step_x] + p[index + step_x] + div[index] ) * .25;
+					p[index] = prev;
+					--index;				
+				}
 			}
 		}
-		setBoundary02d( reinterpret_cast<ci::Vec2f*>( &pdiv[0].x ) );
+		setBoundary( 0, p );
+	}
+}
+
+// solves the same system as linearSolverProject with multigrid V-cycles
+void ciMsaFluidSolver::linearSolverProjectMultigrid( float* p, const float* div )
+{
+	// the multigrid levels are unpadded, (_NX + 2) floats per row
+	float *mgP = _multigrid.getSolution();
+	float *mgDiv = _multigrid.getRhs();
+	const int rowSize = _NX + 2;
+	for (int j = _NY+1; j >=0; --j)
+	{
+		memcpy( mgP + j * rowSize, p + FLUID_IX(0, j), rowSize * sizeof(float) );
+		memcpy( mgDiv + j * rowSize, div + FLUID_IX(0, j), rowSize * sizeof(float) );
+	}
+	
+	_multigrid.setWrap( wrap_x, wrap_y );
+	_multigrid.setBoundaryType( 0 );
+	countMultigrid( _multigrid.solve( 0.0f, 1.0f, solverTolerance, multigridCycles ) );
+	
+	copyActiveCells( p, mgP, rowSize );
+	setBoundary( 0, p );
+}
+
+// exact solve of the periodic system, only valid when both axes wrap
+void ciMsaFluidSolver::linearSolverProjectSpectral( float* p, const float* div )
+{
+	float *fftP = _spectralSolver.getSolution();
+	float *fftDiv = _spectralSolver.getRhs();
+	const int rowSize = _NX + 2;
+	for (int j = _NY+1; j >=0; --j)
+	{
+		memcpy( fftDiv + j * rowSize, div + FLUID_IX(0, j), rowSize * sizeof(float) );
+	}
+	
+	_spectralSolver.solve( 0.0f, 1.0f );
+	_cellCount += (uint64_t)_NX * _NY;
+	
+	copyActiveCells( p, fftP, rowSize );
+	setBoundary( 0, p );
+}
+
+// copies the active interior cells from an unpadded field with rowSize floats per row,
+// the cells outside the active tiles keep their value
+void ciMsaFluidSolver::copyActiveCells( float* dst, const float* src, int rowSize )
+{
+	for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
+	{
+		int j = _activeRows[row];
+		const int *spans;
+		for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+			memcpy( dst + FLUID_IX(spans[2*s], j), src + j * rowSize + spans[2*s], ( spans[2*s+1] - spans[2*s] ) * sizeof(float) );
 	}
 }
 
 void ciMsaFluidSolver::linearSolverRGB( float a, float c )
 {
 	int index3, index4, index;
-	int	step_x = _NX + 2;
+	int	step_x = _stride;
+	float *planes[] = { r, g, b };
+	const float *rhs[] = { rOld, gOld, bOld };
+	float diag = c;
 	c = 1. / c;
-	for ( int k = solverIterations; k > 0; --k )	// MEMO
+	if( _kernels ) {
+		for (int k = 0; continueSolve( k, planes, rhs, 3, a, diag ); k++)
+		{
+			relaxRedBlack( r, rOld, a, c );
+			relaxRedBlack( g, gOld, a, c );
+			relaxRedBlack( b, bOld, a, c );
+			setBoundaryRGB();
+		}
+		return;
+	}
+	for ( int k = 0; continueSolve( k, planes, rhs, 3, a, diag ); k++ )	// MEMO
 	{           
-		for (int j = _NY; j > 0 ; --j)
-		{
-			index = FLUID_IX(_NX, j );
-			//index1 = index - 1;		//FLUID_IX(i-1, j);
-			//index2 = index + 1;		//FLUID_IX(i+1, j);
-			index3 = index - step_x;	//FLUID_IX(i, j-1);
-			index4 = index + step_x;	//FLUID_IX(i, j+1);
-			for (int i = _NX; i > 0 ; --i)
-			{	
-				r[index] = ( ( r[index-1] + r[index+1]  +  r[index3] + r[index4] ) * a  +  rOld[index] ) * c;
-				g[index] = ( ( g[index-1] + g[index+1]  +  g[index3] + g[index4] ) * a  +  gOld[index] ) * c;
-				b[index] = ( ( b[index-1] + b[index+1]  +  b[index3] + b[index4] ) * a  +  bOld[index] ) * c;                                
-				//				x[FLUID_IX(i, j)] = (a * ( x[FLUID_IX(i-1, j)] + x[FLUID_IX(i+1, j)]  +  x[FLUID_IX(i, j-1)] + x[FLUID_IX(i, j+1)])  +  x0[FLUID_IX(i, j)]) / c;
-				--index;
-				--index3;
-				--index4;
+		for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
+		{
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+			{
+				index = FLUID_IX(spans[2*s+1] - 1, j );
+				//index1 = index - 1;		//FLUID_IX(i-1, j);
+				//index2 = index + 1;		//FLUID_IX(i+1, j);
+				index3 = index - step_x;	//FLUID_IX(i, j-1);
+				index4 = index + step_x;	//FLUID_IX(i, j+1);
+				for (int i = spans[2*s+1] - spans[2*s]; i > 0 ; --i)
+				{	
+					r[index] = ( ( r[index-1] + r[index+1]  +  r[index3] + r[index4] ) * a  +  rOld[index] ) * c;
+					g[index] = ( ( g[index-1] + g[index+1]  +  g[index3] + g[index4] ) * a  +  gOld[index] ) * c;
+					b[index] = ( ( b[index-1] + b[index+1]  +  b[index3] + b[index4] ) * a  +  bOld[index] ) * c;                                
+					//				x[FLUID_IX(i, j)] = (a * ( x[FLUID_IX(i-1, j)] + x[FLUID_IX(i+1, j)]  +  x[FLUID_IX(i, j-1)] + x[FLUID_IX(i, j+1)])  +  x0[FLUID_IX(i, j)]) / c;
+					--index;
+					--index3;
+					--index4;
+				}
 			}
 		}
 		setBoundaryRGB();	
@@ -746,33 +2518,141 @@ void ciMsaFluidSolver::linearSolverRGB( float a, float c )
 void ciMsaFluidSolver::linearSolverUV( float a, float c )
 {
 	int index;
-	int	step_x = _NX + 2;
+	int	step_x = _stride;
+	float *planes[] = { u, v };
+	const float *rhs[] = { uOld, vOld };
+	float diag = c;
 	c = 1. / c;
-	ci::Vec2f* __restrict localUV = uv;
-	const ci::Vec2f* __restrict localOldUV = uvOld;
+	float* __restrict localU = u;
+	float* __restrict localV = v;
+	const float* __restrict localOldU = uOld;
+	const float* __restrict localOldV = vOld;
+
+	if( _kernels ) {
+		for (int k = 0; continueSolve( k, planes, rhs, 2, a, diag ); k++)
+		{
+			relaxRedBlack( u, uOld, a, c );
+			relaxRedBlack( v, vOld, a, c );
+			setBoundary2d( 1, u, v );
+		}
+		return;
+	}
 
-	for (int k = solverIterations; k > 0; --k)	// MEMO
+	for (int k = 0; continueSolve( k, planes, rhs, 2, a, diag ); k++)	// MEMO
 	{           
-		for (int j = _NY; j > 0 ; --j)
+		for (int row = (int)_activeRows.size() - 1; row >= 0; --row)
+		{
+			int j = _activeRows[row];
+			const int *spans;
+			for (int s = getRowSpans(j, &spans) - 1; s >= 0; --s)
+			{
+				index = FLUID_IX(spans[2*s+1] - 1, j );
+				float prevU = localU[index+1];
+				float prevV = localV[index+1];
+				for (int i = spans[2*s+1] - spans[2*s]; i > 0 ; --i)
+				{
+					prevU = ( ( localU[index-1] + prevU + localU[index - step_x] + localU[index + step_x] ) * a  + localOldU[index] ) * c;
+					prevV = ( ( localV[index-1] + prevV + localV[index - step_x] + localV[index + step_x] ) * a  + localOldV[index] ) * c;
+					localU[index] = prevU;
+					localV[index] = prevV;
+					--index;
+				}
+			}
+		}
+		setBoundary2d( 1, u, v );
+	}
+}
+
+// called before every sweep of a linear solve with the number of sweeps done so far, returns whether to sweep again.
+// x are the numPlanes solved planes and x0 their right hand sides of diag * x = a * ( sum of the neighbours ) + x0
+bool ciMsaFluidSolver::continueSolve( int k, float **x, const float **x0, int numPlanes, float a, float diag )
+{
+	if( !doAdaptiveIterations ) {
+		if( k < solverIterations )
+			return true;
+		_frameIterations += k;
+		countSweeps( k, numPlanes );
+		return false;
+	}
+	
+	if( k < minIterations )
+		return true;
+	bool last = k >= maxIterations;
+	if( !last && ( k - minIterations ) % FLUID_RESIDUAL_CHECK_INTERVAL != 0 )
+		return true;
+	
+	float residual = calcResidual( x, x0, numPlanes, a, diag );
+	if( !last && residual > targetResidual )
+		return true;
+	
+	_frameIterations += k;
+	_frameResidual = ci::math<float>::max( _frameResidual, residual );
+	countSweeps( k, numPlanes );
+	return false;
+}
+
+// relative rms residual ||x0 + a * ( sum of the neighbours ) - diag * x|| / ||x0|| over the active cells of the planes
+float ciMsaFluidSolver::calcResidual( float **x, const float **x0, int numPlanes, float a, float diag )
+{
+	double sums[2];
+	sumRows( 0, (int)_activeRows.size(), 2, sums, [&]( int row, double *rowSums ) {
+		int j = _activeRows[row];
+		const int *spans;
+		int numSpans = getRowSpans( j, &spans );
+		for (int k = 0; k < numPlanes; k++)
+		for (int s = 0; s < numSpans; s++)
 		{
-			index = FLUID_IX(_NX, j );
-			float prevU = localUV[index+1].x;
-			float prevV = localUV[index+1].y;
-			for (int i = _NX; i > 0 ; --i)
+			if( _kernels ) {
+				_kernels->residualRow( x[k], x0[k], FLUID_IX(spans[2*s], j), spans[2*s+1] - spans[2*s], _stride,
+									  a, diag, &rowSums[0], &rowSums[1] );
+				continue;
+			}
+			for (int index = FLUID_IX(spans[2*s], j); index < FLUID_IX(spans[2*s+1], j); index++)
 			{
-				prevU = ( ( localUV[index-1].x + prevU + localUV[index - step_x].x + localUV[index + step_x].x ) * a  + localOldUV[index].x ) * c;
-				prevV = ( ( localUV[index-1].y + prevV + localUV[index - step_x].y + localUV[index + step_x].y ) * a  + localOldUV[index].y ) * c;
-				localUV[index].x = prevU;
-				localUV[index].y = prevV;
-				--index;
+				const float *p = x[k];
+				float r = x0[k][index] + ( p[index-1] + p[index+1] + p[index-_stride] + p[index+_stride] ) * a - diag * p[index];
+				rowSums[0] += r * r;
+				rowSums[1] += x0[k][index] * x0[k][index];
 			}
 		}
-		setBoundary2d( 1, uv );
+	} );
+	double sumResidual2 = sums[0], sumRhs2 = sums[1];
+	return (float)( sumRhs2 > 0 ? sqrt( sumResidual2 / sumRhs2 ) : sqrt( sumResidual2 ) );
+}
+
+// one red-black sweep of the vectorized relaxation over the interior, first the cells with (i + j) even, then the odd ones
+void ciMsaFluidSolver::relaxRedBlack( float* x, const float* x0, float a, float c )
+{
+	const unsigned int allBits = 0xffffffff;
+	float on;
+	memcpy( &on, &allBits, sizeof( on ) );
+	
+	for (int color = 0; color < 2; color++)
+	{
+		// lane masks for rows starting with an even or an odd cell
+		float mask[2][FLUID_SIMD_MAX_WIDTH];
+		for (int parity = 0; parity < 2; parity++)
+		{
+			for (int k = 0; k < FLUID_SIMD_MAX_WIDTH; k++)
+				mask[parity][k] = ( ( parity + k ) & 1 ) == color ? on : 0.0f;
+		}
+		_pool->run( 0, (int)_activeRows.size(), [&]( int, int row0, int row1 ) {
+			for (int row = row0; row < row1; row++)
+			{
+				int j = _activeRows[row];
+				const int *spans;
+				int numSpans = getRowSpans( j, &spans );
+				for (int s = 0; s < numSpans; s++)
+					_kernels->relaxRow( x, x0, FLUID_IX(spans[2*s], j), spans[2*s+1] - spans[2*s], _stride, a, c,
+									   mask[(spans[2*s] + j) & 1] );
+			}
+		} );
 	}
 }
 
 // specifies simple boundry conditions.
-void ciMsaFluidSolver::setBoundary(int bound, float* x)
+template< bool WRAP_X, bool WRAP_Y >
+void ciMsaFluidSolver::setBoundaryT(int bound, float* x)
 {
 	int dst1, dst2, src1, src2;
 	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
@@ -781,9 +2661,9 @@ void ciMsaFluidSolver::setBoundary(int bound, float* x)
 	src1 = FLUID_IX(1, 1);
 	dst2 = FLUID_IX(_NX+1, 1 );
 	src2 = FLUID_IX(_NX, 1);
-	if( wrap_x )
+	if( WRAP_X )
 		SWAP( src1, src2 );
-	if( bound == 1 && !wrap_x )
+	if( bound == 1 && !WRAP_X )
 		for (int i = _NY; i > 0; --i )
 		{
 			x[dst1] = -x[src1];	dst1 += step;	src1 += step;	
@@ -800,9 +2680,9 @@ void ciMsaFluidSolver::setBoundary(int bound, float* x)
 	src1 = FLUID_IX(1, 1);
 	dst2 = FLUID_IX(1, _NY+1);
 	src2 = FLUID_IX(1, _NY);
-	if( wrap_y )
+	if( WRAP_Y )
 		SWAP( src1, src2 );
-	if( bound == 2 && !wrap_y )
+	if( bound == 2 && !WRAP_Y )
 		for (int i = _NX; i > 0; --i )
 		{
 			x[dst1++] = -x[src1++];	
@@ -821,42 +2701,8 @@ void ciMsaFluidSolver::setBoundary(int bound, float* x)
 	x[FLUID_IX(_NX+1, _NY+1)] = 0.5f * (x[FLUID_IX(_NX, _NY+1)] + x[FLUID_IX(_NX+1, _NY)]);
 }
 
-void ciMsaFluidSolver::setBoundary02d(ci::Vec2f* x)
-{
-	int dst1, dst2, src1, src2;
-	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
-
-	dst1 = FLUID_IX(0, 1);
-	src1 = FLUID_IX(1, 1);
-	dst2 = FLUID_IX(_NX+1, 1 );
-	src2 = FLUID_IX(_NX, 1);
-	if( wrap_x )
-		SWAP( src1, src2 );
-	for (int i = _NY; i > 0; --i )
-	{
-		x[dst1].x = x[src1].x;	dst1 += step;	src1 += step;	
-		x[dst2].x = x[src2].x;	dst2 += step;	src2 += step;	
-	}
-
-	dst1 = FLUID_IX(1, 0);
-	src1 = FLUID_IX(1, 1);
-	dst2 = FLUID_IX(1, _NY+1);
-	src2 = FLUID_IX(1, _NY);
-	if( wrap_y )
-		SWAP( src1, src2 );
-	for (int i = _NX; i > 0; --i )
-	{
-		x[dst1++] = x[src1++];
-		x[dst2++] = x[src2++];	
-	}
-	
-	x[FLUID_IX(  0,   0)].x = 0.5f * (x[FLUID_IX(1, 0  )].x + x[FLUID_IX(  0, 1)].x);
-	x[FLUID_IX(  0, _NY+1)].x = 0.5f * (x[FLUID_IX(1, _NY+1)].x + x[FLUID_IX(  0, _NY)].x);
-	x[FLUID_IX(_NX+1,   0)].x = 0.5f * (x[FLUID_IX(_NX, 0  )].x + x[FLUID_IX(_NX+1, 1)].x);
-	x[FLUID_IX(_NX+1, _NY+1)].x = 0.5f * (x[FLUID_IX(_NX, _NY+1)].x + x[FLUID_IX(_NX+1, _NY)].x);
-}
-
-void ciMsaFluidSolver::setBoundary2d( int bound, ci::Vec2f *xy )
+template< bool WRAP_X, bool WRAP_Y >
+void ciMsaFluidSolver::setBoundary2dT( int bound, float *u, float *v )
 {
 	int dst1, dst2, src1, src2;
 	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
@@ -865,51 +2711,53 @@ void ciMsaFluidSolver::setBoundary2d( int bound, ci::Vec2f *xy )
 	src1 = FLUID_IX(1, 1);
 	dst2 = FLUID_IX(_NX+1, 1 );
 	src2 = FLUID_IX(_NX, 1);
-	if( wrap_x )
+	if( WRAP_X )
 		SWAP( src1, src2 );
-	if( bound == 1 && !wrap_x )
+	if( bound == 1 && !WRAP_X )
 		for (int i = _NY; i > 0; --i )
 		{
-			xy[dst1].x = -xy[src1].x;	dst1 += step;	src1 += step;	
-			xy[dst2].x = -xy[src2].x;	dst2 += step;	src2 += step;	
+			u[dst1] = -u[src1];	dst1 += step;	src1 += step;	
+			u[dst2] = -u[src2];	dst2 += step;	src2 += step;	
 		}
 	else
 		for (int i = _NY; i > 0; --i )
 		{
-			xy[dst1].x = xy[src1].x;	dst1 += step;	src1 += step;	
-			xy[dst2].x = xy[src2].x;	dst2 += step;	src2 += step;	
+			u[dst1] = u[src1];	dst1 += step;	src1 += step;	
+			u[dst2] = u[src2];	dst2 += step;	src2 += step;	
 		}
 
 	dst1 = FLUID_IX(1, 0);
 	src1 = FLUID_IX(1, 1);
 	dst2 = FLUID_IX(1, _NY+1);
 	src2 = FLUID_IX(1, _NY);
-	if( wrap_y )
+	if( WRAP_Y )
 		SWAP( src1, src2 );
-	if( bound == 2 && !wrap_y )
+	if( bound == 2 && !WRAP_Y )
 		for (int i = _NX; i > 0; --i )
 		{
-			xy[dst1++].y = -xy[src1++].y;	
-			xy[dst2++].y = -xy[src2++].y;	
+			v[dst1++] = -v[src1++];	
+			v[dst2++] = -v[src2++];	
 		}
 	else
 		for (int i = _NX; i > 0; --i )
 		{
-			xy[dst1++].y = xy[src1++].y;
-			xy[dst2++].y = xy[src2++].y;	
+			v[dst1++] = v[src1++];
+			v[dst2++] = v[src2++];	
 		}
 	
-	xy[FLUID_IX(  0,   0)][bound-1] = 0.5f * (xy[FLUID_IX(1, 0  )][bound-1] + xy[FLUID_IX(  0, 1)][bound-1]);
-	xy[FLUID_IX(  0, _NY+1)][bound-1] = 0.5f * (xy[FLUID_IX(1, _NY+1)][bound-1] + xy[FLUID_IX(  0, _NY)][bound-1]);
-	xy[FLUID_IX(_NX+1,   0)][bound-1] = 0.5f * (xy[FLUID_IX(_NX, 0  )][bound-1] + xy[FLUID_IX(_NX+1, 1)][bound-1]);
-	xy[FLUID_IX(_NX+1, _NY+1)][bound-1] = 0.5f * (xy[FLUID_IX(_NX, _NY+1)][bound-1] + xy[FLUID_IX(_NX+1, _NY)][bound-1]);
+	float *x = ( bound == 1 ) ? u : v;
+	x[FLUID_IX(  0,   0)] = 0.5f * (x[FLUID_IX(1, 0  )] + x[FLUID_IX(  0, 1)]);
+	x[FLUID_IX(  0, _NY+1)] = 0.5f * (x[FLUID_IX(1, _NY+1)] + x[FLUID_IX(  0, _NY)]);
+	x[FLUID_IX(_NX+1,   0)] = 0.5f * (x[FLUID_IX(_NX, 0  )] + x[FLUID_IX(_NX+1, 1)]);
+	x[FLUID_IX(_NX+1, _NY+1)] = 0.5f * (x[FLUID_IX(_NX, _NY+1)] + x[FLUID_IX(_NX+1, _NY)]);
 }
 
 #define CPY_RGB( d, s )		{	r[d] = r[s];	g[d] = g[s];	b[d] = b[s]; }
 #define CPY_RGB_NEG( d, s )	{	r[d] = -r[s];	g[d] = -g[s];	b[d] = -b[s]; }
 
 // specifies simple boundry conditions.
-void ciMsaFluidSolver::setBoundaryRGB()
+template< bool WRAP_X, bool WRAP_Y >
+void ciMsaFluidSolver::setBoundaryRGBT()
 {
 	int dst1, dst2, src1, src2;
 	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
@@ -918,7 +2766,7 @@ void ciMsaFluidSolver::setBoundaryRGB()
 	src1 = FLUID_IX(1, 1);
 	dst2 = FLUID_IX(_NX+1, 1 );
 	src2 = FLUID_IX(_NX, 1);
-	if( wrap_x )
+	if( WRAP_X )
 		SWAP( src1, src2 );
 		for (int i = _NY; i > 0; --i )
 		{
@@ -930,7 +2778,7 @@ void ciMsaFluidSolver::setBoundaryRGB()
 	src1 = FLUID_IX(1, 1);
 	dst2 = FLUID_IX(1, _NY+1);
 	src2 = FLUID_IX(1, _NY);
-	if( wrap_y )
+	if( WRAP_Y )
 		SWAP( src1, src2 );
 		for (int i = _NX; i > 0; --i )
 		{
@@ -945,7 +2793,57 @@ void ciMsaFluidSolver::setBoundaryRGB()
 	
 }
 
+// the walls of the region of interest follow the boundary of the grid
+void ciMsaFluidSolver::setBoundary(int bound, float* x) {
+	(this->*_setBoundary)(bound, x);
+	if( hasRegionWalls() )
+		setRegionBoundary( bound, x );
+}
+
+void ciMsaFluidSolver::setBoundary2d( int bound, float *u, float *v ) {
+	(this->*_setBoundary2d)(bound, u, v);
+	if( hasRegionWalls() ) {
+		setRegionBoundary( 1, u );
+		setRegionBoundary( 2, v );
+	}
+}
+
+void ciMsaFluidSolver::setBoundaryRGB() {
+	(this->*_setBoundaryRGB)();
+	if( hasRegionWalls() ) {
+		setRegionBoundary( 0, r );
+		setRegionBoundary( 0, g );
+		setRegionBoundary( 0, b );
+	}
+}
+
+#define FLUID_SELECT_WRAP( fn )	( wrapsX() ? ( wrapsY() ? &ciMsaFluidSolver::fn< true, true > : &ciMsaFluidSolver::fn< true, false > ) \
+										   : ( wrapsY() ? &ciMsaFluidSolver::fn< false, true > : &ciMsaFluidSolver::fn< false, false > ) )
+
+void ciMsaFluidSolver::selectSpecializations() {
+	_setBoundary = FLUID_SELECT_WRAP( setBoundaryT );
+	_setBoundary2d = FLUID_SELECT_WRAP( setBoundary2dT );
+	_setBoundaryRGB = FLUID_SELECT_WRAP( setBoundaryRGBT );
+	
+	if( _kernels )
+		_fadeDye = doRGB ? &ciMsaFluidSolver::fadeRGB : &ciMsaFluidSolver::fadeR;
+	else if( !flushesPerElement() )
+		_fadeDye = doRGB ? &ciMsaFluidSolver::fadeScalar< true, false > : &ciMsaFluidSolver::fadeScalar< false, false >;
+	else
+		_fadeDye = doRGB ? &ciMsaFluidSolver::fadeScalar< true, true > : &ciMsaFluidSolver::fadeScalar< false, true >;
+	
+	if( doRGB )
+		_step = doVorticityConfinement ? &ciMsaFluidSolver::stepT< true, true > : &ciMsaFluidSolver::stepT< true, false >;
+	else
+		_step = doVorticityConfinement ? &ciMsaFluidSolver::stepT< false, true > : &ciMsaFluidSolver::stepT< false, false >;
+	_stepDye = doRGB ? &ciMsaFluidSolver::stepDyeT< true > : &ciMsaFluidSolver::stepDyeT< false >;
+}
+
 void ciMsaFluidSolver::randomizeColor() {
+	if( _dyeSolver ) {
+		_dyeSolver->randomizeColor();
+		return;
+	}
 	for (int i = getWidth()-1; i > 0; --i)
 	{
 		for (int j = getHeight()-1; j > 0; --j)
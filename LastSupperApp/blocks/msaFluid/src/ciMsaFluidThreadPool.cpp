@@ -0,0 +1,142 @@
+/***********************************************************************
+
+ Worker pool for the parallel stages of ciMsaFluidSolver
+
+ ***********************************************************************/
+
+#include <algorithm>
+
+#include "ciMsaFluidDenormalGuard.h"
+#include "ciMsaFluidThreadPool.h"
+
+ciMsaFluidThreadPool::ciMsaFluidThreadPool()
+:_numThreads(1)
+,_parallel(true)
+,_task(NULL)
+,_begin(0)
+,_end(0)
+,_numBands(0)
+,_flushDenormals(false)
+{
+	_generation = 0;
+	_pending = 0;
+	_sleeping = 0;
+	_stop = false;
+}
+
+ciMsaFluidThreadPool::~ciMsaFluidThreadPool()
+{
+	stopWorkers();
+}
+
+int ciMsaFluidThreadPool::getHardwareConcurrency()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return std::min( std::max( n, 1 ), FLUID_MAX_THREADS );
+}
+
+void ciMsaFluidThreadPool::setNumThreads( int numThreads )
+{
+	numThreads = std::min( std::max( numThreads, 1 ), FLUID_MAX_THREADS );
+	if ( numThreads == _numThreads )
+		return;
+
+	stopWorkers();
+
+	_numThreads = numThreads;
+	_stop = false;
+	for ( int i = 1; i < _numThreads; i++ )
+		_workers.push_back( std::shared_ptr< std::thread >(
+					new std::thread( std::bind( &ciMsaFluidThreadPool::workerLoop, this, i, _generation.load() ) ) ) );
+}
+
+void ciMsaFluidThreadPool::stopWorkers()
+{
+	if ( _workers.empty() )
+		return;
+
+	_stop = true;
+	_generation++;
+	{
+		std::lock_guard< std::mutex > lock( _mutex );
+		_wake.notify_all();
+	}
+	for ( size_t i = 0; i < _workers.size(); i++ )
+		_workers[i]->join();
+	_workers.clear();
+	_numThreads = 1;
+}
+
+int ciMsaFluidThreadPool::run( int begin, int end, const Task &task )
+{
+	int numBands = isParallel() ? std::min( _numThreads, end - begin ) : 1;
+	if ( numBands <= 1 )
+	{
+		task( 0, begin, end );
+		return 1;
+	}
+
+	_task = &task;
+	_begin = begin;
+	_end = end;
+	_numBands = numBands;
+	_flushDenormals = ciMsaFluidDenormalGuard::isActive();
+
+	// every worker acknowledges the job, even the ones without a band,
+	// so the job fields are not overwritten while a worker still reads them
+	_pending = _numThreads - 1;
+	_generation++;
+	if ( _sleeping > 0 )
+	{
+		std::lock_guard< std::mutex > lock( _mutex );
+		_wake.notify_all();
+	}
+
+	runBand( 0 );
+
+	while ( _pending > 0 )
+		std::this_thread::yield();
+
+	return numBands;
+}
+
+void ciMsaFluidThreadPool::runBand( int band )
+{
+	int length = _end - _begin;
+	int bandBegin = _begin + ( length * band ) / _numBands;
+	int bandEnd = _begin + ( length * ( band + 1 ) ) / _numBands;
+	(*_task)( band, bandBegin, bandEnd );
+}
+
+void ciMsaFluidThreadPool::workerLoop( int band, int generation )
+{
+	for ( ;; )
+	{
+		int spins = 0;
+		while ( _generation == generation )
+		{
+			if ( ++spins < FLUID_THREAD_SPIN_COUNT )
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			std::unique_lock< std::mutex > lock( _mutex );
+			_sleeping++;
+			while ( _generation == generation )
+				_wake.wait( lock );
+			_sleeping--;
+		}
+		generation = _generation;
+
+		if ( _stop )
+			return;
+
+		if ( band < _numBands )
+		{
+			ciMsaFluidDenormalGuard denormalGuard( _flushDenormals );
+			runBand( band );
+		}
+		_pending--;
+	}
+}
@@ -0,0 +1,77 @@
+/***********************************************************************
+
+ Times the fade of a decaying fluid with and without flushing denormals
+
+ A 320x240 RGB field gets one burst of forces and colors and then decays
+ for FLUID_BENCH_FRAMES frames on one thread, long enough for the faded
+ dye and velocity to reach the denormal range. The average fade stage time
+ and the average update are reported for every SIMD level the cpu supports,
+ with the FTZ/DAZ mode (ciMsaFluidDenormalGuard) on and off.
+
+ usage: FluidDenormalBench [frames]
+
+ ***********************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "cinder/Timer.h"
+
+#include "ciMsaFluidDenormalGuard.h"
+#include "ciMsaFluidKernels.h"
+#include "ciMsaFluidSolver.h"
+
+#define FLUID_BENCH_FRAMES		400
+
+// getStageTime() is smoothed over the frames, the bench reads the unsmoothed time of the last frame
+class BenchSolver : public ciMsaFluidSolver {
+public:
+	double	getLastStageSeconds( int stage ) const	{ return _stageFrameTimes[stage]; }
+};
+
+static void runBench( int simdLevel, bool flushDenormals, int frames )
+{
+	BenchSolver solver;
+	solver.setup( 320, 240 );
+	solver.enableRGB( true );
+	solver.setSimdLevel( simdLevel );
+	solver.enableFlushDenormals( flushDenormals );
+	solver.setNumThreads( 1 );
+	solver.setFadeSpeed( 0.2f );
+	solver.setDeltaT( 0.4f );
+	solver.enableStageTimers( true );
+
+	for ( int k = 0; k < 4000; k++ )
+	{
+		float x = ( k % 63 ) / 63.0f;
+		float y = ( k * 7 % 59 ) / 59.0f;
+		solver.addForceAtPos( ci::Vec2f( x, y ), ci::Vec2f( 0.01f, 0.02f ) );
+		solver.addColorAtPos( x, y, 1, 1, 1 );
+	}
+
+	double fadeSeconds = 0;
+	ci::Timer timer( true );
+	for ( int frame = 0; frame < frames; frame++ )
+	{
+		solver.update();
+		fadeSeconds += solver.getLastStageSeconds( FLUID_STAGE_FADE );
+	}
+	double seconds = timer.getSeconds();
+
+	printf( "%-5s flush %-3s  update %7.3f ms  fade %6.3f ms\n", simdLevel == FLUID_SIMD_AVX2 ? "AVX2" : simdLevel == FLUID_SIMD_SSE2 ? "SSE2" : "off",
+			flushDenormals ? "on" : "off", seconds * 1000.0 / frames, fadeSeconds * 1000.0 / frames );
+}
+
+int main( int argc, char *argv[] )
+{
+	int frames = argc > 1 ? atoi( argv[1] ) : FLUID_BENCH_FRAMES;
+	if ( !ciMsaFluidDenormalGuard::isSupported() )
+		printf( "FTZ/DAZ is not supported, the fade flushes per element in both modes\n" );
+
+	for ( int simdLevel = FLUID_SIMD_NONE; simdLevel <= ciMsaFluidKernels::detectSimdLevel(); simdLevel++ )
+	{
+		runBench( simdLevel, false, frames );
+		runBench( simdLevel, true, frames );
+	}
+	return 0;
+}
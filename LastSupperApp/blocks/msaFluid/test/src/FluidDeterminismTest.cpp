@@ -0,0 +1,120 @@
+/***********************************************************************
+
+ Checks that the solver gives the same fields on 1, 2, 4 and 8 threads
+
+ Runs ciMsaFluidDeterminismCheck for a set of solver configurations in the
+ deterministic mode and exits with 1 if the hashes of any of them differ.
+ The same configurations run once more without the mode, those results are
+ reported but do not fail the test.
+
+ Without the mode the band reductions (the statistics and the residual the
+ adaptive iterations stop on) keep one double partial sum per thread band,
+ so their grouping depends on the thread count. The summands are float row
+ sums, which only move the last bits of the double sums, and the float
+ results have agreed in every configuration here so far. The deterministic
+ mode adds the rows in the same order for any thread count, so the result
+ does not depend on that margin.
+
+ usage: FluidDeterminismTest [width height]
+
+ ***********************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+#include "ciMsaFluidDeterminismCheck.h"
+#include "ciMsaFluidKernels.h"
+#include "ciMsaFluidSolver.h"
+
+struct Configuration {
+	const char	*name;
+	std::function< void ( ciMsaFluidSolver & ) >	configure;
+};
+
+static void configureDefault( ciMsaFluidSolver &solver )
+{
+	solver.enableRGB( true );
+	solver.enableVorticityConfinement( true );
+	solver.setWrap( true, true );
+}
+
+static void configureAdaptive( ciMsaFluidSolver &solver )
+{
+	configureDefault( solver );
+	solver.enableAdaptiveIterations( true );
+	solver.setStatisticsInterval( 1 );
+}
+
+static void configureActiveTiles( ciMsaFluidSolver &solver )
+{
+	configureAdaptive( solver );
+	solver.enableActiveTiles( true );
+}
+
+static void configureMultigrid( ciMsaFluidSolver &solver )
+{
+	configureAdaptive( solver );
+	solver.setProjectionSolver( FLUID_PROJECTION_MULTIGRID );
+	solver.enableSpectralProjection( false );
+	solver.enableWarmStart( true );
+}
+
+static void configureDyeScale( ciMsaFluidSolver &solver )
+{
+	configureAdaptive( solver );
+	solver.setDiffusionSolver( FLUID_DIFFUSION_FAST );
+	solver.setColorDiffusion( 0.0001f );
+	solver.setDyeScale( 2 );
+}
+
+static void configureScalar( ciMsaFluidSolver &solver )
+{
+	configureAdaptive( solver );
+	solver.setSimdLevel( FLUID_SIMD_NONE );
+}
+
+static void configureRegion( ciMsaFluidSolver &solver )
+{
+	configureAdaptive( solver );
+	solver.enableRegionOfInterest( true );
+	solver.setRegionOfInterest( ci::Rectf( 0.2f, 0.1f, 0.7f, 0.9f ) );
+}
+
+int main( int argc, char *argv[] )
+{
+	int NX = argc > 2 ? atoi( argv[1] ) : 160;
+	int NY = argc > 2 ? atoi( argv[2] ) : 120;
+
+	const Configuration configurations[] = {
+		{ "default", configureDefault },
+		{ "adaptive iterations", configureAdaptive },
+		{ "active tiles", configureActiveTiles },
+		{ "multigrid, warm start", configureMultigrid },
+		{ "fast diffusion, dye scale 2", configureDyeScale },
+		{ "scalar", configureScalar },
+		{ "region of interest", configureRegion }
+	};
+	const int numConfigurations = sizeof( configurations ) / sizeof( configurations[0] );
+
+	ciMsaFluidDeterminismCheck check;
+	int numFailed = 0;
+	for ( int k = 0; k < numConfigurations; k++ )
+	{
+		check.enableDeterministic( false );
+		bool agreed = check.run( NX, NY, configurations[k].configure );
+		check.enableDeterministic( true );
+		bool passed = check.run( NX, NY, configurations[k].configure );
+		printf( "%-28s deterministic %s, without the mode %s\n", configurations[k].name,
+				passed ? "ok" : "FAILED", agreed ? "equal" : "different" );
+		if ( passed )
+			continue;
+
+		for ( int i = 0; i < check.getNumRuns(); i++ )
+			printf( "    threads %d hash %016llx\n", check.getThreadCount( i ), (unsigned long long)check.getHash( i ) );
+		numFailed++;
+	}
+
+	printf( "%d of %d configurations differ between thread counts\n", numFailed, numConfigurations );
+	return numFailed > 0 ? 1 : 0;
+}
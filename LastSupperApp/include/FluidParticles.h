@@ -1,8 +1,11 @@
 #pragma once
 
+#include <string>
+
 #include "cinder/Vector.h"
 #include "cinder/Color.h"
 
+#include "ciMsaFluidSnapshot.h"
 #include "ciMsaFluidSolver.h"
 
 class FluidParticle
@@ -11,8 +14,10 @@ class FluidParticle
 		FluidParticle();
 		FluidParticle( const ci::Vec2f &pos );
 
-		void update( double time, const ciMsaFluidSolver *solver, const ci::Vec2f &windowSize, const ci::Vec2f &invWindowSize, float *positions, float *colors );
+		// fluidVel is the fluid velocity at the position of the particle
+		void update( double time, const ci::Vec2f &fluidVel, const ci::Vec2f &windowSize, float *positions, float *colors );
 		bool isAlive() { return mLifeSpan > 0; }
+		const ci::Vec2f &getPos() const { return mPos; }
 
 	private:
 		ci::Vec2f mPos;
@@ -34,12 +39,21 @@ class FluidParticleManager
 
 		void setWindowSize( ci::Vec2i winSize );
 		void setFluidSolver( const ciMsaFluidSolver *aSolver ) { mSolver = aSolver; }
+		//! While set the particles follow the snapshot instead of the solver.
+		void setFluidSnapshot( const ciMsaFluidSnapshot *aSnapshot ) { mSnapshot = aSnapshot; }
 
-		void update( double seconds );
+		//! With flushDenormals the update runs in the FTZ/DAZ mode like the solver.
+		void update( double seconds, bool flushDenormals );
 		void draw();
 
 		void addParticle( const ci::Vec2f &pos, int count = 1 );
 
+		//! Writes the live particles to a binary file, returns false if it could not be written.
+		bool saveState( const std::string &path ) const;
+		//! Replaces the particles with the ones of a file written by saveState() for the same window size, reading it
+		//! through a memory mapping. Returns false if the file is missing or does not match.
+		bool loadState( const std::string &path );
+
 		static float getAging() { return sAging; }
 		static void setAging( float a ) { sAging = a; }
 
@@ -48,6 +62,7 @@ class FluidParticleManager
 		ci::Vec2f mInvWindowSize;
 
 		const ciMsaFluidSolver *mSolver;
+		const ciMsaFluidSnapshot *mSnapshot;
 
 		static float sAging;
 
@@ -58,6 +73,11 @@ class FluidParticleManager
 		float mPositions[ MAX_PARTICLES * 2 * 2 ];
 		float mColors[ MAX_PARTICLES * 4 * 2 ];
 		FluidParticle mParticles[ MAX_PARTICLES ];
+
+		// live particles of the last update, their normalized positions and the sampled fluid velocities
+		int mAlive[ MAX_PARTICLES ];
+		float mSampleX[ MAX_PARTICLES ], mSampleY[ MAX_PARTICLES ];
+		float mFluidVelX[ MAX_PARTICLES ], mFluidVelY[ MAX_PARTICLES ];
 };
 
 
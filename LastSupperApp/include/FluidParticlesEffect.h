@@ -1,10 +1,12 @@
 #pragma once
 
+#include <deque>
 #include <string>
 
 #include "cinder/gl/Texture.h"
 
 #include "ciMsaFluidDrawerGl.h"
+#include "ciMsaFluidSimThread.h"
 #include "ciMsaFluidSolver.h"
 #include "CinderOpenCV.h"
 
@@ -64,15 +66,83 @@ class FluidParticlesEffect : public Effect
 
 		ciMsaFluidSolver mFluidSolver;
 		ciMsaFluidDrawerGl mFluidDrawer;
+		ciMsaFluidSimThread mFluidSimThread; // stopped before the solver is destroyed
+		bool mFluidThreaded;
+		float mFluidSimRate;
+		int mFluidDroppedInjections;
+
+		// solver parameters, copied for the simulation thread
+		struct FluidSolverParams
+		{
+			int width, height;
+			float fadeSpeed, deltaT, viscosity, colorDiffusion;
+			int dyeScale;
+			bool vorticityConfinement, fusedAdvection;
+			bool flushDenormals;
+			bool wrapX, wrapY;
+			int projectionSolver, multigridCycles, diffusionSolver;
+			float solverTolerance;
+			bool spectralProjection;
+			bool warmStart;
+			int simdLevel, threads;
+			bool deterministic;
+			bool stageTimers, activeTiles;
+			bool adaptiveIterations;
+			float targetResidual;
+			int minIterations, maxIterations;
+			bool regionOfInterest;
+			ci::Rectf regionRect;
+			int regionMargin;
+
+			void apply( ciMsaFluidSolver &solver ) const;
+		};
+		FluidSolverParams getFluidSolverParams() const;
+		void resetFluid();
+
+		// saved in the per user application data, restored on instantiate
+		bool mFluidRestoreState;
+		float mFluidSaveInterval; // seconds, 0 disables the periodic save
+		double mFluidLastSaveTime;
+		void saveFluidState();
+		bool loadFluidState();
 
 		int mFluidWidth, mFluidHeight;
+		int mFluidDyeScale;
 		float mFluidFadeSpeed;
 		float mFluidDeltaT;
 		float mFluidViscosity;
+		float mFluidColorDiffusion;
 		bool mFluidVorticityConfinement;
+		bool mFluidFusedAdvection;
+		bool mFluidFlushDenormals;
 		bool mFluidWrapX, mFluidWrapY;
+		int mFluidProjectionSolver;
+		int mFluidMultigridCycles;
+		int mFluidDiffusionSolver;
+		float mFluidSolverTolerance;
+		bool mFluidSpectralProjection;
+		bool mFluidWarmStart;
+		int mFluidSimdLevel;
+		int mFluidThreads;
+		bool mFluidDeterministic;
+		bool mFluidStageTimers;
+		ciMsaFluidStageCounters mFluidStageCounters[ FLUID_STAGE_COUNT ]; // of the last step, shown in the params
+		float mFluidStageKCells[ FLUID_STAGE_COUNT ];
+		float mFluidSolverTime; // sum of the stage times
+		bool mFluidActiveTiles;
+		int mFluidNumActiveTiles;
+		bool mFluidRegionOfInterest; // the solver only simulates the clip rect
+		int mFluidRegionMargin;
+		bool mFluidAdaptiveIterations;
+		float mFluidTargetResidual;
+		int mFluidMinIterations, mFluidMaxIterations;
+		int mFluidFrameIterations;
+		float mFluidFrameResidual;
+		std::deque< int > mFluidIterationHistory; // solver sweeps of the last frames, graphed in the control window
+		void drawIterationGraph( const ci::Rectf &rect );
 		float mFluidVelocityMult;
 		float mFluidColorMult;
+		bool mFluidBilinearSplat;
 		ci::Color mFluidColor;
 
 		// particles
@@ -1,8 +1,18 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
 #include "cinder/CinderMath.h"
 #include "cinder/app/app.h"
 #include "cinder/gl/gl.h"
 #include "cinder/Rand.h"
 
+#include "ciMsaFluidDenormalGuard.h"
 #include "FluidParticles.h"
 
 using namespace ci;
@@ -25,9 +35,9 @@ FluidParticle::FluidParticle( const Vec2f &pos )
 	mMass = Rand::randFloat( 0.1f, 1 );
 }
 
-void FluidParticle::update( double time, const ciMsaFluidSolver *solver, const Vec2f &windowSize, const Vec2f &invWindowSize, float *positions, float *colors )
+void FluidParticle::update( double time, const Vec2f &fluidVel, const Vec2f &windowSize, float *positions, float *colors )
 {
-	mVel = solver->getVelocityAtPos( mPos * invWindowSize ) * (mMass * sFluidForce ) * windowSize + mVel * sMomentum;
+	mVel = fluidVel * (mMass * sFluidForce ) * windowSize + mVel * sMomentum;
 
 	/*
 	if ( mVel.lengthSquared() < 10 )
@@ -62,8 +72,22 @@ void FluidParticle::update( double time, const ciMsaFluidSolver *solver, const V
 
 float FluidParticleManager::sAging = 0.995f;
 
+// file of FluidParticleManager::saveState(), the header followed by count particles as they are in memory
+#define PARTICLES_STATE_MAGIC 0x54504c46 // "FLPT"
+#define PARTICLES_STATE_VERSION 1
+
+struct ParticlesStateHeader
+{
+	uint32_t magic, version;
+	uint32_t particleSize;
+	int32_t windowWidth, windowHeight;
+	int32_t count;
+};
+
 FluidParticleManager::FluidParticleManager()
-	: mCurrent( 0 ),
+	: mSolver( NULL ),
+	  mSnapshot( NULL ),
+	  mCurrent( 0 ),
 	  mActive( 0 )
 {
 	setWindowSize( Vec2i( 1, 1 ) );
@@ -75,21 +99,105 @@ void FluidParticleManager::setWindowSize( Vec2i winSize )
 	mInvWindowSize = Vec2f( 1.0f / winSize.x, 1.0f / winSize.y );
 }
 
-void FluidParticleManager::update( double seconds )
+void FluidParticleManager::update( double seconds, bool flushDenormals )
 {
-	int j = 0;
-	mActive = 0;
+	// the particle velocities decay with the momentum and run into denormals as well
+	ciMsaFluidDenormalGuard denormalGuard( flushDenormals );
+
+	// the positions of the live particles are sampled in one batch, bilinearly between the cell centers,
+	// so the motion stays smooth on a coarse grid (a snapshot is empty until the first step of the simulation thread)
+	ciMsaFluidFieldView view = mSnapshot ? mSnapshot->getFieldView() : mSolver->getFieldView();
+	int numAlive = 0;
 	for ( int i = 0; i < MAX_PARTICLES; i++ )
 	{
 		if ( mParticles[i].isAlive() )
 		{
-			mParticles[i].update( seconds, mSolver,
-					mWindowSize, mInvWindowSize,
-					&mPositions[j * 2],
-					&mColors[j * 4]);
-			j += 2;
-			mActive++;
+			mAlive[ numAlive ] = i;
+			mSampleX[ numAlive ] = mParticles[i].getPos().x * mInvWindowSize.x;
+			mSampleY[ numAlive ] = mParticles[i].getPos().y * mInvWindowSize.y;
+			numAlive++;
+		}
+	}
+	if ( view.isValid() )
+		view.getVelocitiesAtPos( mSampleX, mSampleY, mFluidVelX, mFluidVelY, numAlive );
+	else
+	{
+		std::fill( mFluidVelX, mFluidVelX + numAlive, 0.0f );
+		std::fill( mFluidVelY, mFluidVelY + numAlive, 0.0f );
+	}
+
+	for ( int k = 0; k < numAlive; k++ )
+	{
+		mParticles[ mAlive[k] ].update( seconds, Vec2f( mFluidVelX[k], mFluidVelY[k] ),
+				mWindowSize,
+				&mPositions[k * 4],
+				&mColors[k * 8]);
+	}
+	mActive = numAlive;
+}
+
+bool FluidParticleManager::saveState( const std::string &path ) const
+{
+	int count = 0;
+	for ( int i = 0; i < MAX_PARTICLES; i++ )
+		count += mParticles[i].isAlive() ? 1 : 0;
+
+	ParticlesStateHeader header = { PARTICLES_STATE_MAGIC, PARTICLES_STATE_VERSION, sizeof( FluidParticle ),
+		mWindowSize.x, mWindowSize.y, count };
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream file( tmpPath.c_str(), std::ios::binary | std::ios::trunc );
+		if ( !file )
+			return false;
+		file.write( reinterpret_cast< const char * >( &header ), sizeof( header ) );
+		for ( int i = 0; i < MAX_PARTICLES; i++ )
+		{
+			if ( mParticles[i].isAlive() )
+				file.write( reinterpret_cast< const char * >( &mParticles[i] ), sizeof( FluidParticle ) );
 		}
+		file.close();
+		if ( file.fail() )
+			return false;
+	}
+
+	// the previous file stays until the new one is complete
+	if ( std::rename( tmpPath.c_str(), path.c_str() ) != 0 )
+	{
+		std::remove( path.c_str() );
+		return std::rename( tmpPath.c_str(), path.c_str() ) == 0;
+	}
+	return true;
+}
+
+bool FluidParticleManager::loadState( const std::string &path )
+{
+	try
+	{
+		boost::interprocess::file_mapping file( path.c_str(), boost::interprocess::read_only );
+		boost::interprocess::mapped_region region( file, boost::interprocess::read_only );
+		const char *data = static_cast< const char * >( region.get_address() );
+		size_t size = region.get_size();
+
+		ParticlesStateHeader header;
+		if ( size < sizeof( header ) )
+			return false;
+		memcpy( &header, data, sizeof( header ) );
+		if ( ( header.magic != PARTICLES_STATE_MAGIC ) || ( header.version != PARTICLES_STATE_VERSION ) ||
+			 ( header.particleSize != sizeof( FluidParticle ) ) ||
+			 ( header.windowWidth != mWindowSize.x ) || ( header.windowHeight != mWindowSize.y ) ||
+			 ( header.count < 0 ) || ( header.count > MAX_PARTICLES ) ||
+			 ( size != sizeof( header ) + header.count * sizeof( FluidParticle ) ) )
+			return false;
+
+		memcpy( mParticles, data + sizeof( header ), header.count * sizeof( FluidParticle ) );
+		std::fill( mParticles + header.count, mParticles + MAX_PARTICLES, FluidParticle() );
+		mCurrent = header.count & ( MAX_PARTICLES - 1 );
+		mActive = 0;
+		return true;
+	}
+	catch ( const boost::interprocess::interprocess_exception & )
+	{
+		return false;
 	}
 }
 
@@ -15,6 +15,7 @@
  along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstdlib>
 #include <vector>
 
 #include <boost/assign/std/vector.hpp>
@@ -23,6 +24,7 @@
 #include "cinder/gl/gl.h"
 #include "cinder/ip/Resize.h"
 #include "cinder/Rand.h"
+#include "cinder/Utilities.h"
 
 #include "FluidParticlesEffect.h"
 #include "GlobalData.h"
@@ -90,23 +92,81 @@ void FluidParticlesEffect::setup()
 
 	// fluid
 	mParams.addText( "Fluid" );
-	mParams.addPersistentParam( "Fluid width", &mFluidWidth, 160, "min=16 max=512", true );
-	mParams.addPersistentParam( "Fluid height", &mFluidHeight, 120, "min=16 max=512", true );
+	mParams.addPersistentParam( "Fluid width", &mFluidWidth, 160, "min=16 max=512" );
+	mParams.addPersistentParam( "Fluid height", &mFluidHeight, 120, "min=16 max=512" );
+	mParams.addPersistentParam( "Dye scale", &mFluidDyeScale, 1, "min=1 max=4" );
 	mParams.addPersistentParam( "Fade speed", &mFluidFadeSpeed, 0.012f, "min=0 max=1 step=0.0005" );
 	mParams.addPersistentParam( "Viscosity", &mFluidViscosity, 0.00003f, "min=0 max=1 step=0.00001" );
+	mParams.addPersistentParam( "Color diffusion", &mFluidColorDiffusion, 0.f, "min=0 max=0.01 step=0.00001" );
 	mParams.addPersistentParam( "Delta t", &mFluidDeltaT, 0.4f, "min=0 max=10 step=0.05" );
 	mParams.addPersistentParam( "Vorticity confinement", &mFluidVorticityConfinement, false );
+	mParams.addPersistentParam( "Fused advection", &mFluidFusedAdvection, true );
+	mParams.addPersistentParam( "Flush denormals", &mFluidFlushDenormals, true );
+	vector< string > projectionSolverNames;
+	projectionSolverNames += "Gauss-Seidel", "Multigrid";
+	mParams.addPersistentParam( "Pressure solver", projectionSolverNames, &mFluidProjectionSolver, FLUID_PROJECTION_GAUSS_SEIDEL );
+	mParams.addPersistentParam( "Multigrid cycles", &mFluidMultigridCycles, FLUID_DEFAULT_MULTIGRID_CYCLES, "min=1 max=50" );
+	vector< string > diffusionSolverNames;
+	diffusionSolverNames += "Gauss-Seidel", "Fast";
+	mFluidDiffusionSolver = FLUID_DIFFUSION_FAST;
+	mParams.addParam( "Diffusion solver", diffusionSolverNames, &mFluidDiffusionSolver );
+	mParams.addPersistentParam( "Solver tolerance", &mFluidSolverTolerance, FLUID_DEFAULT_SOLVER_TOLERANCE, "min=0.00001 max=0.1 step=0.00005" );
+	mParams.addPersistentParam( "Spectral projection", &mFluidSpectralProjection, true );
+	mParams.addPersistentParam( "Warm start", &mFluidWarmStart, true );
+	vector< string > simdNames;
+	simdNames += "Off", "SSE2", "AVX2";
+	mFluidSimdLevel = ciMsaFluidKernels::detectSimdLevel();
+	mParams.addParam( "SIMD", simdNames, &mFluidSimdLevel );
+	mParams.addPersistentParam( "Fluid threads", &mFluidThreads, ciMsaFluidThreadPool::getHardwareConcurrency(), "min=1 max=32" );
+	mParams.addPersistentParam( "Deterministic", &mFluidDeterministic, false );
+	mFluidStageTimers = false;
+	mParams.addParam( "Stage timers", &mFluidStageTimers );
+	mFluidSolverTime = 0.f;
+	mParams.addParam( "Solver ms", &mFluidSolverTime, "", true );
+	for ( int i = 0; i < FLUID_STAGE_COUNT; i++ )
+	{
+		// live breakdown of the last step, zero while the stage timers are off
+		string name = ciMsaFluidSolver::getStageName( i );
+		mFluidStageKCells[ i ] = 0.f;
+		mParams.addParam( "ms " + name, &mFluidStageCounters[ i ].time, "", true );
+		mParams.addParam( "Speedup " + name, &mFluidStageCounters[ i ].speedup, "", true );
+		mParams.addParam( "Kcells " + name, &mFluidStageKCells[ i ], "", true );
+		mParams.addParam( "Iterations " + name, &mFluidStageCounters[ i ].iterations, "", true );
+	}
+	mParams.addPersistentParam( "Active tiles", &mFluidActiveTiles, false );
+	mFluidNumActiveTiles = 0;
+	mParams.addParam( "Active tile count", &mFluidNumActiveTiles, "", true );
+	mParams.addPersistentParam( "Region of interest", &mFluidRegionOfInterest, false );
+	mParams.addPersistentParam( "Region margin", &mFluidRegionMargin, FLUID_DEFAULT_ROI_MARGIN, "min=0 max=64" );
+	mParams.addPersistentParam( "Adaptive iterations", &mFluidAdaptiveIterations, false );
+	mParams.addPersistentParam( "Target residual", &mFluidTargetResidual, FLUID_DEFAULT_TARGET_RESIDUAL, "min=0.001 max=0.5 step=0.001" );
+	mParams.addPersistentParam( "Min iterations", &mFluidMinIterations, FLUID_DEFAULT_MIN_ITERATIONS, "min=0 max=100" );
+	mParams.addPersistentParam( "Max iterations", &mFluidMaxIterations, FLUID_DEFAULT_MAX_ITERATIONS, "min=1 max=200" );
+	mFluidFrameIterations = 0;
+	mParams.addParam( "Solver iterations", &mFluidFrameIterations, "", true );
+	mFluidFrameResidual = 0.f;
+	mParams.addParam( "Solver residual", &mFluidFrameResidual, "", true );
+	mParams.addPersistentParam( "Simulation thread", &mFluidThreaded, false );
+	mParams.addPersistentParam( "Simulation rate", &mFluidSimRate, FLUID_SIM_DEFAULT_RATE, "min=10 max=240 step=1" );
+	mFluidDroppedInjections = 0;
+	mParams.addParam( "Dropped injections", &mFluidDroppedInjections, "", true );
 	mParams.addPersistentParam( "Wrap x", &mFluidWrapX, true );
 	mParams.addPersistentParam( "Wrap y", &mFluidWrapY, true );
 	mParams.addPersistentParam( "Fluid color", &mFluidColor, Color( 1.f, 0.05f, 0.01f ) );
 	mParams.addPersistentParam( "Fluid velocity mult", &mFluidVelocityMult, 1.f, "min=0.02 max=50 step=0.02" );
 	mParams.addPersistentParam( "Fluid color mult", &mFluidColorMult, .5f, "min=0.05 max=10 step=0.05" );
+	mParams.addPersistentParam( "Bilinear splat", &mFluidBilinearSplat, false );
 
 	mFluidSolver.setup( mFluidWidth, mFluidHeight );
 	mFluidSolver.enableRGB( false );
 	mFluidSolver.setColorDiffusion( 0 );
 	mFluidDrawer.setup( &mFluidSolver );
-	mParams.addButton( "Reset fluid", [&]() { mFluidSolver.reset(); } );
+	mParams.addButton( "Reset fluid", [&]() { resetFluid(); } );
+	mParams.addButton( "Save fluid state", [&]() { saveFluidState(); } );
+	mParams.addButton( "Load fluid state", [&]() { loadFluidState(); } );
+	mParams.addPersistentParam( "Restore fluid state", &mFluidRestoreState, false );
+	mParams.addPersistentParam( "Save interval", &mFluidSaveInterval, 0.f, "min=0 max=3600 step=10" );
+	mFluidLastSaveTime = 0;
 
 	mParams.addSeparator();
 	mParams.addText("Post process");
@@ -130,7 +190,10 @@ void FluidParticlesEffect::setup()
 void FluidParticlesEffect::instantiate()
 {
 	mPrevFrame.release();
-	mFluidSolver.reset();
+	// starts from the last saved fluid instead of an empty one
+	if ( !mFluidRestoreState || !loadFluidState() )
+		resetFluid();
+	mFluidLastSaveTime = app::getElapsedSeconds();
 	mIsActive = true;
 }
 
@@ -145,6 +208,20 @@ void FluidParticlesEffect::update()
 
 	GlobalData &gd = GlobalData::get();
 
+	if ( mFluidThreaded != mFluidSimThread.isRunning() )
+	{
+		if ( mFluidThreaded )
+		{
+			// a force and a color for every flow cell in one frame
+			mFluidSimThread.setQueueSize( 2 * mOptFlowWidth * mOptFlowHeight );
+			mFluidSimThread.start( &mFluidSolver, mFluidSimRate );
+		}
+		else
+			mFluidSimThread.stop();
+	}
+	mFluidSimThread.setRate( mFluidSimRate );
+	mFluidDroppedInjections = mFluidSimThread.getDroppedInjections();
+
 	cv::Mat currentFrame;
 	bool newFrame = false;
 	if ( gd.mCaptureSource.isCapturing() && gd.mCaptureSource.checkNewFrame() )
@@ -223,15 +300,30 @@ void FluidParticlesEffect::update()
 			if ( ( maskRect.getWidth() > 0 ) && maskRect.getHeight() > 0 )
 			{
 				Area maskArea( maskRect );
-				for ( int y = maskArea.y1; y < maskArea.y2; y++ )
+				if ( mFluidEnabled )
 				{
-					for ( int x = maskArea.x1; x < maskArea.x2; x++ )
+					for ( int y = maskArea.y1; y < maskArea.y2; y++ )
 					{
-						Vec2f v = fromOcv( mFlow.at< cv::Point2f >( y, x ) );
-						Vec2f p( x + .5, y + .5 );
-						addToFluid( ofNorm.map( p ), ofNorm.map( v ) * mFlowMultiplier,
-								mFluidEnabled, mFluidEnabled, mFluidEnabled );
+						for ( int x = maskArea.x1; x < maskArea.x2; x++ )
+						{
+							Vec2f v = fromOcv( mFlow.at< cv::Point2f >( y, x ) );
+							Vec2f p( x + .5, y + .5 );
+							addToFluid( ofNorm.map( p ), ofNorm.map( v ) * mFlowMultiplier, true, false, false );
+						}
 					}
+
+					// the same forces and colors addToFluid would add, in one pass over the flow
+					const float *field = mFlow.ptr< float >( maskArea.y1 ) + 2 * maskArea.x1;
+					Rectf fieldRect = ofNorm.map( Rectf( maskArea ) );
+					float forceMult = mFlowMultiplier * mFluidVelocityMult;
+					Vec2f scale( forceMult / mFlow.cols, forceMult / mFlow.rows );
+					float minLength2 = 0.000001f * mFluidVelocityMult * mFluidVelocityMult;
+					if ( mFluidSimThread.isRunning() )
+						mFluidSimThread.addForceField( field, maskArea.getWidth(), maskArea.getHeight(), (int)mFlow.step1(), fieldRect,
+								scale, minLength2, mFluidColorMult, mFluidBilinearSplat );
+					else
+						mFluidSolver.addForceField( field, maskArea.getWidth(), maskArea.getHeight(), (int)mFlow.step1(), fieldRect,
+								scale, minLength2, mFluidColorMult, mFluidBilinearSplat );
 				}
 			}
 		}
@@ -241,7 +333,7 @@ void FluidParticlesEffect::update()
 	{
 		if ( lastState == STATE_INTERACTIVE )
 		{
-			mFluidSolver.reset();
+			resetFluid();
 			mFluidVorticityConfinement = false;
 			for ( int i = 0; i < 100; i++ )
 			{
@@ -272,15 +364,163 @@ void FluidParticlesEffect::update()
 	lastState = mState;
 
 	// fluid & particles
-	mFluidSolver.setFadeSpeed( mFluidFadeSpeed );
-	mFluidSolver.setDeltaT( mFluidDeltaT  );
-	mFluidSolver.setVisc( mFluidViscosity );
-	mFluidSolver.enableVorticityConfinement( mFluidVorticityConfinement );
-	mFluidSolver.setWrap( mFluidWrapX, mFluidWrapY );
-	mFluidSolver.update();
+	FluidSolverParams params = getFluidSolverParams();
+
+	if ( mFluidSimThread.isRunning() )
+	{
+		// the solver steps on its own, the particles and the drawer follow the latest step
+		mFluidSimThread.configure( [ params ]( ciMsaFluidSolver &solver ) { params.apply( solver ); } );
+		const ciMsaFluidSnapshot *snapshot = mFluidSimThread.acquireSnapshot();
+		mParticles.setFluidSnapshot( snapshot );
+		mFluidDrawer.setSnapshot( snapshot );
+
+		for ( int i = 0; i < FLUID_STAGE_COUNT; i++ )
+			mFluidStageCounters[ i ] = snapshot->getStageCounters( i );
+		mFluidNumActiveTiles = snapshot->getNumActiveTiles();
+		mFluidFrameIterations = snapshot->getFrameIterations();
+		mFluidFrameResidual = snapshot->getFrameResidual();
+	}
+	else
+	{
+		params.apply( mFluidSolver );
+		mFluidSolver.update();
+		mParticles.setFluidSnapshot( NULL );
+		mFluidDrawer.setSnapshot( NULL );
+
+		for ( int i = 0; i < FLUID_STAGE_COUNT; i++ )
+			mFluidStageCounters[ i ] = mFluidSolver.getStageCounters( i );
+		mFluidNumActiveTiles = mFluidSolver.getNumActiveTiles();
+		mFluidFrameIterations = mFluidSolver.getFrameIterations();
+		mFluidFrameResidual = mFluidSolver.getFrameResidual();
+	}
+	mFluidSolverTime = 0.f;
+	for ( int i = 0; i < FLUID_STAGE_COUNT; i++ )
+	{
+		mFluidSolverTime += mFluidStageCounters[ i ].time;
+		mFluidStageKCells[ i ] = mFluidStageCounters[ i ].cells / 1000.f;
+	}
+	mFluidIterationHistory.push_back( mFluidFrameIterations );
+	if ( mFluidIterationHistory.size() > 256 )
+		mFluidIterationHistory.pop_front();
 
 	mParticles.setAging( mParticleAging );
-	mParticles.update( app::getElapsedSeconds() );
+	mParticles.update( app::getElapsedSeconds(), mFluidFlushDenormals );
+
+	// for a restart after a crash
+	if ( ( mFluidSaveInterval > 0 ) && ( app::getElapsedSeconds() - mFluidLastSaveTime >= mFluidSaveInterval ) )
+		saveFluidState();
+}
+
+FluidParticlesEffect::FluidSolverParams FluidParticlesEffect::getFluidSolverParams() const
+{
+	FluidSolverParams params = { mFluidWidth, mFluidHeight,
+		mFluidFadeSpeed, mFluidDeltaT, mFluidViscosity, mFluidColorDiffusion,
+		mFluidDyeScale,
+		mFluidVorticityConfinement, mFluidFusedAdvection,
+		mFluidFlushDenormals,
+		mFluidWrapX, mFluidWrapY,
+		mFluidProjectionSolver, mFluidMultigridCycles, mFluidDiffusionSolver,
+		mFluidSolverTolerance,
+		mFluidSpectralProjection,
+		mFluidWarmStart,
+		mFluidSimdLevel, mFluidThreads,
+		mFluidDeterministic,
+		mFluidStageTimers, mFluidActiveTiles,
+		mFluidAdaptiveIterations,
+		mFluidTargetResidual,
+		mFluidMinIterations, mFluidMaxIterations,
+		mFluidRegionOfInterest, mOptFlowClipRectNorm, mFluidRegionMargin };
+	return params;
+}
+
+void FluidParticlesEffect::FluidSolverParams::apply( ciMsaFluidSolver &solver ) const
+{
+	// applied between two steps, the fields are resampled. the drawer and the particles
+	// pick up the new size from the solver or the next snapshot
+	if ( ( solver.getWidth() - 2 != width ) || ( solver.getHeight() - 2 != height ) )
+		solver.setSize( width, height );
+	solver.setFadeSpeed( fadeSpeed );
+	solver.setDeltaT( deltaT );
+	solver.setVisc( viscosity );
+	solver.setColorDiffusion( colorDiffusion );
+	solver.setDyeScale( dyeScale );
+	solver.enableVorticityConfinement( vorticityConfinement );
+	solver.enableFusedAdvection( fusedAdvection );
+	solver.enableFlushDenormals( flushDenormals );
+	solver.setWrap( wrapX, wrapY );
+	solver.setProjectionSolver( projectionSolver );
+	solver.setMultigridCycles( multigridCycles );
+	solver.setDiffusionSolver( diffusionSolver );
+	solver.setSolverTolerance( solverTolerance );
+	solver.enableSpectralProjection( spectralProjection );
+	solver.enableWarmStart( warmStart );
+	solver.setSimdLevel( simdLevel );
+	solver.setNumThreads( threads );
+	solver.enableDeterministic( deterministic );
+	solver.enableStageTimers( stageTimers );
+	solver.enableActiveTiles( activeTiles );
+	solver.enableAdaptiveIterations( adaptiveIterations );
+	solver.setAdaptiveIterations( targetResidual, minIterations, maxIterations );
+	solver.enableRegionOfInterest( regionOfInterest );
+	solver.setRegionOfInterest( regionRect, regionMargin );
+}
+
+void FluidParticlesEffect::resetFluid()
+{
+	if ( mFluidSimThread.isRunning() )
+		mFluidSimThread.reset();
+	else
+		mFluidSolver.reset();
+}
+
+// per user, the application directory is often not writable
+static fs::path getFluidStateDirectory()
+{
+#if defined( CINDER_MSW )
+	const char *appData = getenv( "APPDATA" );
+	fs::path dir = ( appData ? fs::path( appData ) : getHomeDirectory() ) / "LastSupper";
+#elif defined( CINDER_MAC )
+	fs::path dir = getHomeDirectory() / "Library" / "Application Support" / "LastSupper";
+#else
+	fs::path dir = getHomeDirectory() / ".lastsupper";
+#endif
+	boost::system::error_code error;
+	fs::create_directories( dir, error );
+	return dir;
+}
+
+void FluidParticlesEffect::saveFluidState()
+{
+	fs::path dir = getFluidStateDirectory();
+	string fluidPath = ( dir / "fluid-state.bin" ).string();
+	if ( mFluidSimThread.isRunning() )
+		mFluidSimThread.saveState( fluidPath );
+	else
+	if ( !mFluidSolver.saveState( fluidPath ) )
+		app::console() << "Unable to save fluid state: " << fluidPath << endl;
+	mParticles.saveState( ( dir / "fluid-particles.bin" ).string() );
+	mFluidLastSaveTime = app::getElapsedSeconds();
+}
+
+bool FluidParticlesEffect::loadFluidState()
+{
+	fs::path dir = getFluidStateDirectory();
+	fs::path fluidPath = dir / "fluid-state.bin";
+	// the simulation thread loads the file later, so it is checked here
+	if ( !ciMsaFluidSolver::isStateFile( fluidPath.string() ) )
+		return false;
+
+	if ( mFluidSimThread.isRunning() )
+		mFluidSimThread.loadState( fluidPath.string() );
+	else
+	{
+		// the dye scale of the parameters first, a new dye grid would start empty
+		getFluidSolverParams().apply( mFluidSolver );
+		if ( !mFluidSolver.loadState( fluidPath.string() ) )
+			return false;
+	}
+	mParticles.loadState( ( dir / "fluid-particles.bin" ).string() );
+	return true;
 }
 
 void FluidParticlesEffect::drawControl()
@@ -315,11 +555,42 @@ void FluidParticlesEffect::drawControl()
 			gl::color( Color::white() );
 			gl::disableAlphaBlending();
 		}
+
+		drawIterationGraph( Rectf( gd.mPreviewRect.x1, gd.mPreviewRect.y2 + 16,
+					gd.mPreviewRect.x2, gd.mPreviewRect.y2 + 16 + 64 ) );
 	}
 
 	mParams.draw();
 }
 
+void FluidParticlesEffect::drawIterationGraph( const Rectf &rect )
+{
+	int maxIterations = 1;
+	for ( auto it = mFluidIterationHistory.cbegin(); it != mFluidIterationHistory.cend(); ++it )
+		maxIterations = math< int >::max( maxIterations, *it );
+
+	gl::enableAlphaBlending();
+	gl::color( ColorA( 0.f, 0.f, 0.f, .5f ) );
+	gl::drawSolidRect( rect );
+	gl::color( Color::white() );
+	gl::drawStrokedRect( rect );
+
+	// newest frame on the right
+	gl::color( Color( 1.f, .8f, 0.f ) );
+	glBegin( GL_LINE_STRIP );
+	float step = rect.getWidth() / 255.f;
+	float x = rect.x2 - step * ( mFluidIterationHistory.size() - 1 );
+	for ( auto it = mFluidIterationHistory.cbegin(); it != mFluidIterationHistory.cend(); ++it, x += step )
+		gl::vertex( Vec2f( x, rect.y2 - rect.getHeight() * *it / (float)maxIterations ) );
+	glEnd();
+
+	gl::drawString( "Solver iterations " + toString( mFluidFrameIterations ) +
+			" (max " + toString( maxIterations ) + ") residual " + toString( mFluidFrameResidual ),
+			rect.getUpperLeft() + Vec2f( 4, 4 ) );
+	gl::color( Color::white() );
+	gl::disableAlphaBlending();
+}
+
 void FluidParticlesEffect::addToFluid( const Vec2f &pos, const Vec2f &vel, bool addParticles, bool addForce, bool addColor )
 {
 	Vec2f p;
@@ -341,11 +612,19 @@ void FluidParticlesEffect::addToFluid( const Vec2f &pos, const Vec2f &vel, bool
 			}
 		}
 		if ( addForce )
-			mFluidSolver.addForceAtPos( p, vel * mFluidVelocityMult );
+		{
+			if ( mFluidSimThread.isRunning() )
+				mFluidSimThread.addForceAtPos( p, vel * mFluidVelocityMult );
+			else
+				mFluidSolver.addForceAtPos( p, vel * mFluidVelocityMult );
+		}
 
 		if ( addColor )
 		{
-			mFluidSolver.addColorAtPos( p, Color::white() * mFluidColorMult );
+			if ( mFluidSimThread.isRunning() )
+				mFluidSimThread.addColorAtPos( p, Color::white() * mFluidColorMult );
+			else
+				mFluidSolver.addColorAtPos( p, Color::white() * mFluidColorMult );
 		}
 	}
 }